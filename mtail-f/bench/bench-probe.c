@@ -0,0 +1,278 @@
+/*
+ ============================================================================
+ Name        : bench-probe.c
+ Description : Latency probe for the mtail-f benchmarks.
+               Runs the command after -- (mtail-f and its options) with its
+               stdout on a pipe and reads the records bench-writer wrote:
+
+                   <seq> <ns> xxxx...\n
+
+               The latency of a record is the CLOCK_MONOTONIC time its
+               chunk was read at minus the time it was written at. The run
+               ends when no output came for the idle time, the command is
+               stopped with SIGTERM and its cpu time and peak RSS taken
+               from wait4(2).
+
+               Prints one JSON object with the results on stdout.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define DEFAULT_IDLE       1.0
+#define DEFAULT_TIMEOUT    60.0
+#define READ_SIZE          (256 * 1024)
+#define MAX_LINE           4096
+
+/*
+ * log-linear latency histogram: 2^SUB_BITS buckets per power of two
+ * of nanoseconds, percentiles are within 1/2^SUB_BITS of the truth
+ * */
+#define SUB_BITS           6
+#define SUB_COUNT          (1 << SUB_BITS)
+#define HIST_SIZE          ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+static uint64_t hist[HIST_SIZE];
+static uint64_t hist_count;
+static uint64_t lat_max;
+
+/* one bit per sequence number to tell missing and repeated records */
+static uint8_t *seen;
+static uint64_t seen_size;
+
+static uint64_t received, dups, bytes, skipped, max_seq;
+static uint64_t first_ns, last_ns;
+static long line_len;
+
+static uint64_t
+mono_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+hist_bucket (uint64_t v) {
+	int msb;
+	if (v < SUB_COUNT)
+		return (int)v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - SUB_BITS + 1) * SUB_COUNT +
+			(int)((v >> (msb - SUB_BITS)) - SUB_COUNT);
+}
+
+static uint64_t
+hist_value (int b) {
+	int shift = b / SUB_COUNT - 1;
+	if (b < SUB_COUNT)
+		return b;
+	/* upper edge of the bucket */
+	return ((uint64_t)(SUB_COUNT + b % SUB_COUNT + 1) << shift) - 1;
+}
+
+static double
+hist_percentile (double p) {
+	uint64_t rank = (uint64_t)(p * hist_count), sum = 0;
+	int b;
+	if (!hist_count)
+		return 0;
+	for (b = 0; b < HIST_SIZE; b++) {
+		sum += hist[b];
+		if (sum > rank)
+			return (hist_value(b) < lat_max ? hist_value(b) : lat_max) / 1e3;
+	}
+	return lat_max / 1e3;
+}
+
+static void
+seen_mark (uint64_t seq) {
+	if (seq >= seen_size * 8) {
+		uint64_t size = seen_size ? seen_size : 1 << 16;
+		while (seq >= size * 8)
+			size *= 2;
+		seen = realloc(seen, size);
+		memset(seen + seen_size, 0, size - seen_size);
+		seen_size = size;
+	}
+	if (seen[seq >> 3] & (1 << (seq & 7)))
+		dups++;
+	seen[seq >> 3] |= 1 << (seq & 7);
+	if (seq > max_seq)
+		max_seq = seq;
+}
+
+static void
+record (const char *p, const char *end, uint64_t now) {
+	uint64_t seq, ns;
+	char *q;
+	if (end - p >= MAX_LINE || !(*p >= '0' && *p <= '9') ||
+			(line_len && end + 1 - p != line_len)) {
+		/*
+		 * file name headers, records torn apart by output of another
+		 * file and anything else the writer didn't write
+		 * */
+		skipped++;
+		return;
+	}
+	seq = strtoull(p, &q, 10);
+	if (*q != ' ') {
+		skipped++;
+		return;
+	}
+	ns = strtoull(q + 1, &q, 10);
+	if (*q != ' ' || ns > now) {
+		skipped++;
+		return;
+	}
+	hist[hist_bucket(now - ns)]++;
+	hist_count++;
+	if (now - ns > lat_max)
+		lat_max = now - ns;
+	seen_mark(seq);
+	received++;
+}
+
+static void
+usage (char *prog) {
+	fprintf(stderr, "Usage: %s [options] -- command [args...]\n"
+			"  -i SECONDS  stop after this long without output (%.0f)\n"
+			"  -t SECONDS  stop after this long in any case (%.0f)\n"
+			"  -n COUNT    stop once COUNT records came\n"
+			"  -l BYTES    records are this long, count others as skipped\n",
+			prog, DEFAULT_IDLE, DEFAULT_TIMEOUT);
+}
+
+int
+main (int argc, char **argv) {
+	double idle = DEFAULT_IDLE, timeout = DEFAULT_TIMEOUT;
+	uint64_t expect = 0, start, now;
+	static char buf[READ_SIZE + MAX_LINE];
+	size_t have = 0;
+	struct rusage ru;
+	struct pollfd pfd;
+	int pipefd[2], status, c;
+	pid_t pid;
+	double cpu, secs, mb;
+
+	while ((c = getopt(argc, argv, "+i:t:n:l:")) != -1) {
+		switch (c) {
+		case 'i': idle = atof(optarg); break;
+		case 't': timeout = atof(optarg); break;
+		case 'n': expect = strtoull(optarg, NULL, 10); break;
+		case 'l': line_len = atol(optarg); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		_exit(127);
+	}
+	close(pipefd[1]);
+
+	start = last_ns = mono_ns();
+	pfd.fd = pipefd[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		ssize_t n;
+		char *p, *nl, *end;
+		int ret;
+
+		now = mono_ns();
+		if (now - start > timeout * 1e9)
+			break;
+		/* the idle clock starts with the first record */
+		if (received && now - last_ns > idle * 1e9)
+			break;
+		if (expect && received >= expect)
+			break;
+		ret = poll(&pfd, 1, 50);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret <= 0)
+			continue;
+		n = read(pipefd[0], buf + have, READ_SIZE);
+		if (n <= 0)
+			break;
+		now = mono_ns();
+		if (!first_ns)
+			first_ns = now;
+		last_ns = now;
+		bytes += n;
+		end = buf + have + n;
+		for (p = buf; (nl = memchr(p, '\n', end - p)); p = nl + 1)
+			record(p, nl, now);
+		have = end - p;
+		if (have >= MAX_LINE) {
+			skipped++;
+			have = 0;
+		}
+		memmove(buf, p, have);
+	}
+
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return 1;
+	}
+	close(pipefd[0]);
+
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	secs = first_ns ? (last_ns - first_ns) / 1e9 : 0;
+	mb = bytes / 1e6;
+
+	{
+		uint64_t unique = received - dups;
+		uint64_t missing = received ? max_seq + 1 - unique : 0;
+		printf("{\"received\":%llu,\"missing\":%llu,\"duplicates\":%llu,"
+				"\"skipped\":%llu,\"bytes\":%llu,\"seconds\":%.3f,"
+				"\"lines_per_s\":%.0f,"
+				"\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+				"\"p999\":%.1f,\"max\":%.1f},"
+				"\"cpu_s\":%.3f,\"user_s\":%.3f,\"sys_s\":%.3f,"
+				"\"cpu_ms_per_mb\":%.3f,\"rss_max_kb\":%ld}\n",
+				(unsigned long long)received, (unsigned long long)missing,
+				(unsigned long long)dups, (unsigned long long)skipped,
+				(unsigned long long)bytes, secs,
+				secs > 0 ? received / secs : 0,
+				hist_percentile(0.5), hist_percentile(0.9),
+				hist_percentile(0.99), hist_percentile(0.999),
+				lat_max / 1e3,
+				cpu, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+				ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+				mb > 0 ? cpu * 1e3 / mb : 0, ru.ru_maxrss);
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ ============================================================================
+ Name        : bench-writer.c
+ Description : Synthetic writer for the mtail-f benchmarks.
+               Pre-zeroes FILES log files of SIZE bytes, maps them and
+               snprintf's records into them the way a memory mapped logger
+               does, at RATE records per second spread over the files.
+
+               Every record starts with its sequence number and the
+               CLOCK_MONOTONIC time it was written at, so bench-probe can
+               tell the latency and the records that went missing:
+
+                   <seq> <ns> xxxx...\n
+
+               Prints one JSON object with what was written on stdout.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#define DEFAULT_RATE       100000
+#define DEFAULT_LINE       128
+#define DEFAULT_FILES      1
+#define DEFAULT_DURATION   5.0
+#define MIN_LINE           40
+
+/*
+ * records are written in bursts of this many microseconds,
+ * the writer sleeps in between once it is on schedule
+ * */
+#define TICK_US            200
+
+typedef struct {
+	char *map;
+	size_t size;
+	size_t off;
+} bench_file_t;
+
+static uint64_t
+mono_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+usage (char *prog) {
+	fprintf(stderr, "Usage: %s [options] prefix\n"
+			"  -r RATE     records per second over all files (%d, 0: as fast as possible)\n"
+			"  -l BYTES    record length including the newline (%d)\n"
+			"  -f FILES    number of files, written round robin (%d)\n"
+			"  -t SECONDS  how long to write (%.0f)\n"
+			"  -s BYTES    size of each file (default: enough for the run)\n"
+			"  -w SECONDS  wait this long after creating the files (0)\n"
+			"files are named prefix.0, prefix.1, ...\n",
+			prog, DEFAULT_RATE, DEFAULT_LINE, DEFAULT_FILES, DEFAULT_DURATION);
+}
+
+static bool
+bench_file_open (bench_file_t *bf, const char *name, size_t size) {
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(name);
+		return false;
+	}
+	/*
+	 * ftruncate gives a sparse file which reads as zeroes,
+	 * exactly what a pre-allocated mmap log looks like
+	 * */
+	if (ftruncate(fd, size) < 0) {
+		perror(name);
+		close(fd);
+		return false;
+	}
+	bf->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (bf->map == MAP_FAILED) {
+		perror(name);
+		return false;
+	}
+	bf->size = size;
+	bf->off = 0;
+	return true;
+}
+
+int
+main (int argc, char **argv) {
+	long rate = DEFAULT_RATE;
+	int line = DEFAULT_LINE;
+	int nfiles = DEFAULT_FILES;
+	double duration = DEFAULT_DURATION;
+	double wait = 0;
+	size_t size = 0;
+	bench_file_t *files;
+	char pad[4096];
+	char name[4096];
+	uint64_t start, end, now, seq = 0, full = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "r:l:f:t:s:w:")) != -1) {
+		switch (c) {
+		case 'r': rate = atol(optarg); break;
+		case 'l': line = atoi(optarg); break;
+		case 'f': nfiles = atoi(optarg); break;
+		case 't': duration = atof(optarg); break;
+		case 's': size = strtoull(optarg, NULL, 0); break;
+		case 'w': wait = atof(optarg); break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1 || nfiles < 1 || rate < 0 || duration <= 0 ||
+			line < MIN_LINE || line > (int)sizeof(pad)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!size) {
+		/*
+		 * room for the whole run with some slack, unpaced runs
+		 * stop early when the files fill up
+		 * */
+		double total = (rate ? rate : 2000000) * duration * line;
+		size = (size_t)(total / nfiles * 1.1) + (1 << 20);
+	}
+
+	files = calloc(nfiles, sizeof(*files));
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "%s.%d", argv[optind], i);
+		if (!bench_file_open(&files[i], name, size))
+			return 1;
+	}
+	memset(pad, 'x', sizeof(pad));
+	if (wait > 0)
+		usleep((useconds_t)(wait * 1e6));
+
+	start = mono_ns();
+	end = start + (uint64_t)(duration * 1e9);
+	i = 0;
+	while ((now = mono_ns()) < end && full < (uint64_t)nfiles) {
+		/* records due by now, a lagging writer catches up in one burst */
+		uint64_t due = rate ?
+				(uint64_t)((double)(now - start) * rate / 1e9 + 1) : seq + 1024;
+		if (seq >= due) {
+			usleep(TICK_US);
+			continue;
+		}
+		while (seq < due && full < (uint64_t)nfiles) {
+			bench_file_t *bf = &files[i];
+			int head;
+			i = (i + 1) % nfiles;
+			if (!bf->map)
+				continue;
+			if (bf->off + line >= bf->size) {
+				/* keep the trailing zero so the file never looks complete */
+				bf->map = NULL;
+				full++;
+				continue;
+			}
+			/*
+			 * format straight into the mapping, the record becomes
+			 * visible to the reader byte by byte like with any logger
+			 * */
+			head = snprintf(bf->map + bf->off, line, "%llu %llu ",
+					(unsigned long long)seq, (unsigned long long)mono_ns());
+			memcpy(bf->map + bf->off + head, pad, line - head - 1);
+			bf->map[bf->off + line - 1] = '\n';
+			bf->off += line;
+			seq++;
+		}
+	}
+	now = mono_ns();
+
+	printf("{\"written\":%llu,\"files\":%d,\"line\":%d,\"rate\":%ld,"
+			"\"seconds\":%.3f,\"achieved\":%.0f,\"full\":%llu}\n",
+			(unsigned long long)seq, nfiles, line, rate,
+			(now - start) / 1e9, seq / ((now - start) / 1e9),
+			(unsigned long long)full);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Runs bench-writer and mtail-f under bench-probe for each engine and
+# prints the results as a JSON array, one object per run.
+#
+# usage: run.sh [-r RATE] [-l BYTES] [-f FILES] [-t SECONDS] [-d DIR]
+#               [-x MTAIL_F] [-s] [-p P99_US] [-e 'NAME:OPTIONS']...
+#
+#   -r  records per second over all files (100000)
+#   -l  record length (128)
+#   -f  number of files (1)
+#   -t  seconds to write (5)
+#   -d  directory the files are written in ($TMPDIR or /tmp)
+#   -x  mtail-f binary (./mtail-f)
+#   -s  sweep: double the rate from -r until the engine falls behind,
+#       loses records or its p99 latency exceeds -p, and report the
+#       last rate it kept up with as "sustained"
+#   -p  p99 latency limit for -s in microseconds (10000)
+#   -e  engine to run, NAME and the mtail-f options for it, may be
+#       repeated (default: 'stdio:' 'mmap:--mmap')
+#
+# example: ./run.sh -r 200000 -f 4 -e 'mmap:--mmap' -e 'mmap-j4:--mmap -j 4'
+#
+
+rate=100000
+line=128
+files=1
+seconds=5
+dir=${TMPDIR:-/tmp}
+mtailf=./mtail-f
+sweep=0
+p99_limit=10000
+engines=
+
+bench=$(dirname "$0")
+
+while getopts r:l:f:t:d:x:sp:e: opt; do
+	case $opt in
+	r) rate=$OPTARG ;;
+	l) line=$OPTARG ;;
+	f) files=$OPTARG ;;
+	t) seconds=$OPTARG ;;
+	d) dir=$OPTARG ;;
+	x) mtailf=$OPTARG ;;
+	s) sweep=1 ;;
+	p) p99_limit=$OPTARG ;;
+	e) engines="$engines$OPTARG
+" ;;
+	*) sed -n '3,23s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+	esac
+done
+[ -n "$engines" ] || engines='stdio:
+mmap:--mmap
+'
+
+work=$(mktemp -d "$dir/mtail-f-bench.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# field NAME of the flat JSON object in $2
+field () {
+	printf '%s\n' "$2" | sed -n "s/.*\"$1\":\([^,}]*\).*/\1/p"
+}
+
+# run_one NAME OPTIONS RATE: prints the JSON object of one run
+run_one () {
+	rm -f "$work"/log.*
+	"$bench/bench-writer" -r "$3" -l "$line" -f "$files" -t "$seconds" \
+		-w 0.5 "$work/log" > "$work/writer.json" &
+	writer=$!
+	# the files exist before the writer starts writing
+	i=0
+	while [ ! -e "$work/log.$((files - 1))" ] && [ $i -lt 50 ]; do
+		sleep 0.01
+		i=$((i + 1))
+	done
+	names=$(i=0; while [ $i -lt "$files" ]; do
+		printf '%s ' "$work/log.$i"; i=$((i + 1)); done)
+	# shellcheck disable=SC2086
+	probe=$("$bench/bench-probe" -l "$line" -t $((${seconds%.*} + 30)) -- \
+		"$mtailf" -q $2 $names)
+	wait $writer
+	w=$(cat "$work/writer.json")
+	written=$(field written "$w")
+	unique=$(( $(field received "$probe") - $(field duplicates "$probe") ))
+	printf '{"engine":"%s","options":"%s","writer":%s,"probe":%s,"lost":%d}' \
+		"$1" "$2" "$w" "$probe" $((written - unique))
+}
+
+# keeps_up JSON: the engine got everything within the latency limit
+keeps_up () {
+	p99=$(printf '%s\n' "$1" | sed -n 's/.*"p99":\([^,}]*\).*/\1/p')
+	achieved=$(field achieved "$1")
+	[ "$(field lost "$1")" -eq 0 ] &&
+		awk "BEGIN { exit !($p99 <= $p99_limit && $achieved >= 0.95 * $2) }"
+}
+
+sep=
+printf '[\n'
+printf '%s' "$engines" | while IFS= read -r engine; do
+	[ -n "$engine" ] || continue
+	name=${engine%%:*}
+	opts=${engine#*:}
+	if [ $sweep -eq 0 ]; then
+		printf '%s%s' "$sep" "$(run_one "$name" "$opts" "$rate")"
+	else
+		r=$rate
+		sustained=0
+		while :; do
+			res=$(run_one "$name" "$opts" "$r")
+			printf '%s%s' "$sep" "$res"
+			sep=',
+'
+			keeps_up "$res" "$r" || break
+			sustained=$r
+			r=$((r * 2))
+		done
+		printf '%s{"engine":"%s","options":"%s","sustained":%d}' \
+			"$sep" "$name" "$opts" $sustained
+	fi
+	sep=',
+'
+done
+printf '\n]\n'
@@ -29,7 +29,11 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE /* memrchr */
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -37,18 +41,142 @@
 #include <string.h>
 #include <unistd.h>
 #include <glob.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /* chunks of data to read at a time from files */
 #define BUF_CHUNK_SIZE 4096
 
+/* delim positions collected per scan kernel call */
+#define SCAN_BATCH 1024
+
+/* adaptive scheduler: timer wheel of idle files */
+#define SCHED_SLOTS 1024        /* wheel slots, one tick each */
+#define SCHED_TICK_US 1000      /* wheel granularity */
+#define SCHED_HOT_IDLE_POLLS 4  /* empty polls before a hot file goes idle */
+#define SCHED_STATS_INTERVAL_US 10000000 /* -v statistics dump period */
+
+/* counters of one file or thread get a cache line of their own */
+#define STATS_ALIGN 64
+
+/* output stage: flush a batch early once it holds this much */
+#define OUT_MAX_SEGS 1024
+#define OUT_MAX_BYTES (4*1024*1024)
+/* -j: batches a reader may have queued before it waits for the writer */
+#define OUT_MAX_INFLIGHT 8
+/* --max-lag catch-up: batches may grow this many times bigger */
+#define OUT_CATCHUP_SCALE 4
+/* --uring: reads per pass and their size, one registered buffer each */
+#define URING_ENTRIES 64
+#define URING_CHUNK (64*1024)
+/* --zerocopy: smaller writes are cheaper to copy than to pin */
+#define ZEROCOPY_MIN (64*1024)
+/* -n +K through a filter: chunks handed to each backfill thread */
+#define BACKFILL_CHUNK (4*1024*1024)
+#define BACKFILL_MIN (4*BACKFILL_CHUNK)
+#define BACKFILL_MAX_THREADS 16
+/* --serve: layout version and entries of the shared index */
+#define SERVE_MAGIC 0x766573666c69746dULL
+#define SERVE_VERSION 1
+#define SERVE_ENTRIES (64*1024)
+
+/*
+ * mmap engine: page tables are populated this far ahead of the cursor,
+ * emitted pages are dropped from the mapping once they are further behind
+ * than the output may still hold, in steps
+ * */
+#define MAP_PREFAULT (2*1024*1024)
+#define MAP_RECLAIM_BEHIND (OUT_MAX_INFLIGHT*OUT_MAX_BYTES)
+#define MAP_RECLAIM_STEP (16*1024*1024)
+/* --map-window: windows start at huge page boundaries */
+#define MAP_WINDOW_ALIGN (2*1024*1024)
+#define MAP_WINDOW_MIN (4*MAP_WINDOW_ALIGN)
+#if UINTPTR_MAX > 0xffffffff
+#define MAP_WINDOW_DEFAULT 0 /* whole files */
+#else
+#define MAP_WINDOW_DEFAULT (256*1024*1024)
+#endif
+
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* ring-log mode: bytes copied out of the ring and validated at a time */
+#define RING_CHUNK (64*1024)
+/* ring-log mode without a header: bytes at the start compared for a wrap */
+#define RING_SAMPLE 64
+
+/* -r: files that can be followed at the same time, see --max-files */
+#define DISCOVERY_MAX_FILES 4096
+
 /* longest cmdline arg size */
 #define MAX_ARG_SIZE 1024
 
+/* -p: passes over all files once the process exited, see follower_drain */
+#define DRAIN_MAX_PASSES 16
+
 /* wrapper to control verbose debug logs sent to stderr used with -v option */
 #define dbg_printf(format, ...) do {                                            \
-	if(debug) { fprintf (stderr, format, __VA_ARGS__); } else {}              \
+	if(__builtin_expect(debug, 0)) { fprintf (stderr, format, __VA_ARGS__); } \
 } while(0)
 
+/*
+ * --ring-header: where a ring-log writer publishes its position. woff is
+ * the offset in the data area the next byte goes to, gen counts the wraps.
+ * Without gen, woff is taken as a running byte count.
+ * */
+typedef struct ring_layout_ {
+	bool header;       /* false: detect the wraps heuristically */
+	size_t woff_off;   /* offset of the write offset field in the file */
+	int woff_width;    /* 4 or 8 bytes, native byte order */
+	size_t gen_off;
+	int gen_width;     /* 0 if there is no generation field */
+	size_t data_off;   /* start of the data area */
+	size_t size;       /* size of the data area, 0 up to the end of file */
+} ring_layout_t;
+
 /*
  * parameters used to control the behavior of mtail
  *
@@ -56,7 +184,8 @@
 typedef struct mtail_params_ {
 	int num_lines; /* mtail-f -n <> print only last n lines*/
 	int watch_pid; /* follow until this pid is alive */
-	int delay_seconds; /* interval before files are inspected for changes */
+	long delay_us; /* interval before files are inspected for changes */
+	long poll_min_us; /* adaptive polling starts at this interval */
 	bool verbose; /* debug flag to print details to stderr */
 	bool quiet; /* don't output file name headers */
 	bool lines_from_start; /* read from start rather than end (taif -n +10) */
@@ -65,20 +194,128 @@ typedef struct mtail_params_ {
 	int num_files;
 	char delim; /* default delim is \n, specify delimiter to read */
 	char end_marker; /* mmap file is usually NULL filled */
+	/* --file-delims: delim and end_marker of the files matching a glob */
+	struct file_delims_ *file_delims;
+	int num_file_delims;
+	char *delims;      /* per slot: the delim of the file in it */
+	char *end_markers; /* per slot: its end_marker */
+	bool use_mmap; /* --mmap: map files and follow them without stdio */
+	bool use_uring; /* --uring: batched reads through io_uring */
+	const char *scan_kernel; /* --scan-kernel: force a scan kernel by name */
+	int wakeup; /* WAKEUP_*, how we wait between passes */
+	long batch_latency_us; /* longest time output may be held back */
+	bool no_splice; /* never vmsplice into a pipe on stdout */
+	size_t max_buffer; /* memory ceiling per file for the -n ring buffer */
+	int threads; /* -j: number of reader threads */
+	bool merge; /* --merge: order records across files by timestamp */
+	long merge_window_us; /* how long records wait for earlier ones */
+	const char *merge_ts; /* timestamp format at the start of each record */
+	long check_us; /* rotation/truncation check interval, 0 to disable */
+	bool ring; /* --ring: the files are circular logs */
+	ring_layout_t ring_layout;
+	int commit; /* COMMIT_*, --commit */
+	size_t commit_word_off; /* COMMIT_OFFSET: where the committed offset is */
+	int commit_word_width;
+	size_t commit_data_off; /* start of the records */
+	char **patterns; /* -e/-f: print only records matching one of these */
+	int num_patterns;
+	int max_files; /* slots in files and everything per file */
+	long rescan_us; /* -r: how often the glob is evaluated again */
+	const char *state_file; /* --state-file: cursors to resume from */
+	long state_interval_us; /* how often the state file is written */
+	int format; /* FORMAT_*, --format */
+	const char *sink_url; /* --sink: tcp:// or unix:// instead of stdout */
+	bool zerocopy; /* --zerocopy: MSG_ZEROCOPY for mapped runs */
+	const char *compress; /* --compress: codec of the output stream */
+	int compress_level; /* --compress-level, -1 for the codec default */
+	const char *stats_file; /* --stats-file: counters are dumped here */
+	long stats_interval_us; /* how often the stats file is rewritten */
+	size_t max_lag; /* --max-lag: bytes a file may be behind, 0 for any */
+	bool lag_skip; /* --on-lag=skip: jump to the last lines past max_lag */
+	int lag_lines; /* lines kept when skipping */
+	size_t map_window; /* --map-window: bytes mapped per file, 0 for all */
+	int multiline; /* MULTILINE_*, --multiline */
+	const char *multiline_re; /* MULTILINE_START: the first line of a record */
+	long multiline_timeout_us; /* a record nothing followed goes out then */
+	size_t max_record; /* --max-record: longest record put together */
+	int backfill_threads; /* --backfill-threads: for -n +K through filters */
+	const char *serve; /* --serve: publish what is emitted for --attach */
+	const char *attach; /* --attach: follow what a --serve instance emits */
 } mtail_params_t;
 
+/* --commit protocols, when a record counts as written */
+#define COMMIT_NONE      0 /* any byte other than the end marker */
+#define COMMIT_RECORD    1 /* up to the last delimiter */
+#define COMMIT_LENPREFIX 2 /* length word stored after the payload */
+#define COMMIT_OFFSET    3 /* committed offset published in a header word */
+
+/* --format of the output */
+#define FORMAT_TEXT   0 /* the records as they are, with ==> name <== */
+#define FORMAT_NDJSON 1 /* one JSON object per record */
+#define FORMAT_FRAME  2 /* binary frame_hdr_t, then the record */
+
+/* --multiline, which lines continue the record before them */
+#define MULTILINE_NONE   0 /* every line is a record */
+#define MULTILINE_INDENT 1 /* lines starting with a space or a tab */
+#define MULTILINE_START  2 /* lines that don't match the start regex */
+
+/* --wakeup backends, can be combined */
+#define WAKEUP_POLL    0x1 /* adaptive poll, backs off while idle */
+#define WAKEUP_INOTIFY 0x2 /* IN_MODIFY/IN_CLOSE_WRITE from write(2) writers */
+
 /*
- * array backed ring buffer to hold the last n lines of the file
- * for printing with -n option
+ * ring buffer to hold the last n lines of a non-seekable file for printing
+ * with -n option. The bytes live in one circular arena, an index ring of
+ * offset/length pairs points into it, so steady state does no allocation
+ * per line. The arena grows up to max_bytes, after that the oldest lines
+ * make room, and a single record longer than max_bytes is cut short.
  */
+typedef struct rb_line_ {
+	size_t off; /* start of the line in the arena */
+	size_t len;
+	uint64_t pos; /* offset of the line in the file */
+} rb_line_t;
 
 typedef struct ring_buffer_ {
-	int latest_index; /* index in the buffer, where last line was stored */
+	int oldest; /* slot in lines of the oldest line */
 	int capacity; /* number of lines to hold in buffer */
 	int size; /* current lines in buffer */
-	char **line; /* actual lines held in an array */
+	rb_line_t *lines; /* index ring, NULL until initialized */
+	char *arena; /* circular byte arena holding the lines */
+	size_t arena_cap;
+	size_t head; /* arena offset of the oldest byte */
+	size_t used; /* arena bytes in use */
+	size_t max_bytes; /* hard ceiling for arena_cap */
+	unsigned long truncated; /* records cut at max_bytes */
 } ring_buffer_t;
 
+/*
+ * Counters of a file, kept up to date on the hot path whether or not -v
+ * is given, and dumped on SIGUSR1 or to --stats-file. Only the thread
+ * following the file writes them, the dump reads them relaxed. Every
+ * file's counters are a cache line apart, so readers counting different
+ * files never share one.
+ * */
+typedef struct file_stats_ {
+	_Atomic uint64_t bytes;       /* emitted, after the filter */
+	_Atomic uint64_t records;     /* delimiters emitted */
+	_Atomic uint64_t polls;
+	_Atomic uint64_t empty_polls; /* polls that found nothing new */
+	_Atomic uint64_t lag;         /* written but not emitted, last check */
+	_Atomic uint64_t scan_ns;     /* time spent polling the file */
+	_Atomic uint64_t catchups;    /* times it went past --max-lag */
+	_Atomic uint64_t skipped;     /* bytes skipped or lost to a ring wrap */
+} __attribute__((aligned(STATS_ALIGN))) file_stats_t;
+
+/* counters of a reader thread, or of the writer thread with -j */
+typedef struct thread_stats_ {
+	_Atomic uint64_t passes;      /* poll passes */
+	_Atomic uint64_t scan_ns;     /* time spent polling files */
+	_Atomic uint64_t writes;      /* batches written to the sink */
+	_Atomic uint64_t write_bytes;
+	_Atomic uint64_t write_ns;    /* time spent writing them */
+} __attribute__((aligned(STATS_ALIGN))) thread_stats_t;
+
 typedef struct file_data_ {
 	FILE *fp; /* ptr to the open file */
 	ring_buffer_t rb; /* buffer to store the tail -n data */
@@ -86,345 +323,8507 @@ typedef struct file_data_ {
 	 	 	 	 	   * and printing can happen
 	 	 	 	 	   */
 	char delim;       /* delimiter to use for this file for reading */
+	char end_marker;  /* what unwritten space reads as, see --file-delims */
+	int fd;           /* descriptor backing the mapping (--mmap engine) */
+	const char *map;  /* read-only shared mapping of the file */
+	size_t map_off;   /* file offset map points at, see --map-window */
+	size_t map_len;   /* file offset the mapping ends at */
+	size_t cursor;    /* offset of the next byte to be emitted */
+	size_t advised;   /* page tables populated up to here */
+	size_t reclaimed; /* emitted pages before were dropped from the mapping */
+	int wd;           /* inotify watch, -1 if not watched */
+	/* scheduling, see scheduler_t */
+	int sched_list;       /* list the file is linked in, -1 for none */
+	int sched_prev;
+	int sched_next;
+	uint64_t due_tick;    /* wheel tick of the next poll while idle */
+	long backoff_us;      /* current poll interval while idle */
+	unsigned idle_polls;  /* consecutive polls without new data */
+	bool catchup;         /* more than --max-lag behind, see lag_check */
+	file_stats_t *stats;  /* counters of the slot */
+	/* identity of the open file, to notice rotation and truncation */
+	dev_t dev;
+	ino_t ino;
+	uint64_t check_us;    /* next identity check */
+	char head[8];         /* first bytes emitted, to notice a wrap */
+	bool head_valid;
+	unsigned long reopens; /* statistics for -v */
+	uint32_t attach_gen;  /* --attach: generation of the table slot opened */
+	/* --ring */
+	uint64_t ring_pos;    /* bytes of the stream read so far, with a header */
+	char ring_sample[RING_SAMPLE]; /* start of the data area, no header */
+	bool ring_sampled;
+	unsigned long laps;   /* wraps followed */
+	unsigned long lost;   /* bytes overwritten before they were read */
+	int owner;            /* follower of the file, -1 for a free slot */
+	/* --uring */
+	char *uring_data;     /* what this pass read at the cursor, or NULL */
+	int uring_res;        /* bytes read, -errno */
+	unsigned uring_len;   /* bytes to read, grows while the reads fill up */
 } file_data_t;
 
-int debug = false;
+/*
+ * Output stage. Everything emitted during a poll pass is collected as
+ * segments and written with a single writev at the end of the pass, or
+ * earlier once the batch is big or older than batch_latency_us. Segments
+ * point straight into the mappings, only data read through stdio is copied
+ * into the arena. Each segment remembers its file, the ==> name <== headers
+ * are added when the batch is written to the sink. Mapping-backed runs are
+ * vmspliced when stdout is a pipe, or sent with MSG_ZEROCOPY to a --sink
+ * socket.
+ *
+ * With -j the batches of the reader threads are handed to a lock-free MPSC
+ * queue instead, and the writer thread drains it into the sink. A reader
+ * that is OUT_MAX_INFLIGHT batches ahead of the writer waits, so a slow
+ * sink pauses the readers instead of piling up memory.
+ * */
+typedef struct out_seg_ {
+	const char *ptr;  /* mapping-backed bytes, NULL if in the arena */
+	size_t off;       /* offset into the arena if ptr is NULL */
+	size_t len;
+	int file;         /* index of the file the bytes came from */
+	/* structured --format only: one record per segment */
+	uint64_t pos;     /* offset of the record in the file */
+	int64_t recv_us;  /* when it was read, us since the epoch */
+	uint64_t skipped; /* not a record: bytes skipped before pos */
+} out_seg_t;
+
+typedef struct compressor_ compressor_t;
+typedef struct serve_ serve_t;
+
+/* final destination of the output, only the writer touches it */
+typedef struct out_sink_ {
+	int fd;             /* where the output goes */
+	bool headers;       /* print ==> name <== when switching files */
+	bool splice;        /* vmsplice mapping-backed segments */
+	char **names;       /* file names for the headers */
+	char **header;      /* formatted headers, built on first use */
+	size_t *header_len;
+	int num_files;
+	int last_file;      /* file of the last header printed */
+	int format;         /* FORMAT_* */
+	const char *delims; /* per file, the record delimiters */
+	char *scratch;      /* encoded records of a structured --format */
+	size_t scratch_cap;
+	const char *url;    /* --sink, reconnected when the peer goes away */
+	bool zerocopy;      /* MSG_ZEROCOPY for mapping-backed runs */
+	_Atomic bool fresh; /* reconnected, headers must be sent again */
+	compressor_t *comp; /* --compress, everything written goes through it */
+	serve_t *serve;     /* --serve: segments are published, not written */
+	thread_stats_t *stats; /* of the thread writing to the sink */
+	unsigned long reconnects; /* statistics for -v */
+} out_sink_t;
+
+typedef struct out_queue_ out_queue_t;
+typedef struct merge_ merge_t;
+typedef struct filter_ filter_t;
+
+typedef struct out_batch_ {
+	out_sink_t *sink;   /* written to directly, if queue is NULL */
+	out_queue_t *queue; /* -j: batches are handed to the writer thread */
+	merge_t *merge;     /* --merge: records go through the merge first */
+	filter_t *filter;   /* -e/-f: records are matched before anything else */
+	_Atomic unsigned long pushed;  /* batches handed to the queue */
+	_Atomic unsigned long written; /* of those, written by the writer */
+	int cur_file;       /* file of the segments being appended */
+	file_stats_t *stats; /* per file, the bytes and records passed on */
+	const char *delims; /* per file, params->delims */
+	int format;         /* FORMAT_*, structured ones keep records apart */
+	uint64_t pos;       /* file offset of the next byte appended */
+	uint64_t rec_pos;   /* offset of the record being added */
+	int64_t recv_us;    /* when the bytes being added were read */
+	out_seg_t *segs;
+	int num_segs;
+	int segs_cap;
+	char *arena;        /* copied bytes */
+	size_t arena_len;
+	size_t arena_cap;
+	size_t bytes;       /* total bytes pending */
+	uint64_t first_us;  /* when the oldest pending segment was added */
+	long latency_us;
+	int lagging;        /* files in --max-lag catch-up, batches grow */
+	bool whole_records; /* --multiline: the filter passes one record a time */
+} out_batch_t;
+
+/* a batch in flight from a reader thread to the writer thread */
+typedef struct out_node_ {
+	_Atomic(struct out_node_ *) next;
+	out_batch_t *owner;  /* batch of the reader that pushed it */
+	out_seg_t *segs;
+	int num_segs;
+	char *arena;
+} out_node_t;
 
 /*
- * print the usage of this utility
+ * Vyukov's intrusive MPSC queue: producers exchange the head, the single
+ * consumer follows next pointers from the tail. An eventfd wakes the
+ * consumer.
  * */
-void
-print_usage (int argc, char **argv) {
-	/* TODO elaborate */
-	fprintf(stderr, "Usage:"
-			"    %s filename # filename to follow\n", argv[0]);
+struct out_queue_ {
+	_Atomic(out_node_t *) head;
+	out_node_t *tail;
+	out_node_t stub;
+	int efd;
+};
+
+/*
+ * A follow engine knows how to open a file, emit whatever was newly written
+ * to it, and close it again. The stdio engine is the original getdelim/fseek
+ * loop, the mmap engine reads straight out of a shared mapping, the uring
+ * engine batches one read per file and pass.
+ * */
+typedef struct follow_engine_ {
+	const char *name;
+	bool (*open) (file_data_t *fdata, const char *filename);
+	/* returns true if anything was emitted */
+	bool (*poll) (mtail_params_t *params, file_data_t *f_array, int index,
+			out_batch_t *out);
+	void (*close) (file_data_t *fdata);
+	/*
+	 * optional, for engines that batch their I/O: state of a follower,
+	 * and the reads for all files due in a pass, before they are polled
+	 * */
+	void *(*attach) (mtail_params_t *params);
+	void (*prepare) (void *ctx, mtail_params_t *params, file_data_t *f_array,
+			const int *due, int num_due);
+	void (*detach) (void *ctx);
+} follow_engine_t;
+
+int debug = false;
+
+/* --map-window, the mmap engine maps whole files while 0 */
+size_t map_window = 0;
+
+/* set from the SIGINT/SIGTERM handler, the main loop exits cleanly */
+volatile sig_atomic_t stop_requested = 0;
+
+/* set from the SIGUSR1 handler, the counters are dumped on the next pass */
+volatile sig_atomic_t stats_requested = 0;
+
+/* SIGBUS on mapped pages past the end of a truncated file, see file_check */
+_Atomic unsigned long mapping_faults = 0;
+/* what the page put in place of the lost one is filled with, -x */
+char mapping_fill = '\0';
+
+/* -j: set by the writer thread once the reader threads should finish */
+_Atomic bool followers_stop = false;
+
+/* -p: readable once the process exits, -1 if kill(2) has to tell */
+int watch_pidfd = -1;
+
+/* -p: the process exited, its files are drained before stopping */
+_Atomic bool watch_pid_gone = false;
+
+uint64_t
+monotonic_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-bool glob_files (char *regex, glob_t* pglob) {
-	int ret;
-	int i;
-	ret = glob(regex, 0, NULL, pglob);
-	if (ret == 0) {
-		for (i=0;i<pglob->gl_pathc;i++) {
-			dbg_printf("%s: %d: %s\n", __FUNCTION__, i+1, pglob->gl_pathv[i]);
-		}
-		return true;
-	} else {
-		globfree(pglob);
-		return false;
-	}
+uint64_t
+monotonic_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
+
 /*
- * Close all files in case of error, or if we are finished
+ * bump a counter only its own thread writes: a plain load and store, no
+ * locked instruction, readers on other threads still see whole values
  * */
+static inline void
+stat_add (_Atomic uint64_t *c, uint64_t v) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+			memory_order_relaxed);
+}
+
+static inline uint64_t
+stat_get (_Atomic uint64_t *c) {
+	return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/* a slot starts following another file */
 void
-close_files (file_data_t *file_data_array, int num_files) {
-	while (num_files-->0) {
-		fclose(file_data_array[num_files].fp);
-		file_data_array[num_files].fp = NULL;
-	}
+stats_reset (file_stats_t *st) {
+	atomic_store_explicit(&st->bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->records, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->polls, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->empty_polls, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->lag, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->scan_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->catchups, 0, memory_order_relaxed);
+	atomic_store_explicit(&st->skipped, 0, memory_order_relaxed);
+}
+
+int64_t
+realtime_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
+
 /*
- * Attempt to open all the files,
- * if any file fails to open, close all files opened thus far, and return false
- * else return true
- *
+ * --sink: connect to tcp://HOST:PORT or unix:///PATH. Returns -1 with
+ * errno set on failure, EINVAL for an URL that isn't understood.
  * */
-bool
-open_files (char *filenames[], int num_files, file_data_t *file_data_array) {
-	int i;
-	for (i=0;i<num_files;i++) {
-		if (file_data_array[i].fp) {
-			/* File is already open */
-			/* TODO check if file exists, has been rotated/deleted? */
+int
+sink_connect (const char *url) {
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char host[256];
+	const char *port;
+	size_t len;
+	int fd = -1, err;
+
+	if (strncmp(url, "unix://", 7) == 0) {
+		if (strlen(url + 7) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, url + 7);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		return fd;
+	}
+	if (strncmp(url, "tcp://", 6) != 0 ||
+			(port = strrchr(url + 6, ':')) == NULL ||
+			(len = port - (url + 6)) >= sizeof(host)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, url + 6, len);
+	host[len] = '\0';
+	if (len >= 2 && host[0] == '[' && host[len-1] == ']') {
+		/* tcp://[::1]:port */
+		memmove(host, host + 1, len - 2);
+		host[len - 2] = '\0';
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, port + 1, &hints, &res)) != 0) {
+		dbg_printf("%s: %s\n", url, gai_strerror(err));
+		errno = err == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (fd < 0) {
 			continue;
 		}
-		file_data_array[i].fp = fopen(filenames[i], "r");
-		if (!file_data_array[i].fp) {
-			dbg_printf("Error opening %s for reading: %s\n",
-						filenames[i], strerror(errno));
-			close_files(file_data_array, i);
-			return false;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
 		}
+		err = errno;
+		close(fd);
+		errno = err;
+		fd = -1;
 	}
-	return true;
+	freeaddrinfo(res);
+	return fd;
 }
 
 /*
- * if size has reached capacity, replace oldest with newest line.
- * else insert the line into ring buffer.
+ * socket options of a --sink connection: the output stage batches itself,
+ * so Nagle would only add latency
  * */
 void
-enqueue (ring_buffer_t *rb, char *line, int len) {
-	int old_len;
-	int index;
-	rb->latest_index++;
-	if (rb->latest_index>=rb->capacity) {
-		rb->latest_index = 0;
+sink_setup (out_sink_t *sink) {
+	int one = 1;
+	if (!sink->url) {
+		return;
 	}
-	index = rb->latest_index;
-	if (!rb->line[index]) {
-		rb->line[index] = malloc(sizeof(char)*len);
-	} else {
-		old_len = sizeof(rb->line[index]);
-		if (old_len<len) {
-			free(rb->line[index]);
-			rb->line[index] = malloc(sizeof(char)*len);
-		}
+	if (strncmp(sink->url, "tcp://", 6) == 0) {
+		setsockopt(sink->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 	}
-	line[len-1]='\0'; /* Ensure that line is null terminated */
-	strncpy(rb->line[index], line, len);
-	if (rb->size<rb->capacity) {
-		rb->size++;
+	if (sink->zerocopy && setsockopt(sink->fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+			sizeof(one)) != 0) {
+		dbg_printf("%s: SO_ZEROCOPY: %s, copying\n", sink->url,
+				strerror(errno));
+		sink->zerocopy = false;
 	}
 }
 
-/*
- * print the lines in buffer for "tail -n <>" functionality
- */
 void
-print_ring_buffer(ring_buffer_t *rb) {
+out_sink_init (out_sink_t *sink, int fd, mtail_params_t *params) {
+	struct stat st;
+	memset(sink, 0, sizeof(out_sink_t));
+	sink->fd = fd;
+	sink->headers = (!params->quiet) && params->format == FORMAT_TEXT &&
+			(params->num_files>1 || params->rescan_us > 0);
+	sink->names = params->files;
+	sink->num_files = params->max_files;
+	sink->header = calloc(params->max_files, sizeof(char *));
+	sink->header_len = calloc(params->max_files, sizeof(size_t));
+	sink->last_file = -1;
+	sink->format = params->format;
+	sink->delims = params->delims;
+	sink->splice = params->use_mmap && !params->no_splice &&
+			params->format == FORMAT_TEXT &&
+			fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+	sink->url = params->sink_url;
+	sink->zerocopy = params->zerocopy && params->use_mmap &&
+			params->format == FORMAT_TEXT;
+	sink_setup(sink);
+}
+
+void
+out_sink_free (out_sink_t *sink) {
 	int i;
-	int oldest_index = rb->latest_index+1;
-	if (!rb->line) {
-		/* Nothing to print */
-		return;
+	for (i=0;i<sink->num_files;i++) {
+		free(sink->header[i]);
 	}
-	for (i=0;i<rb->size;i++) {
-		if (oldest_index >= rb->size) {
-			oldest_index = 0;
-		}
-		fprintf(stdout,"%s",rb->line[oldest_index]);
-		free(rb->line[oldest_index]);
-		rb->line[oldest_index]=NULL;
-		oldest_index++;
+	free(sink->header);
+	free(sink->header_len);
+	free(sink->scratch);
+	if (sink->url) {
+		dbg_printf("%s: %lu reconnect(s)\n", sink->url, sink->reconnects);
+		close(sink->fd);
 	}
-	fflush(stdout);
-	free(rb->line);
-	rb->line=NULL;
 }
 
 void
-ring_buffer_init(ring_buffer_t *rb, int capacity) {
-	memset(rb, 0, sizeof(ring_buffer_t));
-	rb->capacity=capacity;
-	rb->latest_index = capacity;
-	rb->line = malloc(sizeof(char*)*capacity);
-	memset(rb->line,0,sizeof(char*)*capacity);
+out_init (out_batch_t *out, out_sink_t *sink, out_queue_t *queue,
+		mtail_params_t *params) {
+	memset(out, 0, sizeof(out_batch_t));
+	out->sink = sink;
+	out->queue = queue;
+	out->cur_file = -1;
+	out->delims = params->delims;
+	out->format = params->format;
+	out->latency_us = params->batch_latency_us;
+	out->whole_records = params->multiline != MULTILINE_NONE;
 }
 
-/* check if we need to stop tailing based on params
- * is watched_pid alive?
+void
+out_free (out_batch_t *out) {
+	free(out->segs);
+	free(out->arena);
+}
+
+void
+out_queue_init (out_queue_t *q) {
+	atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+	q->tail = &q->stub;
+	q->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+void
+out_queue_push (out_queue_t *q, out_node_t *node) {
+	out_node_t *prev;
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/*
+ * pop the oldest node, NULL if the queue is empty or a push is halfway
+ * done. Single consumer only.
  * */
-bool
-stop_conditions_met (mtail_params_t *params) {
-	if (params->watch_pid!=0) {
-#ifdef _POSIX_VERSION
-		dbg_printf("Checking pid:%d is alive\n", params->watch_pid);
-		kill(params->watch_pid,0);
-		if (errno == ESRCH) {
+out_node_t *
+out_queue_pop (out_queue_t *q) {
+	out_node_t *tail = q->tail;
+	out_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
 
-			return true;
+	if (tail == &q->stub) {
+		if (!next) {
+			return NULL;
 		}
-#else
-		fprintf(stderr, "pid check unsupported on non-posix systems\n");
-		return true;
-#endif
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
 	}
-	return false;
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+		return NULL;
+	}
+	out_queue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
 }
+
 /*
- * Parse and validate the cmdline options
+ * --sink: the peer went away. Connect again once a second until it is back
+ * or we are asked to stop; the write in progress goes on over the new
+ * connection.
  * */
 bool
-parse_opts (int argc, char *argv[], mtail_params_t *params) {
-    int opt;
-    glob_t pglob;
-	if (argc<2) {
-		print_usage(argc, argv);
-		return EXIT_FAILURE;
-	}
-	memset(params,0,sizeof(mtail_params_t));
+sink_reconnect (out_sink_t *sink) {
+	struct timespec ts = { 1, 0 };
+	int fd;
 
-	/* initialize defaults */
-	params->num_lines = 10;
-	params->delim = '\n';
-	params->delay_seconds = 1;
-
-	/* write a better string */
-	while ((opt = getopt(argc, argv, "n:s:vp:qr:d:")) != -1) {
-		dbg_printf("opt:%c optarg:%s\n", opt, optarg);
-		switch (opt) {
-		case 'n':
-			if (optarg[0]=='+') {
-				params->lines_from_start = true;
-				optarg++;
-			}
-			params->num_lines = atoi(optarg);
-			break;
-		case 's':
-			params->delay_seconds = atoi(optarg);
-			break;
-		case 'v':
-			params->verbose = true;
-			debug = true;
-			break;
-		case 'p':
-			params->watch_pid = atoi(optarg);
-			break;
-		case 'q':
-			params->quiet = true;
-			break;
-		case 'r':
-			strncpy(params->regex, optarg, MAX_ARG_SIZE);
-			params->regex[MAX_ARG_SIZE-1]='\0';
-			glob_files(params->regex, &pglob);
-			break;
-		case 'd':
-			params->delim = optarg[0];
-			break;
-		case 'x':
-			params->end_marker = optarg[0];
-			break;
-		default:
-			break;
+	fprintf(stderr, "%s: %s, reconnecting\n", sink->url, strerror(errno));
+	close(sink->fd);
+	while (!stop_requested) {
+		if ((fd = sink_connect(sink->url)) >= 0) {
+			sink->fd = fd;
+			sink->fresh = true;
+			sink->reconnects++;
+			sink_setup(sink);
+			dbg_printf("%s: reconnected\n", sink->url);
+			return true;
 		}
+		nanosleep(&ts, NULL);
 	}
-	if (params->regex[0]=='\0') {
-		params->files = &argv[optind];
-		params->num_files = argc - optind;
-	} else if (pglob.gl_pathc!=0) {
-		params->files = pglob.gl_pathv;
-		params->num_files = pglob.gl_pathc;
-	} else {
-		fprintf(stderr, "glob: %s Input files not found\n", params->regex);
-	}
-	dbg_printf("argv[%d] = %s\n", optind, argv[optind]);
-	return true;
+	return false;
 }
 
 /*
- * Helper function to determine first index of end_marker in given char *buf
+ * --zerocopy: the completions have to be read off the error queue, or the
+ * socket runs out of option memory. Which ranges completed doesn't matter,
+ * the mapped pages stay pinned until then.
  * */
-int
-find_end_index (char *buf, char end_marker, int limit) {
-	int i=0;
-	while(buf[i]!=end_marker && i<limit ) {
-		i++;
+void
+sink_reap_zerocopy (out_sink_t *sink) {
+	char control[128];
+	struct msghdr msg;
+	do {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+	} while (recvmsg(sink->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+}
+
+ssize_t
+sink_sendmsg_zerocopy (out_sink_t *sink, struct iovec *iov, int cnt) {
+	struct msghdr msg;
+	size_t len = 0;
+	ssize_t n;
+	int k;
+
+	for (k=0;k<cnt;k++) {
+		len += iov[k].iov_len;
 	}
-	if (buf[i]==end_marker) {
-		return i;
-	} else {
-		return -1;
+	if (len < ZEROCOPY_MIN) {
+		return writev(sink->fd, iov, cnt);
 	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+	n = sendmsg(sink->fd, &msg, MSG_ZEROCOPY);
+	if (n < 0 && errno == ENOBUFS) {
+		/* too many sends in flight, copy this one */
+		sink_reap_zerocopy(sink);
+		return writev(sink->fd, iov, cnt);
+	}
+	sink_reap_zerocopy(sink);
+	return n;
 }
 
-bool
-print_file_content (mtail_params_t *param_args) {
-	FILE* fp = NULL;
-	int i = 0;
-	size_t chunk_size = BUF_CHUNK_SIZE;
-	char *buf = NULL;
-	bool print_file_name;
-	int read_chars = 0;
-	int last_file_printed = -1;
-	int move_by = 0;
-	file_data_t *f_array =
-			malloc(sizeof(file_data_t)*param_args->num_files);
+/*
+ * --compress: the output stream is compressed on a helper thread. The
+ * sink copies what it would have written into one of two buffers; at the
+ * end of each batch the buffer is handed over and the sink goes on with
+ * the other one, so it only waits when the codec falls behind by a whole
+ * batch. Each batch is compressed and flushed on its own, with the same
+ * stream context for the ratio. The codec libraries are loaded when
+ * asked for, the build doesn't need their headers.
+ * */
 
-	/* Initialize data structures */
-	for (i=0;i<param_args->num_files;i++) {
-		ring_buffer_init(&f_array[i].rb, param_args->num_lines);
-		/* end is reached if we are not looking for last n lines */
-		f_array[i].end_reached = (param_args->num_lines == 0);
-		f_array[i].fp = NULL;
-		f_array[i].delim = param_args->delim;
-	}
+/* lz4frame.h LZ4F_preferences_t, all zero is the default */
+typedef struct lz4f_prefs_ {
+	int block_size_id;
+	int block_mode;
+	int content_checksum;
+	int frame_type;
+	unsigned long long content_size;
+	unsigned dict_id;
+	int block_checksum;
+	int level;
+	unsigned auto_flush;
+	unsigned favor_dec_speed;
+	unsigned reserved[3];
+} lz4f_prefs_t;
 
-	/* Need to print file names when we are tailing more than 1 file
-	 * and if quiet mode is disabled
-	 * */
-	bool need_to_print_file_name = (!param_args->quiet) &&
-									(param_args->num_files>1);
+/* zstd.h ZSTD_inBuffer/ZSTD_outBuffer */
+typedef struct zstd_buf_ {
+	const void *ptr;
+	size_t size;
+	size_t pos;
+} zstd_buf_t;
 
-	while (true) {
-		if (!open_files(param_args->files, param_args->num_files, f_array)) {
-			/* Could not open the given files, retry */
-			break;
-		}
-		for (i=0; i<param_args->num_files; i++) { /* for each file */
-			fp = f_array[i].fp; /* Get the file pointer */
-			print_file_name = need_to_print_file_name;
-			/* getdelim is problematic with huge files fix this */
-			while((read_chars =
-					getdelim(&buf, &chunk_size, f_array[i].delim, fp))>0) {
-				/* something new was read */
-				dbg_printf("%s: %d chars read, cursor at %ld, errno:%s\n",
-						param_args->files[i], read_chars, ftell(fp),
-						strerror(errno));
-				/* print, if we read anything other than just end_marker */
-				if (buf[0]!=param_args->end_marker) {
-					if (print_file_name && (last_file_printed != i)) {
-						/* Header for a different file was printed */
-						fprintf(stdout, "\n==> %s <==\n", param_args->files[i]);
-						last_file_printed = i;
-						print_file_name = false;
-					}
-					if (f_array[i].end_reached) {
-						/* print the actual content */
-						fprintf(stdout, "%s", buf);
-						fflush(stdout);
-					} else {
-						/* mtail-f -n specified, enqueue content */
-						enqueue(&f_array[i].rb,buf,read_chars+1);
-					}
-				}
+#define ZSTD_C_COMPRESSIONLEVEL 100
+#define ZSTD_E_FLUSH 1
+#define ZSTD_E_END   2
+#define ZSTD_RESET_SESSION 1
+#define LZ4F_VERSION 100
+#define LZ4F_CHUNK (64*1024)  /* input per LZ4F_compressUpdate */
 
-				/* Check if end_marker was found */
-				if (buf[read_chars-1]==param_args->end_marker) {
-					if (!f_array[i].end_reached) {
-						print_ring_buffer(&f_array[i].rb);
-						f_array[i].end_reached = true;
-						f_array[i].delim = param_args->end_marker;
-					}
-					/* move cursor to first occurrence of end_marker */
-					move_by = read_chars-find_end_index(buf,
-											param_args->end_marker, read_chars);
-
-
-					fseek(fp,
-							-move_by,
-							SEEK_CUR);
-					dbg_printf("%s: end_marker ASCII:%d found, cursor at %ld\n",
-							param_args->files[i], (int)(param_args->end_marker),
-							ftell(fp));
-					break; /* so that we pause before we retry reading */
-				}
+typedef struct codec_ {
+	const char *name;
+	const char *library;
+	int default_level;
+	bool (*init) (compressor_t *c);
+	/* compress and write len bytes of in, end finishes the frame */
+	bool (*compress) (compressor_t *c, const char *in, size_t len, bool end);
+	/* start a new frame, after a reconnect */
+	void (*reset) (compressor_t *c);
+	void (*free) (compressor_t *c);
+} codec_t;
+
+struct compressor_ {
+	const codec_t *codec;
+	out_sink_t *sink;
+	int level;
+	void *lib;
+	void *ctx;
+	union {
+		struct {
+			void *(*create) (void);
+			size_t (*free) (void *);
+			size_t (*set_param) (void *, int, int);
+			size_t (*stream) (void *, zstd_buf_t *, zstd_buf_t *, int);
+			size_t (*reset) (void *, int);
+			unsigned (*is_error) (size_t);
+			size_t (*out_size) (void);
+		} zstd;
+		struct {
+			size_t (*create) (void **, unsigned);
+			size_t (*free) (void *);
+			size_t (*begin) (void *, void *, size_t, const lz4f_prefs_t *);
+			size_t (*bound) (size_t, const lz4f_prefs_t *);
+			size_t (*update) (void *, void *, size_t, const void *, size_t,
+					const void *);
+			size_t (*flush) (void *, void *, size_t, const void *);
+			size_t (*end) (void *, void *, size_t, const void *);
+			unsigned (*is_error) (size_t);
+			lz4f_prefs_t prefs;
+			bool started; /* the frame header was written */
+		} lz4;
+	} f;
+	char *out;            /* compressed bytes on their way to the fd */
+	size_t out_cap;
+	char *in[2];          /* batches, filled by the sink in turn */
+	size_t in_len[2];
+	size_t in_cap[2];
+	int fill;             /* buffer the sink is filling */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool busy;            /* the other buffer is being compressed */
+	bool finish;          /* no more batches, end the frame */
+	_Atomic bool failed;  /* the output is gone */
+	unsigned long long bytes_in; /* statistics for -v */
+	unsigned long long bytes_out;
+};
+
+/*
+ * write compressed bytes. If a --sink reconnects the rest of this frame
+ * is of no use to the new peer, it gets a new frame from the next bytes on.
+ * */
+bool
+comp_write (compressor_t *c, const char *buf, size_t len) {
+	out_sink_t *sink = c->sink;
+	ssize_t n;
+	c->bytes_out += len;
+	while (len > 0) {
+		n = write(sink->fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
-			dbg_printf("%s: %d chars read, cursor at %ld, errno:%s\n",
-					param_args->files[i], read_chars, ftell(fp),
-					strerror(errno));
-			fseek(fp, 0, SEEK_CUR);
-		}
-		/* wait before retrying */
-		sleep(param_args->delay_seconds);
-		if (stop_conditions_met(param_args)) {
-			break;
+			if (sink->url && sink_reconnect(sink)) {
+				c->codec->reset(c);
+				return true;
+			}
+			dbg_printf("output: %s\n", strerror(errno));
+			atomic_store(&c->failed, true);
+			return false;
 		}
-	}
-	close_files(f_array, param_args->num_files);
-	if (buf) {
-		free(buf);
+		buf += n;
+		len -= n;
 	}
 	return true;
 }
 
-int main (int argc, char *argv[]) {
-	mtail_params_t param_args;
-	setvbuf(stderr,NULL,_IONBF,0);
+bool
+zstd_init (compressor_t *c) {
+	if (!(c->f.zstd.create = dlsym(c->lib, "ZSTD_createCCtx")) ||
+			!(c->f.zstd.free = dlsym(c->lib, "ZSTD_freeCCtx")) ||
+			!(c->f.zstd.set_param = dlsym(c->lib, "ZSTD_CCtx_setParameter")) ||
+			!(c->f.zstd.stream = dlsym(c->lib, "ZSTD_compressStream2")) ||
+			!(c->f.zstd.reset = dlsym(c->lib, "ZSTD_CCtx_reset")) ||
+			!(c->f.zstd.is_error = dlsym(c->lib, "ZSTD_isError")) ||
+			!(c->f.zstd.out_size = dlsym(c->lib, "ZSTD_CStreamOutSize"))) {
+		return false;
+	}
+	if ((c->ctx = c->f.zstd.create()) == NULL) {
+		return false;
+	}
+	c->out_cap = c->f.zstd.out_size();
+	c->out = malloc(c->out_cap);
+	return !c->f.zstd.is_error(c->f.zstd.set_param(c->ctx,
+			ZSTD_C_COMPRESSIONLEVEL, c->level));
+}
 
-	parse_opts(argc, argv, &param_args);
-	print_file_content(&param_args);
+bool
+zstd_compress (compressor_t *c, const char *in, size_t len, bool end) {
+	zstd_buf_t src = { in, len, 0 };
+	zstd_buf_t dst;
+	size_t left;
+
+	do {
+		dst.ptr = c->out;
+		dst.size = c->out_cap;
+		dst.pos = 0;
+		left = c->f.zstd.stream(c->ctx, &dst, &src,
+				end ? ZSTD_E_END : ZSTD_E_FLUSH);
+		if (c->f.zstd.is_error(left)) {
+			dbg_printf("zstd: error %zu\n", left);
+			atomic_store(&c->failed, true);
+			return false;
+		}
+		if (!comp_write(c, c->out, dst.pos)) {
+			return false;
+		}
+	} while (left > 0 || src.pos < src.size);
+	return true;
+}
+
+void
+zstd_reset (compressor_t *c) {
+	c->f.zstd.reset(c->ctx, ZSTD_RESET_SESSION);
+}
+
+void
+zstd_free (compressor_t *c) {
+	if (c->ctx) {
+		c->f.zstd.free(c->ctx);
+	}
+}
+
+bool
+lz4_init (compressor_t *c) {
+	if (!(c->f.lz4.create = dlsym(c->lib, "LZ4F_createCompressionContext")) ||
+			!(c->f.lz4.free = dlsym(c->lib, "LZ4F_freeCompressionContext")) ||
+			!(c->f.lz4.begin = dlsym(c->lib, "LZ4F_compressBegin")) ||
+			!(c->f.lz4.bound = dlsym(c->lib, "LZ4F_compressBound")) ||
+			!(c->f.lz4.update = dlsym(c->lib, "LZ4F_compressUpdate")) ||
+			!(c->f.lz4.flush = dlsym(c->lib, "LZ4F_flush")) ||
+			!(c->f.lz4.end = dlsym(c->lib, "LZ4F_compressEnd")) ||
+			!(c->f.lz4.is_error = dlsym(c->lib, "LZ4F_isError"))) {
+		return false;
+	}
+	if (c->f.lz4.is_error(c->f.lz4.create(&c->ctx, LZ4F_VERSION))) {
+		c->ctx = NULL;
+		return false;
+	}
+	memset(&c->f.lz4.prefs, 0, sizeof(c->f.lz4.prefs));
+	c->f.lz4.prefs.level = c->level;
+	/* frame header, one chunk, and what a flush or the end may add */
+	c->out_cap = c->f.lz4.bound(LZ4F_CHUNK, &c->f.lz4.prefs) + 64;
+	c->out = malloc(c->out_cap);
+	return true;
+}
+
+/*
+ * false, and the output is given up, if r is an lz4 error
+ * */
+bool
+lz4_ok (compressor_t *c, size_t r) {
+	if (c->f.lz4.is_error(r)) {
+		dbg_printf("lz4: error %zu\n", r);
+		atomic_store(&c->failed, true);
+		return false;
+	}
+	return true;
+}
+
+bool
+lz4_compress (compressor_t *c, const char *in, size_t len, bool end) {
+	size_t n = 0, r, chunk;
+
+	if (!c->f.lz4.started) {
+		n = c->f.lz4.begin(c->ctx, c->out, c->out_cap, &c->f.lz4.prefs);
+		if (!lz4_ok(c, n)) {
+			return false;
+		}
+		c->f.lz4.started = true;
+	}
+	while (len > 0) {
+		chunk = len < LZ4F_CHUNK ? len : LZ4F_CHUNK;
+		r = c->f.lz4.update(c->ctx, c->out + n, c->out_cap - n, in, chunk,
+				NULL);
+		if (!lz4_ok(c, r) || !comp_write(c, c->out, n + r)) {
+			return false;
+		}
+		n = 0;
+		in += chunk;
+		len -= chunk;
+	}
+	/* push the batch out of the block buffer */
+	r = (end ? c->f.lz4.end : c->f.lz4.flush)(c->ctx, c->out + n,
+			c->out_cap - n, NULL);
+	if (!lz4_ok(c, r)) {
+		return false;
+	}
+	c->f.lz4.started = !end;
+	return comp_write(c, c->out, n + r);
+}
+
+void
+lz4_reset (compressor_t *c) {
+	c->f.lz4.started = false;
+}
+
+void
+lz4_free (compressor_t *c) {
+	if (c->ctx) {
+		c->f.lz4.free(c->ctx);
+	}
+}
+
+const codec_t codecs[] = {
+	{ "zstd", "libzstd.so.1", 3, zstd_init, zstd_compress, zstd_reset,
+			zstd_free },
+	{ "lz4", "liblz4.so.1", 0, lz4_init, lz4_compress, lz4_reset, lz4_free },
+};
+
+void *
+comp_run (void *arg) {
+	compressor_t *c = arg;
+	int k;
+
+	pthread_mutex_lock(&c->lock);
+	while (true) {
+		while (!c->busy && !c->finish) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		if (!c->busy) {
+			break;
+		}
+		k = c->fill ^ 1;
+		pthread_mutex_unlock(&c->lock);
+		c->bytes_in += c->in_len[k];
+		if (!atomic_load(&c->failed)) {
+			c->codec->compress(c, c->in[k], c->in_len[k], false);
+		}
+		pthread_mutex_lock(&c->lock);
+		c->busy = false;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+	if (c->sink && !atomic_load(&c->failed)) {
+		c->codec->compress(c, NULL, 0, true);
+	}
+	return NULL;
+}
+
+/*
+ * load the codec named name and start its thread, it is given the sink
+ * with comp_attach
+ * */
+compressor_t *
+comp_new (const char *name, int level) {
+	compressor_t *c;
+	int k;
+
+	for (k=0;k<(int)(sizeof(codecs)/sizeof(codecs[0]));k++) {
+		if (strcmp(codecs[k].name, name) == 0) {
+			break;
+		}
+	}
+	if (k == (int)(sizeof(codecs)/sizeof(codecs[0]))) {
+		fprintf(stderr, "unknown codec: %s\n", name);
+		return NULL;
+	}
+	c = calloc(1, sizeof(compressor_t));
+	c->codec = &codecs[k];
+	c->level = level >= 0 ? level : c->codec->default_level;
+	if ((c->lib = dlopen(c->codec->library, RTLD_NOW | RTLD_LOCAL)) == NULL ||
+			!c->codec->init(c)) {
+		fprintf(stderr, "--compress=%s: %s\n", name,
+				c->lib ? "could not set up the codec" : dlerror());
+		if (c->lib) {
+			c->codec->free(c);
+			dlclose(c->lib);
+		}
+		free(c->out);
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (pthread_create(&c->thread, NULL, comp_run, c) != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+		c->codec->free(c);
+		dlclose(c->lib);
+		free(c->out);
+		free(c);
+		return NULL;
+	}
+	dbg_printf("compressing with %s level %d\n", name, c->level);
+	return c;
+}
+
+void
+comp_attach (compressor_t *c, out_sink_t *sink) {
+	c->sink = sink;
+	sink->comp = c;
+}
+
+/*
+ * collect bytes of the current batch
+ * */
+bool
+comp_append (compressor_t *c, struct iovec *iov, int cnt) {
+	int b = c->fill, k;
+	size_t len;
+
+	for (k=0;k<cnt;k++) {
+		len = iov[k].iov_len;
+		if (c->in_len[b] + len > c->in_cap[b]) {
+			while (c->in_len[b] + len > c->in_cap[b]) {
+				c->in_cap[b] = c->in_cap[b] ? c->in_cap[b]*2 : OUT_MAX_BYTES;
+			}
+			c->in[b] = realloc(c->in[b], c->in_cap[b]);
+		}
+		memcpy(c->in[b] + c->in_len[b], iov[k].iov_base, len);
+		c->in_len[b] += len;
+	}
+	return !atomic_load(&c->failed);
+}
+
+/*
+ * end of a batch: hand it to the helper thread
+ * */
+bool
+comp_submit (compressor_t *c) {
+	if (c->in_len[c->fill] == 0) {
+		return !atomic_load(&c->failed);
+	}
+	pthread_mutex_lock(&c->lock);
+	while (c->busy) {
+		pthread_cond_wait(&c->cond, &c->lock);
+	}
+	c->fill ^= 1;
+	c->in_len[c->fill] = 0;
+	c->busy = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return !atomic_load(&c->failed);
+}
+
+/*
+ * compress what is left, end the frame, and let the helper thread go
+ * */
+void
+comp_finish (compressor_t *c) {
+	int k;
+	comp_submit(c);
+	pthread_mutex_lock(&c->lock);
+	c->finish = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+	dbg_printf("%s: %llu bytes compressed to %llu\n", c->codec->name,
+			c->bytes_in, c->bytes_out);
+	c->codec->free(c);
+	dlclose(c->lib);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	for (k=0;k<2;k++) {
+		free(c->in[k]);
+	}
+	free(c->out);
+	free(c);
+}
+
+/*
+ * write all of iov, resuming after partial writes. mapped runs are
+ * vmspliced into a pipe or sent with MSG_ZEROCOPY to a socket, if vmsplice
+ * is refused the rest goes out with writev. A --sink is reconnected when
+ * the write fails. With --compress it is all collected for the codec.
+ * */
+bool
+write_iov (out_sink_t *sink, struct iovec *iov, int cnt, bool mapped) {
+	ssize_t n;
+	if (sink->comp) {
+		return comp_append(sink->comp, iov, cnt);
+	}
+	while (cnt > 0) {
+		if (mapped && sink->splice) {
+			n = vmsplice(sink->fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX, 0);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				dbg_printf("vmsplice: %s, using writev\n", strerror(errno));
+				sink->splice = false;
+				continue;
+			}
+		} else if (mapped && sink->zerocopy) {
+			n = sink_sendmsg_zerocopy(sink, iov, cnt < IOV_MAX ? cnt : IOV_MAX);
+		} else {
+			n = writev(sink->fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX);
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (sink->url && sink_reconnect(sink)) {
+				continue;
+			}
+			return false;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/*
+ * header for file index, formatted once
+ * */
+const char *
+out_sink_header (out_sink_t *sink, int index) {
+	size_t len;
+	if (!sink->header[index]) {
+		len = strlen(sink->names[index]) + 12;
+		sink->header[index] = malloc(len);
+		snprintf(sink->header[index], len, "\n==> %s <==\n",
+				sink->names[index]);
+	}
+	return sink->header[index];
+}
+
+/*
+ * Structured --format. Each segment is one record, the filter stage put
+ * them together. ndjson is one object per line,
+ *   {"file":ID,"offset":OFF,"recv_us":US,"record":"..."}
+ * with "partial":true for a record cut without its delimiter. A file is
+ * announced with {"file":ID,"name":"..."} before its first record, and
+ * again when -r reuses the id for another file. Bytes that were skipped
+ * (--on-lag=skip, or lost to a ring wrap) show as
+ * {"file":ID,"offset":OFF,"recv_us":US,"skipped":N}, OFF being where the
+ * output goes on. frame is a frame_hdr_t in host byte order followed by
+ * len bytes, the record without its delimiter, the name of the file,
+ * or the 8 byte count of a FRAME_SKIP. The frame payloads are written from where the
+ * records are, mappings included; ndjson is escaped into the scratch
+ * buffer 16 bytes at a time.
+ * */
+typedef struct frame_hdr_ {
+	uint32_t len;       /* bytes that follow the header */
+	uint16_t type;      /* FRAME_RECORD, FRAME_FILE or FRAME_SKIP */
+	uint16_t flags;     /* FRAME_PARTIAL */
+	uint32_t file;      /* file id */
+	uint32_t reserved;
+	uint64_t offset;    /* offset of the record in the file */
+	int64_t recv_us;    /* when it was read, us since the epoch */
+} frame_hdr_t;
+
+#define FRAME_RECORD  0
+#define FRAME_FILE    1
+#define FRAME_SKIP    2
+#define FRAME_PARTIAL 0x1 /* the record didn't end with the delimiter */
+
+/*
+ * length of the prefix of s that needs no escaping in a JSON string.
+ * Bytes from 0x80 up are passed through, the records are taken to be
+ * UTF-8.
+ * */
+static inline size_t
+json_plain_prefix (const char *s, size_t len) {
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	__m128i v;
+	int mask;
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+				_mm_cmpeq_epi8(v, bslash)),
+				_mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__aarch64__)
+	uint8x16_t v;
+	for (; i + 16 <= len; i += 16) {
+		v = vld1q_u8((const uint8_t *)(s + i));
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+				vceqq_u8(v, vdupq_n_u8('\\'))),
+				vcleq_u8(v, vdupq_n_u8(0x1f)))) != 0) {
+			break;
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if ((unsigned char)s[i] < 0x20 || s[i] == '"' || s[i] == '\\') {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * escape len bytes of src into dst, which has room for 6*len
+ * */
+size_t
+json_escape (char *dst, const char *src, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	char *d = dst;
+	size_t i = 0, n;
+	unsigned char c;
+
+	while (true) {
+		n = json_plain_prefix(src + i, len - i);
+		memcpy(d, src + i, n);
+		d += n;
+		i += n;
+		if (i == len) {
+			break;
+		}
+		c = src[i++];
+		*d++ = '\\';
+		switch (c) {
+		case '"': *d++ = '"'; break;
+		case '\\': *d++ = '\\'; break;
+		case '\n': *d++ = 'n'; break;
+		case '\r': *d++ = 'r'; break;
+		case '\t': *d++ = 't'; break;
+		default:
+			memcpy(d, "u00", 3);
+			d[3] = hex[c >> 4];
+			d[4] = hex[c & 0xf];
+			d += 5;
+			break;
+		}
+	}
+	return d - dst;
+}
+
+static inline char *
+put_u64 (char *d, uint64_t v) {
+	char tmp[20];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n > 0) {
+		*d++ = tmp[--n];
+	}
+	return d;
+}
+
+static inline char *
+put_str (char *d, const char *s) {
+	size_t len = strlen(s);
+	memcpy(d, s, len);
+	return d + len;
+}
+
+/*
+ * the announcement of file index, built once per name
+ * */
+void
+out_sink_announce (out_sink_t *sink, int index) {
+	const char *name = sink->names[index];
+	size_t len = strlen(name);
+	frame_hdr_t hdr;
+	char *d;
+
+	sink->header[index] = malloc(6*len + 64);
+	d = sink->header[index];
+	if (sink->format == FORMAT_FRAME) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.len = len;
+		hdr.type = FRAME_FILE;
+		hdr.file = index;
+		memcpy(d, &hdr, sizeof(hdr));
+		memcpy(d + sizeof(hdr), name, len);
+		d += sizeof(hdr) + len;
+	} else {
+		d = put_u64(put_str(d, "{\"file\":"), index);
+		d = put_str(d, ",\"name\":\"");
+		d += json_escape(d, name, len);
+		d = put_str(d, "\"}\n");
+	}
+	sink->header_len[index] = d - sink->header[index];
+}
+
+/*
+ * count a batch written since start_ns against the writing thread
+ * */
+static inline void
+out_sink_account (out_sink_t *sink, out_seg_t *segs, int num_segs,
+		uint64_t start_ns) {
+	uint64_t bytes = 0;
+	int i;
+	if (!sink->stats) {
+		return;
+	}
+	for (i=0;i<num_segs;i++) {
+		bytes += segs[i].len;
+	}
+	stat_add(&sink->stats->writes, 1);
+	stat_add(&sink->stats->write_bytes, bytes);
+	stat_add(&sink->stats->write_ns, monotonic_ns() - start_ns);
+}
+
+/*
+ * write segments as records of a structured --format
+ * */
+bool
+out_sink_write_records (out_sink_t *sink, out_seg_t *segs, int num_segs,
+		const char *arena) {
+	struct iovec iov[OUT_MAX_SEGS];
+	const char *rec;
+	frame_hdr_t hdr;
+	size_t used = 0, need, len;
+	bool ok = true, partial;
+	char *d;
+	int i, n = 0;
+
+	for (i=0;ok && i<num_segs;i++) {
+		rec = segs[i].ptr ? segs[i].ptr : arena + segs[i].off;
+		len = segs[i].len;
+		partial = len == 0 || rec[len-1] != sink->delims[segs[i].file];
+		len -= partial ? 0 : 1;
+		need = sink->format == FORMAT_FRAME ? sizeof(hdr) + 8 : 6*len + 96;
+		if (n + 3 > OUT_MAX_SEGS || used + need > sink->scratch_cap) {
+			/* the iovecs point into the scratch, let them go first */
+			if (n > 0) {
+				ok = write_iov(sink, iov, n, false);
+			}
+			n = 0;
+			used = 0;
+			if (need > sink->scratch_cap) {
+				free(sink->scratch);
+				sink->scratch_cap = need > OUT_MAX_BYTES ? need : OUT_MAX_BYTES;
+				sink->scratch = malloc(sink->scratch_cap);
+			}
+		}
+		if (!sink->header[segs[i].file]) {
+			out_sink_announce(sink, segs[i].file);
+			iov[n].iov_base = sink->header[segs[i].file];
+			iov[n].iov_len = sink->header_len[segs[i].file];
+			n++;
+		}
+		d = sink->scratch + used;
+		if (segs[i].skipped) {
+			if (sink->format == FORMAT_FRAME) {
+				memset(&hdr, 0, sizeof(hdr));
+				hdr.len = sizeof(segs[i].skipped);
+				hdr.type = FRAME_SKIP;
+				hdr.file = segs[i].file;
+				hdr.offset = segs[i].pos;
+				hdr.recv_us = segs[i].recv_us;
+				memcpy(d, &hdr, sizeof(hdr));
+				memcpy(d + sizeof(hdr), &segs[i].skipped,
+						sizeof(segs[i].skipped));
+				d += sizeof(hdr) + sizeof(segs[i].skipped);
+			} else {
+				d = put_u64(put_str(d, "{\"file\":"), segs[i].file);
+				d = put_u64(put_str(d, ",\"offset\":"), segs[i].pos);
+				d = put_u64(put_str(d, ",\"recv_us\":"), segs[i].recv_us);
+				d = put_u64(put_str(d, ",\"skipped\":"), segs[i].skipped);
+				d = put_str(d, "}\n");
+			}
+			iov[n].iov_base = sink->scratch + used;
+			iov[n].iov_len = d - (sink->scratch + used);
+			n++;
+			used = d - sink->scratch;
+			continue;
+		}
+		if (sink->format == FORMAT_FRAME) {
+			hdr.len = len;
+			hdr.type = FRAME_RECORD;
+			hdr.flags = partial ? FRAME_PARTIAL : 0;
+			hdr.file = segs[i].file;
+			hdr.reserved = 0;
+			hdr.offset = segs[i].pos;
+			hdr.recv_us = segs[i].recv_us;
+			memcpy(d, &hdr, sizeof(hdr));
+			iov[n].iov_base = d;
+			iov[n].iov_len = sizeof(hdr);
+			iov[n+1].iov_base = (char *)rec;
+			iov[n+1].iov_len = len;
+			n += 2;
+			used += sizeof(hdr);
+			continue;
+		}
+		d = put_u64(put_str(d, "{\"file\":"), segs[i].file);
+		d = put_u64(put_str(d, ",\"offset\":"), segs[i].pos);
+		d = put_u64(put_str(d, ",\"recv_us\":"), segs[i].recv_us);
+		d = put_str(d, ",\"record\":\"");
+		d += json_escape(d, rec, len);
+		d = put_str(d, partial ? "\",\"partial\":true}\n" : "\"}\n");
+		if (n > 0 && (char *)iov[n-1].iov_base + iov[n-1].iov_len ==
+				sink->scratch + used) {
+			/* consecutive records are one run of the scratch */
+			iov[n-1].iov_len += d - (sink->scratch + used);
+		} else {
+			iov[n].iov_base = sink->scratch + used;
+			iov[n].iov_len = d - (sink->scratch + used);
+			n++;
+		}
+		used = d - sink->scratch;
+	}
+	if (ok && n > 0) {
+		ok = write_iov(sink, iov, n, false);
+	}
+	if (ok && sink->comp) {
+		ok = comp_submit(sink->comp);
+	}
+	if (!ok) {
+		dbg_printf("output: %s\n", strerror(errno));
+	}
+	return ok;
+}
+
+/*
+ * --serve: instead of writing the output, one instance publishes where it
+ * is in the files, and any number of --attach clients read the records
+ * straight out of their own mappings of the same files. Discovery, the
+ * frontier and rotation are dealt with once, a client only maps what the
+ * index points at.
+ *
+ * The shared memory holds a header, a table naming the file of each slot,
+ * and a ring of entries, one per mapped run the server emitted. The server
+ * is the only writer. An entry is a seqlock of its own: seq is 0 while it
+ * is rewritten and the number of the entry plus one after, a client that
+ * doesn't find the seq it expects before and after reading it was lapped.
+ * A table slot is rewritten with an odd gen, entries carry the gen of the
+ * slot they were published under so a client never reads them against
+ * the file that took the slot over. Clients map it all read-only.
+ *
+ * A server holds a lock on its index for as long as it runs. The index is
+ * built under a name of its own and only then put in place, over one
+ * nobody holds the lock of any more, so neither a second server nor a
+ * restart truncates a ring clients are reading.
+ * */
+typedef struct serve_hdr_ {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t num_entries;     /* a power of two */
+	uint32_t max_files;       /* slots in the file table */
+	int32_t pid;              /* of the server, clients stop when it is gone */
+	_Atomic uint32_t wake;    /* futex, bumped after entries were published */
+	_Alignas(64) _Atomic uint64_t head; /* entries published so far */
+} serve_hdr_t;
+
+typedef struct serve_file_ {
+	_Atomic uint32_t gen;     /* odd while the name is rewritten, 0 unused */
+	char name[MAX_ARG_SIZE];
+} serve_file_t;
+
+typedef struct serve_entry_ {
+	_Atomic uint64_t seq;
+	uint32_t file;            /* slot of the file table */
+	uint32_t gen;             /* of the slot when this was published */
+	uint64_t pos;             /* file offset of the run */
+	uint64_t len;
+} serve_entry_t;
+
+/* what a slot of the table was last published for */
+typedef struct serve_slot_ {
+	dev_t dev;
+	ino_t ino;
+	unsigned long reopens;
+} serve_slot_t;
+
+struct serve_ {
+	char path[MAX_ARG_SIZE + 16];
+	int fd;                   /* locked while we serve */
+	char *map;
+	size_t size;
+	serve_hdr_t *hdr;
+	serve_file_t *files;
+	serve_entry_t *entries;
+	uint64_t head;            /* entries published, the server's copy */
+	char **names;             /* params->files */
+	file_data_t *f_array;
+	serve_slot_t *slots;
+	int max_files;
+};
+
+/*
+ * the file behind a --serve/--attach name: a path, or one under /dev/shm
+ * */
+void
+serve_path (const char *name, char *path, size_t size) {
+	snprintf(path, size, "%s%s", strchr(name, '/') ? "" : "/dev/shm/", name);
+}
+
+/* bytes of the mapping up to the entries, and in all */
+static inline size_t
+serve_entries_off (uint32_t max_files) {
+	size_t off = sizeof(serve_hdr_t) + sizeof(serve_file_t)*max_files;
+	return (off + 63) & ~(size_t)63;
+}
+
+static inline size_t
+serve_size (uint32_t max_files, uint32_t num_entries) {
+	return serve_entries_off(max_files) + sizeof(serve_entry_t)*num_entries;
+}
+
+/*
+ * put the index built at tmp in place of s->path, unless a live server
+ * holds the lock of the one there. The lock of the one replaced is held
+ * until it is, a server that locked it after us finds it gone and looks
+ * again.
+ * */
+static bool
+serve_install (serve_t *s, const char *tmp) {
+	struct stat st, cur;
+	serve_hdr_t hdr;
+	int fd;
+
+	for (;;) {
+		fd = open(s->path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT) {
+				break;
+			}
+			if (link(tmp, s->path) == 0) {
+				return true;
+			}
+			if (errno != EEXIST) {
+				break;
+			}
+			continue;
+		}
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			if (errno == EWOULDBLOCK) {
+				if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+					hdr.pid = 0;
+				}
+				fprintf(stderr, "%s: served by pid %d\n", s->path,
+						(int)hdr.pid);
+				close(fd);
+				return false;
+			}
+			close(fd);
+			break;
+		}
+		if (fstat(fd, &st) == 0 && stat(s->path, &cur) == 0 &&
+				st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) {
+			/* left behind by a server that is gone */
+			dbg_printf("serve: replacing %s\n", s->path);
+			if (rename(tmp, s->path) == 0) {
+				close(fd);
+				return true;
+			}
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	fprintf(stderr, "%s: %s\n", s->path, strerror(errno));
+	return false;
+}
+
+bool
+serve_init (serve_t *s, mtail_params_t *params, file_data_t *f_array) {
+	char tmp[MAX_ARG_SIZE + 32];
+	bool ok;
+
+	memset(s, 0, sizeof(serve_t));
+	serve_path(params->serve, s->path, sizeof(s->path));
+	snprintf(tmp, sizeof(tmp), "%s.%d", s->path, (int)getpid());
+	s->size = serve_size(params->max_files, SERVE_ENTRIES);
+	s->fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (s->fd < 0 || flock(s->fd, LOCK_EX | LOCK_NB) != 0 ||
+			ftruncate(s->fd, s->size) != 0) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		if (s->fd >= 0) {
+			close(s->fd);
+			unlink(tmp);
+		}
+		return false;
+	}
+	s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd,
+			0);
+	if (s->map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		close(s->fd);
+		unlink(tmp);
+		return false;
+	}
+	s->hdr = (serve_hdr_t *)s->map;
+	s->files = (serve_file_t *)(s->map + sizeof(serve_hdr_t));
+	s->entries = (serve_entry_t *)(s->map +
+			serve_entries_off(params->max_files));
+	s->names = params->files;
+	s->f_array = f_array;
+	s->max_files = params->max_files;
+	s->slots = calloc(params->max_files, sizeof(serve_slot_t));
+	s->hdr->version = SERVE_VERSION;
+	s->hdr->num_entries = SERVE_ENTRIES;
+	s->hdr->max_files = params->max_files;
+	s->hdr->pid = getpid();
+	/* clients check the magic last */
+	atomic_thread_fence(memory_order_release);
+	s->hdr->magic = SERVE_MAGIC;
+	ok = serve_install(s, tmp);
+	unlink(tmp);
+	if (!ok) {
+		munmap(s->map, s->size);
+		close(s->fd);
+		free(s->slots);
+		return false;
+	}
+	dbg_printf("serve: %s, %u entries, %d file slot(s)\n", s->path,
+			SERVE_ENTRIES, s->max_files);
+	return true;
+}
+
+/*
+ * the clients keep what they mapped, new ones find nothing to attach to.
+ * Nobody replaces the index while we hold its lock, if it isn't ours it
+ * was removed by hand, the name isn't ours to unlink then.
+ * */
+void
+serve_free (serve_t *s) {
+	struct stat st, cur;
+	dbg_printf("serve: published %llu entries\n",
+			(unsigned long long)s->head);
+	if (fstat(s->fd, &st) == 0 && stat(s->path, &cur) == 0 &&
+			st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) {
+		unlink(s->path);
+	}
+	munmap(s->map, s->size);
+	close(s->fd);
+	free(s->slots);
+}
+
+/*
+ * name the file in slot i in the table again if it isn't the one the slot
+ * was published for. The readers sync their output before they reopen a
+ * file or give up its slot, so the slot is never older than the segment.
+ * */
+static void
+serve_name (serve_t *s, int i) {
+	file_data_t *fdata = &s->f_array[i];
+	serve_slot_t *slot = &s->slots[i];
+	serve_file_t *file = &s->files[i];
+	uint32_t gen = atomic_load_explicit(&file->gen, memory_order_relaxed);
+
+	if (gen && slot->dev == fdata->dev && slot->ino == fdata->ino &&
+			slot->reopens == fdata->reopens &&
+			strcmp(file->name, s->names[i]) == 0) {
+		return;
+	}
+	atomic_store_explicit(&file->gen, gen + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	snprintf(file->name, sizeof(file->name), "%s", s->names[i]);
+	atomic_store_explicit(&file->gen, gen + 2, memory_order_release);
+	slot->dev = fdata->dev;
+	slot->ino = fdata->ino;
+	slot->reopens = fdata->reopens;
+	dbg_printf("serve: slot %d is %s\n", i, s->names[i]);
+}
+
+/*
+ * publish the mapped runs of a batch. Copied segments (skip notices, the
+ * bytes of a stdio read) aren't anywhere a client could map, the client
+ * sees the gap and notes it.
+ * */
+void
+serve_publish (serve_t *s, out_seg_t *segs, int num_segs) {
+	serve_entry_t *e;
+	uint32_t mask = SERVE_ENTRIES - 1;
+	int i, last = -1;
+
+	for (i=0;i<num_segs;i++) {
+		if (!segs[i].ptr || segs[i].len == 0 || segs[i].file < 0) {
+			continue;
+		}
+		if (segs[i].file != last) {
+			serve_name(s, segs[i].file);
+			last = segs[i].file;
+		}
+		e = &s->entries[s->head & mask];
+		atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		e->file = segs[i].file;
+		e->gen = atomic_load_explicit(&s->files[last].gen,
+				memory_order_relaxed);
+		e->pos = segs[i].pos;
+		e->len = segs[i].len;
+		atomic_store_explicit(&e->seq, s->head + 1, memory_order_release);
+		s->head++;
+	}
+	if (last < 0) {
+		return;
+	}
+	atomic_store_explicit(&s->hdr->head, s->head, memory_order_release);
+	/* a client that saw the old wake sees the new head, or sleeps */
+	atomic_fetch_add_explicit(&s->hdr->wake, 1, memory_order_release);
+	syscall(SYS_futex, &s->hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * write segments to the sink, with headers where the file changes
+ * */
+bool
+out_sink_write (out_sink_t *sink, out_seg_t *segs, int num_segs,
+		const char *arena) {
+	struct iovec iov[OUT_MAX_SEGS];
+	bool ok = true;
+	bool mapped, need_header;
+	bool runs = sink->splice || sink->zerocopy;
+	uint64_t start_ns = monotonic_ns();
+	int i = 0, n;
+
+	if (sink->fresh) {
+		/* a new connection, the peer hasn't seen any header yet */
+		sink->fresh = false;
+		sink->last_file = -1;
+		for (n=0;sink->format != FORMAT_TEXT && n<sink->num_files;n++) {
+			free(sink->header[n]);
+			sink->header[n] = NULL;
+		}
+	}
+	if (sink->serve) {
+		serve_publish(sink->serve, segs, num_segs);
+		out_sink_account(sink, segs, num_segs, start_ns);
+		return true;
+	}
+	if (sink->format != FORMAT_TEXT) {
+		ok = out_sink_write_records(sink, segs, num_segs, arena);
+		out_sink_account(sink, segs, num_segs, start_ns);
+		return ok;
+	}
+	while (ok && i < num_segs) {
+		/*
+		 * vmsplice and zerocopy runs hold mapping-backed bytes only,
+		 * headers and arena bytes are heap memory that must never be
+		 * spliced, and is freed before a zerocopy send completes
+		 * */
+		mapped = runs && segs[i].ptr != NULL &&
+				!(sink->headers && segs[i].file != sink->last_file);
+		for (n = 0; i < num_segs && n < OUT_MAX_SEGS-1; i++) {
+			need_header = sink->headers && segs[i].file != sink->last_file;
+			if (mapped && (need_header || !segs[i].ptr)) {
+				break;
+			}
+			if (!mapped && runs && segs[i].ptr && !need_header && n > 0) {
+				break;
+			}
+			if (need_header) {
+				iov[n].iov_base = (char *)out_sink_header(sink, segs[i].file);
+				iov[n].iov_len = strlen(iov[n].iov_base);
+				sink->last_file = segs[i].file;
+				n++;
+			}
+			iov[n].iov_base = segs[i].ptr ? (char *)segs[i].ptr :
+					(char *)arena + segs[i].off;
+			iov[n].iov_len = segs[i].len;
+			n++;
+		}
+		ok = write_iov(sink, iov, n, mapped);
+	}
+	if (ok && sink->comp) {
+		ok = comp_submit(sink->comp);
+	}
+	if (!ok) {
+		dbg_printf("output: %s\n", strerror(errno));
+	}
+	out_sink_account(sink, segs, num_segs, start_ns);
+	return ok;
+}
+
+/*
+ * write out or hand over everything pending
+ * */
+bool
+out_flush (out_batch_t *out) {
+	struct timespec ts = { 0, 50000 };
+	out_node_t *node;
+	bool ok = true;
+	uint64_t one = 1;
+
+	if (out->num_segs == 0) {
+		return true;
+	}
+	if (!out->queue) {
+		ok = out_sink_write(out->sink, out->segs, out->num_segs, out->arena);
+		out->num_segs = 0;
+		out->arena_len = 0;
+		out->bytes = 0;
+		return ok;
+	}
+	while (atomic_load_explicit(&out->pushed, memory_order_relaxed) -
+			atomic_load_explicit(&out->written, memory_order_acquire) >=
+			OUT_MAX_INFLIGHT) {
+		/* backpressure, the writer can't keep up with the sink */
+		nanosleep(&ts, NULL);
+	}
+	/* the node takes over the buffers, the writer frees them */
+	node = malloc(sizeof(out_node_t));
+	node->owner = out;
+	node->segs = out->segs;
+	node->num_segs = out->num_segs;
+	node->arena = out->arena;
+	out->segs = NULL;
+	out->segs_cap = 0;
+	out->num_segs = 0;
+	out->arena = NULL;
+	out->arena_cap = 0;
+	out->arena_len = 0;
+	out->bytes = 0;
+	atomic_fetch_add_explicit(&out->pushed, 1, memory_order_relaxed);
+	out_queue_push(out->queue, node);
+	if (write(out->queue->efd, &one, sizeof(one)) < 0) {
+		/* the counter is saturated, the writer is awake anyway */
+	}
+	return ok;
+}
+
+void filter_detach (filter_t *f);
+
+/*
+ * flush, and with -j wait until the writer is done with everything this
+ * batch handed over. Must be called before any mapping that segments may
+ * point into is unmapped, the records the filter holds in mappings are
+ * copied aside too.
+ * */
+bool
+out_sync (out_batch_t *out) {
+	struct timespec ts = { 0, 50000 };
+	bool ok;
+
+	if (out->filter) {
+		filter_detach(out->filter);
+	}
+	ok = out_flush(out);
+	while (out->queue &&
+			atomic_load_explicit(&out->written, memory_order_acquire) !=
+			atomic_load_explicit(&out->pushed, memory_order_relaxed)) {
+		nanosleep(&ts, NULL);
+	}
+	return ok;
+}
+
+/*
+ * add a segment, merging it with the previous one if contiguous
+ * */
+void
+out_add_seg (out_batch_t *out, const char *ptr, size_t off, size_t len) {
+	out_seg_t *last = out->num_segs ? &out->segs[out->num_segs-1] : NULL;
+	if (out->num_segs == 0) {
+		out->first_us = out->latency_us > 0 ? monotonic_us() : 0;
+	}
+	out->bytes += len;
+	if (last && last->file == out->cur_file && out->format == FORMAT_TEXT &&
+			((ptr && last->ptr && last->ptr + last->len == ptr) ||
+			(!ptr && !last->ptr && last->off + last->len == off))) {
+		last->len += len;
+		return;
+	}
+	if (out->num_segs == out->segs_cap) {
+		out->segs_cap = out->segs_cap ? out->segs_cap*2 : 64;
+		out->segs = realloc(out->segs, sizeof(out_seg_t)*out->segs_cap);
+	}
+	out->segs[out->num_segs].ptr = ptr;
+	out->segs[out->num_segs].off = off;
+	out->segs[out->num_segs].len = len;
+	out->segs[out->num_segs].file = out->cur_file;
+	out->segs[out->num_segs].pos = out->rec_pos;
+	out->segs[out->num_segs].recv_us = out->recv_us;
+	out->segs[out->num_segs].skipped = 0;
+	out->num_segs++;
+}
+
+/*
+ * flush early if the batch grew big or its oldest data waited too long
+ * */
+void
+out_maybe_flush (out_batch_t *out) {
+	int scale = out->lagging ? OUT_CATCHUP_SCALE : 1;
+	if (out->num_segs >= scale*OUT_MAX_SEGS/2 ||
+			out->bytes >= (size_t)scale*OUT_MAX_BYTES ||
+			(out->latency_us > 0 && !out->lagging &&
+			monotonic_us() - out->first_us >= (uint64_t)out->latency_us)) {
+		out_flush(out);
+	}
+}
+
+/*
+ * copy bytes into the batch arena
+ * */
+void
+out_add_copy (out_batch_t *out, const char *buf, size_t len) {
+	if (out->arena_len + len > out->arena_cap) {
+		while (out->arena_len + len > out->arena_cap) {
+			out->arena_cap = out->arena_cap ? out->arena_cap*2 : BUF_CHUNK_SIZE;
+		}
+		out->arena = realloc(out->arena, out->arena_cap);
+	}
+	memcpy(out->arena + out->arena_len, buf, len);
+	out_add_seg(out, NULL, out->arena_len, len);
+	out->arena_len += len;
+	out_maybe_flush(out);
+}
+
+/*
+ * note that skipped bytes of the current file are missing before pos:
+ * a line of its own in text, a record of its own in a structured format
+ * */
+void
+out_add_skip (out_batch_t *out, const char *name, uint64_t pos,
+		uint64_t skipped) {
+	char buf[MAX_ARG_SIZE + 64];
+	int n;
+	if (out->format == FORMAT_TEXT) {
+		n = snprintf(buf, sizeof(buf), "mtail-f: %s: skipped %llu bytes\n",
+				name, (unsigned long long)skipped);
+		out_add_copy(out, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf)-1);
+		return;
+	}
+	out->rec_pos = pos;
+	out->recv_us = realtime_us();
+	out_add_seg(out, NULL, out->arena_len, 0);
+	out->segs[out->num_segs-1].skipped = skipped;
+	out_maybe_flush(out);
+}
+
+/*
+ * the following output belongs to file index
+ * */
+void
+out_switch_file (out_batch_t *out, int index) {
+	out->cur_file = index;
+}
+
+/*
+ * the following bytes start at offset pos of the current file, the record
+ * offsets of a structured --format count from there
+ * */
+static inline void
+out_seek (out_batch_t *out, uint64_t pos) {
+	out->pos = pos;
+}
+
+/*
+ * --merge: records of every file are held back for the reorder window and
+ * then released in timestamp order. Each file is assumed to be ordered
+ * already, so a binary heap over the oldest pending record of each file
+ * is a k-way merge. A record that doesn't start with a timestamp (a
+ * continuation line, say) sorts with the record before it.
+ * */
+typedef struct merge_rec_ {
+	size_t off;           /* start of the record in the stream buffer */
+	size_t len;
+	int64_t ts;           /* timestamp in us */
+	uint64_t arrival_us;  /* when the record was emitted by the engine */
+	uint64_t pos;         /* offset in the file, see out_seg_t */
+	int64_t recv_us;
+} merge_rec_t;
+
+typedef struct merge_stream_ {
+	char *buf;            /* pending records, then an incomplete one */
+	size_t len;
+	size_t cap;
+	size_t partial;       /* offset of the incomplete record */
+	uint64_t partial_pos; /* its offset in the file */
+	int64_t partial_us;
+	merge_rec_t *recs;    /* pending complete records, oldest at rec_head */
+	int rec_head;
+	int num_recs;
+	int recs_cap;
+	int64_t last_ts;
+	int heap_pos;         /* -1 while there is nothing to release */
+} merge_stream_t;
+
+struct merge_ {
+	merge_stream_t *streams;
+	int num_streams;
+	int *heap;            /* streams ordered by their oldest record */
+	int heap_len;
+	const char *delims;   /* per stream, params->delims */
+	long window_us;
+	const char *ts_format;
+	unsigned long unparsed; /* records without a timestamp, for -v */
+};
+
+/* days since 1970-01-01 of a proleptic gregorian date */
+static inline int64_t
+days_from_civil (int64_t y, unsigned m, unsigned d) {
+	int64_t era;
+	unsigned yoe, doy, doe;
+	y -= m <= 2;
+	era = (y >= 0 ? y : y-399) / 400;
+	yoe = (unsigned)(y - era * 400);
+	doy = (153*(m > 2 ? m-3 : m+9) + 2)/5 + d-1;
+	doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+/* parse up to n digits, false if there are fewer */
+static inline bool
+parse_digits (const char **p, const char *end, int n, int *value) {
+	int v = 0;
+	while (n-- > 0) {
+		if (*p >= end || **p < '0' || **p > '9') {
+			return false;
+		}
+		v = v*10 + (*(*p)++ - '0');
+	}
+	*value = v;
+	return true;
+}
+
+/* optional .ffffff or ,ffffff after the seconds, in us */
+static inline int64_t
+parse_fraction (const char **p, const char *end) {
+	int64_t us = 0;
+	int scale = 100000;
+	if (*p < end && (**p == '.' || **p == ',')) {
+		for ((*p)++; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+			us += (**p - '0') * scale;
+			scale /= 10;
+		}
+	}
+	return us;
+}
+
+/*
+ * leading timestamp of a record in us: "iso" is YYYY-MM-DD[T ]HH:MM:SS[.f],
+ * "epoch" is seconds[.f] since 1970, anything else a strptime(3) format
+ * followed by an optional fraction. An opening '[' is skipped.
+ * */
+bool
+merge_parse_ts (const char *format, const char *rec, size_t len,
+		int64_t *ts) {
+	const char *p = rec, *end = rec + (len < 64 ? len : 64);
+	int y, mo, d, h, mi, sec;
+	char buf[65];
+	struct tm tm;
+	char *rest;
+	int64_t v = 0;
+
+	if (p < end && *p == '[') {
+		p++;
+	}
+	if (strcmp(format, "iso") == 0) {
+		if (!parse_digits(&p, end, 4, &y) || p >= end || *p++ != '-' ||
+				!parse_digits(&p, end, 2, &mo) || p >= end || *p++ != '-' ||
+				!parse_digits(&p, end, 2, &d) || p >= end ||
+				(*p != 'T' && *p != ' ')) {
+			return false;
+		}
+		p++;
+		if (!parse_digits(&p, end, 2, &h) || p >= end || *p++ != ':' ||
+				!parse_digits(&p, end, 2, &mi) || p >= end || *p++ != ':' ||
+				!parse_digits(&p, end, 2, &sec)) {
+			return false;
+		}
+		*ts = ((days_from_civil(y, mo, d)*24 + h)*60 + mi)*60 + sec;
+		*ts = *ts * 1000000 + parse_fraction(&p, end);
+		return true;
+	}
+	if (strcmp(format, "epoch") == 0) {
+		if (p >= end || *p < '0' || *p > '9') {
+			return false;
+		}
+		while (p < end && *p >= '0' && *p <= '9') {
+			v = v*10 + (*p++ - '0');
+		}
+		*ts = v * 1000000 + parse_fraction(&p, end);
+		return true;
+	}
+	memcpy(buf, p, end - p);
+	buf[end - p] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if ((rest = strptime(buf, format, &tm)) == NULL) {
+		return false;
+	}
+	p += rest - buf;
+	*ts = (int64_t)timegm(&tm) * 1000000 + parse_fraction(&p, end);
+	return true;
+}
+
+void
+merge_init (merge_t *m, mtail_params_t *params) {
+	int i;
+	memset(m, 0, sizeof(merge_t));
+	m->num_streams = params->max_files;
+	m->streams = calloc(m->num_streams, sizeof(merge_stream_t));
+	m->heap = malloc(sizeof(int) * (m->num_streams + 1));
+	m->delims = params->delims;
+	m->window_us = params->merge_window_us;
+	m->ts_format = params->merge_ts;
+	for (i=0;i<m->num_streams;i++) {
+		m->streams[i].heap_pos = -1;
+		m->streams[i].last_ts = INT64_MIN;
+	}
+}
+
+void
+merge_free (merge_t *m) {
+	int i;
+	for (i=0;i<m->num_streams;i++) {
+		free(m->streams[i].buf);
+		free(m->streams[i].recs);
+	}
+	free(m->streams);
+	free(m->heap);
+}
+
+/* order of the heap: oldest timestamp first, ties by file index */
+static inline bool
+merge_before (merge_t *m, int a, int b) {
+	merge_stream_t *sa = &m->streams[a], *sb = &m->streams[b];
+	int64_t ta = sa->recs[sa->rec_head].ts, tb = sb->recs[sb->rec_head].ts;
+	return ta < tb || (ta == tb && a < b);
+}
+
+static inline void
+merge_heap_set (merge_t *m, int pos, int stream) {
+	m->heap[pos] = stream;
+	m->streams[stream].heap_pos = pos;
+}
+
+void
+merge_sift_up (merge_t *m, int pos) {
+	int stream = m->heap[pos];
+	while (pos > 0 && merge_before(m, stream, m->heap[(pos-1)/2])) {
+		merge_heap_set(m, pos, m->heap[(pos-1)/2]);
+		pos = (pos-1)/2;
+	}
+	merge_heap_set(m, pos, stream);
+}
+
+void
+merge_sift_down (merge_t *m, int pos) {
+	int stream = m->heap[pos];
+	int child;
+	while ((child = 2*pos + 1) < m->heap_len) {
+		if (child + 1 < m->heap_len &&
+				merge_before(m, m->heap[child+1], m->heap[child])) {
+			child++;
+		}
+		if (!merge_before(m, m->heap[child], stream)) {
+			break;
+		}
+		merge_heap_set(m, pos, m->heap[child]);
+		pos = child;
+	}
+	merge_heap_set(m, pos, stream);
+}
+
+/*
+ * queue a complete record of stream i
+ * */
+void
+merge_push_rec (merge_t *m, int i, size_t off, size_t len, uint64_t now) {
+	merge_stream_t *st = &m->streams[i];
+	merge_rec_t *rec;
+	int64_t ts;
+
+	if (st->num_recs == st->recs_cap) {
+		if (st->rec_head > 0) {
+			/* reuse the slots of released records */
+			memmove(st->recs, st->recs + st->rec_head,
+					sizeof(merge_rec_t) * (st->num_recs - st->rec_head));
+			st->num_recs -= st->rec_head;
+			st->rec_head = 0;
+		}
+		if (st->num_recs == st->recs_cap) {
+			st->recs_cap = st->recs_cap ? st->recs_cap*2 : 64;
+			st->recs = realloc(st->recs, sizeof(merge_rec_t)*st->recs_cap);
+		}
+	}
+	if (merge_parse_ts(m->ts_format, st->buf + off, len, &ts)) {
+		st->last_ts = ts;
+	} else {
+		m->unparsed++;
+	}
+	rec = &st->recs[st->num_recs++];
+	rec->off = off;
+	rec->len = len;
+	rec->ts = st->last_ts;
+	rec->arrival_us = now;
+	rec->pos = st->partial_pos;
+	rec->recv_us = st->partial_us;
+	if (st->heap_pos < 0) {
+		m->heap_len++;
+		merge_heap_set(m, m->heap_len-1, i);
+		merge_sift_up(m, m->heap_len-1);
+	}
+}
+
+/*
+ * take bytes the engine emitted for file i, split them into records. pos
+ * and recv_us are those of the first byte. With whole set buf is a single
+ * record, --multiline put its lines together already.
+ * */
+void
+merge_feed (merge_t *m, int i, const char *buf, size_t len, uint64_t pos,
+		int64_t recv_us, bool whole) {
+	merge_stream_t *st = &m->streams[i];
+	uint64_t now = monotonic_us();
+	const char *nl;
+	size_t shift;
+	int k;
+
+	/* drop released bytes before growing */
+	if (st->len + len > st->cap) {
+		shift = st->rec_head < st->num_recs ? st->recs[st->rec_head].off :
+				st->partial;
+		if (shift > 0) {
+			memmove(st->buf, st->buf + shift, st->len - shift);
+			st->len -= shift;
+			st->partial -= shift;
+			for (k=st->rec_head;k<st->num_recs;k++) {
+				st->recs[k].off -= shift;
+			}
+		}
+	}
+	if (st->len + len > st->cap) {
+		while (st->len + len > st->cap) {
+			st->cap = st->cap ? st->cap*2 : BUF_CHUNK_SIZE;
+		}
+		st->buf = realloc(st->buf, st->cap);
+	}
+	if (st->partial == st->len) {
+		st->partial_pos = pos;
+		st->partial_us = recv_us;
+	}
+	memcpy(st->buf + st->len, buf, len);
+	st->len += len;
+	if (whole && st->partial == st->len - len) {
+		merge_push_rec(m, i, st->partial, len, now);
+		st->partial_pos += len;
+		st->partial = st->len;
+		return;
+	}
+	while ((nl = memchr(st->buf + st->partial, m->delims[i],
+			st->len - st->partial)) != NULL) {
+		merge_push_rec(m, i, st->partial, nl + 1 - (st->buf + st->partial),
+				now);
+		st->partial_pos += nl + 1 - (st->buf + st->partial);
+		st->partial = nl + 1 - st->buf;
+	}
+}
+
+/*
+ * release the records whose window passed, all of them if force is set.
+ * With force incomplete trailing records go out as well.
+ * */
+void
+merge_release (merge_t *m, out_batch_t *out, bool force) {
+	merge_stream_t *st;
+	merge_rec_t *rec;
+	uint64_t now = monotonic_us();
+	int i;
+
+	while (m->heap_len > 0) {
+		i = m->heap[0];
+		st = &m->streams[i];
+		rec = &st->recs[st->rec_head];
+		if (!force && rec->arrival_us + m->window_us > now) {
+			break;
+		}
+		out_switch_file(out, i);
+		out->rec_pos = rec->pos;
+		out->recv_us = rec->recv_us;
+		out_add_copy(out, st->buf + rec->off, rec->len);
+		if (++st->rec_head < st->num_recs) {
+			merge_sift_down(m, 0);
+			continue;
+		}
+		st->rec_head = st->num_recs = 0;
+		st->heap_pos = -1;
+		if (--m->heap_len > 0) {
+			merge_heap_set(m, 0, m->heap[m->heap_len]);
+			merge_sift_down(m, 0);
+		}
+	}
+	if (!force) {
+		return;
+	}
+	for (i=0;i<m->num_streams;i++) {
+		st = &m->streams[i];
+		if (st->partial < st->len) {
+			out_switch_file(out, i);
+			out->rec_pos = st->partial_pos;
+			out->recv_us = st->partial_us;
+			out_add_copy(out, st->buf + st->partial, st->len - st->partial);
+		}
+		st->len = st->partial = 0;
+	}
+}
+
+/*
+ * us until the next record is due, -1 if nothing is pending
+ * */
+long
+merge_wait_limit (merge_t *m) {
+	merge_stream_t *st;
+	int64_t due;
+	if (m->heap_len == 0) {
+		return -1;
+	}
+	st = &m->streams[m->heap[0]];
+	due = (int64_t)(st->recs[st->rec_head].arrival_us + m->window_us -
+			monotonic_us());
+	return due > 0 ? (long)due : 0;
+}
+
+/*
+ * number of delim bytes in buf, for the records counter
+ * */
+static inline uint64_t
+count_delims (const char *buf, size_t len, char delim) {
+	uint64_t n = 0;
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i vd = _mm_set1_epi8(delim);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vd)));
+	}
+#endif
+	for (; i < len; i++) {
+		n += buf[i] == delim;
+	}
+	return n;
+}
+
+/*
+ * count bytes that passed the filter against the current file
+ * */
+static inline void
+out_count (out_batch_t *out, const char *buf, size_t len) {
+	file_stats_t *st;
+	if (out->stats && out->cur_file >= 0) {
+		st = &out->stats[out->cur_file];
+		stat_add(&st->bytes, len);
+		stat_add(&st->records, out->whole_records ? 1 :
+				count_delims(buf, len, out->delims[out->cur_file]));
+	}
+}
+
+/*
+ * hand bytes that passed the filter to the merge or the batch, pos is the
+ * file offset of the first one
+ * */
+void
+out_pass_copy (out_batch_t *out, const char *buf, size_t len, uint64_t pos) {
+	out_count(out, buf, len);
+	if (out->merge) {
+		merge_feed(out->merge, out->cur_file, buf, len, pos, out->recv_us,
+				out->whole_records);
+		return;
+	}
+	out->rec_pos = pos;
+	out_add_copy(out, buf, len);
+}
+
+void
+out_pass_mapped (out_batch_t *out, const char *ptr, size_t len,
+		uint64_t pos) {
+	out_count(out, ptr, len);
+	if (out->merge) {
+		merge_feed(out->merge, out->cur_file, ptr, len, pos, out->recv_us,
+				out->whole_records);
+		return;
+	}
+	out->rec_pos = pos;
+	out_add_seg(out, ptr, 0, len);
+	out_maybe_flush(out);
+}
+
+/*
+ * -e/-f filter. Patterns without regex special characters are literals,
+ * all of them go into one Aho-Corasick automaton that is run over each
+ * record; the others are POSIX extended regexes matched in place with
+ * REG_STARTEND. A record is printed if any pattern matches. Records are
+ * matched where they are, so the rejected ones from a mapping are never
+ * copied, the accepted ones are still emitted in place. Only the start of
+ * a record that is still incomplete is copied aside until its delimiter
+ * shows up. A structured --format needs whole records too, there the
+ * filter runs without patterns and takes every record.
+ *
+ * --multiline puts the lines of a record (a stack trace, say) together
+ * before it is matched: a line that continues the record before it is
+ * appended to it, any other line completes that record and starts the
+ * next one. A record read from a mapping is held as a span of it, it is
+ * only copied aside when the mapping may go away, see out_sync(). So a
+ * trace is emitted in place like any single line. The last record of a
+ * file is complete once nothing was added to it for
+ * --multiline-timeout, and --max-record cuts records that grow too big.
+ * */
+typedef struct ac_ {
+	int (*go)[256];      /* transitions, complete after ac_build */
+	int *fail;
+	bool *match;         /* a pattern ends in this state */
+	int num_states;
+	int cap;
+} ac_t;
+
+typedef struct filter_carry_ {
+	char *buf;           /* start of an incomplete record */
+	size_t len;
+	size_t cap;
+	uint64_t pos;        /* its offset in the file */
+	const char *span;    /* --multiline: the record in a mapping, not buf */
+	size_t body;         /* --multiline: bytes before its incomplete line */
+	uint64_t since_us;   /* --multiline: when it last grew */
+} filter_carry_t;
+
+struct filter_ {
+	ac_t ac;
+	bool match_all;      /* no patterns, records are only put together */
+	bool has_literals;
+	regex_t *regexes;
+	int num_regexes;
+	const char *delims;  /* per file, params->delims */
+	size_t max_record;   /* an incomplete record is matched at this size */
+	filter_carry_t *carry; /* per file */
+	int num_files;
+	int multiline;       /* MULTILINE_* */
+	regex_t start_re;    /* MULTILINE_START */
+	long timeout_us;
+	int num_pending;     /* --multiline: carries holding a record */
+	unsigned long matched; /* statistics for -v */
+	unsigned long rejected;
+	unsigned long cut;   /* records cut at max_record */
+};
+
+int
+ac_new_state (ac_t *ac) {
+	if (ac->num_states == ac->cap) {
+		ac->cap = ac->cap ? ac->cap*2 : 64;
+		ac->go = realloc(ac->go, sizeof(*ac->go) * ac->cap);
+		ac->fail = realloc(ac->fail, sizeof(int) * ac->cap);
+		ac->match = realloc(ac->match, sizeof(bool) * ac->cap);
+	}
+	memset(ac->go[ac->num_states], -1, sizeof(*ac->go));
+	ac->fail[ac->num_states] = 0;
+	ac->match[ac->num_states] = false;
+	return ac->num_states++;
+}
+
+void
+ac_add (ac_t *ac, const char *pat, size_t len) {
+	int state = 0, next;
+	unsigned char c;
+	if (ac->num_states == 0) {
+		ac_new_state(ac);
+	}
+	while (len--) {
+		c = (unsigned char)*pat++;
+		if ((next = ac->go[state][c]) < 0) {
+			next = ac_new_state(ac);
+			ac->go[state][c] = next;
+		}
+		state = next;
+	}
+	ac->match[state] = true;
+}
+
+/*
+ * breadth first over the trie, turn it into a DFA
+ * */
+void
+ac_build (ac_t *ac) {
+	int *queue = malloc(sizeof(int) * ac->num_states);
+	int head = 0, tail = 0;
+	int state, next, c;
+
+	for (c = 0; c < 256; c++) {
+		if ((next = ac->go[0][c]) < 0) {
+			ac->go[0][c] = 0;
+		} else {
+			ac->fail[next] = 0;
+			queue[tail++] = next;
+		}
+	}
+	while (head < tail) {
+		state = queue[head++];
+		ac->match[state] |= ac->match[ac->fail[state]];
+		for (c = 0; c < 256; c++) {
+			if ((next = ac->go[state][c]) < 0) {
+				ac->go[state][c] = ac->go[ac->fail[state]][c];
+			} else {
+				ac->fail[next] = ac->go[ac->fail[state]][c];
+				queue[tail++] = next;
+			}
+		}
+	}
+	free(queue);
+}
+
+static inline bool
+ac_search (const ac_t *ac, const char *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	const unsigned char *end = p + len;
+	int state = 0;
+	while (p < end) {
+		state = ac->go[state][*p++];
+		if (__builtin_expect(ac->match[state], 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * patterns without regex special characters go into the automaton
+ * */
+static inline bool
+pattern_is_literal (const char *pattern) {
+	return strpbrk(pattern, ".[]()*+?{}|^$\\") == NULL;
+}
+
+void
+filter_init (filter_t *f, mtail_params_t *params) {
+	int i;
+
+	memset(f, 0, sizeof(filter_t));
+	f->delims = params->delims;
+	f->match_all = params->num_patterns == 0;
+	f->max_record = params->max_record ? params->max_record :
+			params->max_buffer;
+	f->multiline = params->multiline;
+	f->timeout_us = params->multiline_timeout_us;
+	f->num_files = params->max_files;
+	f->carry = calloc(f->num_files, sizeof(filter_carry_t));
+	f->regexes = malloc(sizeof(regex_t) * params->num_patterns);
+	for (i=0;i<params->num_patterns;i++) {
+		if (pattern_is_literal(params->patterns[i])) {
+			ac_add(&f->ac, params->patterns[i], strlen(params->patterns[i]));
+			f->has_literals = true;
+			continue;
+		}
+		/* checked by parse_opts */
+		regcomp(&f->regexes[f->num_regexes++], params->patterns[i],
+				REG_EXTENDED | REG_NOSUB);
+	}
+	if (f->has_literals) {
+		ac_build(&f->ac);
+	}
+	if (f->multiline == MULTILINE_START) {
+		/* checked by parse_opts */
+		regcomp(&f->start_re, params->multiline_re, REG_EXTENDED | REG_NOSUB);
+	}
+	dbg_printf("filter: %d state automaton, %d regex(es)\n",
+			f->ac.num_states, f->num_regexes);
+}
+
+void
+filter_free (filter_t *f) {
+	int i;
+	for (i=0;i<f->num_regexes;i++) {
+		regfree(&f->regexes[i]);
+	}
+	if (f->multiline == MULTILINE_START) {
+		regfree(&f->start_re);
+	}
+	for (i=0;i<f->num_files;i++) {
+		free(f->carry[i].buf);
+	}
+	free(f->regexes);
+	free(f->carry);
+	free(f->ac.go);
+	free(f->ac.fail);
+	free(f->ac.match);
+}
+
+/*
+ * does the record match a pattern. Its delim is left out, so that $
+ * anchors at the end of the record.
+ * */
+bool
+filter_match (filter_t *f, const char *rec, size_t len, char delim) {
+	regmatch_t m;
+	int i;
+	if (f->match_all) {
+		return true;
+	}
+	if (len > 0 && rec[len-1] == delim) {
+		len--;
+	}
+	if (f->has_literals && ac_search(&f->ac, rec, len)) {
+		return true;
+	}
+	for (i=0;i<f->num_regexes;i++) {
+		m.rm_so = 0;
+		m.rm_eo = len;
+		if (regexec(&f->regexes[i], rec, 1, &m, REG_STARTEND) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+filter_carry (filter_carry_t *c, const char *buf, size_t len) {
+	if (c->len + len > c->cap) {
+		while (c->len + len > c->cap) {
+			c->cap = c->cap ? c->cap*2 : BUF_CHUNK_SIZE;
+		}
+		c->buf = realloc(c->buf, c->cap);
+	}
+	memcpy(c->buf + c->len, buf, len);
+	c->len += len;
+}
+
+/*
+ * complete the carried record of the current file with the bytes up to
+ * the first delim, returns how many bytes were used
+ * */
+size_t
+filter_finish_carry (filter_t *f, out_batch_t *out, const char *buf,
+		size_t len) {
+	filter_carry_t *c = &f->carry[out->cur_file];
+	const char *d = memchr(buf, f->delims[out->cur_file], len);
+	size_t used = d ? (size_t)(d - buf) + 1 : len;
+
+	filter_carry(c, buf, used);
+	if (!d && c->len < f->max_record) {
+		return used;
+	}
+	if (filter_match(f, c->buf, c->len, f->delims[out->cur_file])) {
+		out_pass_copy(out, c->buf, c->len, c->pos);
+		f->matched++;
+	} else {
+		f->rejected++;
+	}
+	c->len = 0;
+	return used;
+}
+
+/*
+ * --multiline: does the complete line continue the record before it
+ * */
+static inline bool
+filter_continues (filter_t *f, const char *line, size_t len, char delim) {
+	regmatch_t m;
+	if (len > 0 && line[len-1] == delim) {
+		len--;
+	}
+	if (f->multiline == MULTILINE_INDENT) {
+		return len > 0 && (line[0] == ' ' || line[0] == '\t');
+	}
+	m.rm_so = 0;
+	m.rm_eo = len;
+	return regexec(&f->start_re, line, 1, &m, REG_STARTEND) != 0;
+}
+
+/*
+ * --multiline: copy the carried record out of the mapping it is held in
+ * */
+static inline void
+filter_unspan (filter_carry_t *c) {
+	const char *span = c->span;
+	size_t len = c->len;
+	c->span = NULL;
+	c->len = 0;
+	filter_carry(c, span, len);
+}
+
+/*
+ * --multiline: add bytes to the carried record of the current file. Bytes
+ * of a mapping that follow its span extend it, anything else means the
+ * record is copied from then on.
+ * */
+void
+filter_hold (filter_t *f, filter_carry_t *c, const char *buf, size_t len,
+		uint64_t pos, bool mapped) {
+	if (c->len == 0) {
+		c->pos = pos;
+		f->num_pending++;
+		if (mapped) {
+			c->span = buf;
+			c->len = len;
+			return;
+		}
+	} else if (c->span && mapped && c->span + c->len == buf) {
+		c->len += len;
+		return;
+	} else if (c->span) {
+		filter_unspan(c);
+	}
+	filter_carry(c, buf, len);
+}
+
+/*
+ * --multiline: match and pass the first n bytes of the carried record of
+ * file i, the rest, if any, starts the next one
+ * */
+void
+filter_release (filter_t *f, out_batch_t *out, int i, size_t n) {
+	filter_carry_t *c = &f->carry[i];
+	const char *rec = c->span ? c->span : c->buf;
+
+	out_switch_file(out, i);
+	if (filter_match(f, rec, n, f->delims[i])) {
+		if (c->span) {
+			out_pass_mapped(out, rec, n, c->pos);
+		} else {
+			out_pass_copy(out, rec, n, c->pos);
+		}
+		f->matched++;
+	} else {
+		f->rejected++;
+	}
+	c->len -= n;
+	c->pos += n;
+	c->body = c->body > n ? c->body - n : 0;
+	if (c->span) {
+		c->span += n;
+	} else {
+		memmove(c->buf, c->buf + n, c->len);
+	}
+	if (c->len == 0) {
+		c->span = NULL;
+		f->num_pending--;
+	}
+}
+
+/*
+ * --multiline: the lines in buf, which starts at file offset pos, go into
+ * the carried record of the current file one by one
+ * */
+void
+filter_feed_multiline (filter_t *f, out_batch_t *out, const char *buf,
+		size_t len, uint64_t pos, bool mapped) {
+	int i = out->cur_file;
+	filter_carry_t *c = &f->carry[i];
+	char delim = f->delims[i];
+	const char *p = buf, *end = buf + len, *d;
+	size_t n;
+
+	while (p < end) {
+		d = memchr(p, delim, end - p);
+		n = d ? (size_t)(d + 1 - p) : (size_t)(end - p);
+		filter_hold(f, c, p, n, pos + (p - buf), mapped);
+		p += n;
+		if (!d) {
+			break;
+		}
+		/* the line from body on is complete now */
+		if (c->body > 0 && !filter_continues(f,
+				(c->span ? c->span : c->buf) + c->body, c->len - c->body,
+				delim)) {
+			filter_release(f, out, i, c->body);
+		}
+		c->body = c->len;
+		if (c->len >= f->max_record) {
+			f->cut++;
+			filter_release(f, out, i, c->len);
+		}
+	}
+	if (c->len >= f->max_record) {
+		/* a single line that long */
+		f->cut++;
+		filter_release(f, out, i, c->len);
+	}
+	if (c->len > 0 && f->timeout_us > 0) {
+		c->since_us = monotonic_us();
+	}
+}
+
+/*
+ * match the records in buf, which starts at file offset pos. mapped tells
+ * if accepted ones can be emitted where they are.
+ * */
+void
+filter_feed (filter_t *f, out_batch_t *out, const char *buf, size_t len,
+		uint64_t pos, bool mapped) {
+	const char *p = buf, *end = buf + len, *d;
+	size_t n;
+
+	if (f->multiline) {
+		filter_feed_multiline(f, out, buf, len, pos, mapped);
+		return;
+	}
+	if (f->carry[out->cur_file].len > 0) {
+		p += filter_finish_carry(f, out, buf, len);
+	}
+	while (p < end) {
+		if ((d = memchr(p, f->delims[out->cur_file], end - p)) == NULL) {
+			/* incomplete, wait for the rest */
+			f->carry[out->cur_file].pos = pos + (p - buf);
+			filter_carry(&f->carry[out->cur_file], p, end - p);
+			return;
+		}
+		n = d + 1 - p;
+		if (filter_match(f, p, n, f->delims[out->cur_file])) {
+			if (mapped) {
+				out_pass_mapped(out, p, n, pos + (p - buf));
+			} else {
+				out_pass_copy(out, p, n, pos + (p - buf));
+			}
+			f->matched++;
+		} else {
+			f->rejected++;
+		}
+		p = d + 1;
+	}
+}
+
+/*
+ * --multiline: pass the records nothing was added to for the timeout,
+ * all of them with force. Returns the us until the next one is due, -1
+ * if none is pending.
+ * */
+long
+filter_expire (filter_t *f, out_batch_t *out, bool force) {
+	uint64_t now;
+	long limit = -1, due;
+	int i;
+
+	if (f->num_pending == 0) {
+		return -1;
+	}
+	now = monotonic_us();
+	for (i=0;i<f->num_files && f->num_pending > 0;i++) {
+		if (f->carry[i].len == 0) {
+			continue;
+		}
+		due = (long)(f->carry[i].since_us + f->timeout_us - now);
+		if (force || due <= 0) {
+			filter_release(f, out, i, f->carry[i].len);
+		} else if (limit < 0 || due < limit) {
+			limit = due;
+		}
+	}
+	return limit;
+}
+
+/*
+ * the mappings spans point into may go away: copy the records aside
+ * */
+void
+filter_detach (filter_t *f) {
+	int i;
+
+	if (f->num_pending == 0) {
+		return;
+	}
+	for (i=0;i<f->num_files;i++) {
+		if (f->carry[i].span) {
+			filter_unspan(&f->carry[i]);
+		}
+	}
+}
+
+/*
+ * bytes of file i the filter holds back
+ * */
+static inline size_t
+filter_held (filter_t *f, int i) {
+	return f->carry[i].len;
+}
+
+/*
+ * at exit: incomplete records are matched as they are
+ * */
+void
+filter_flush (filter_t *f, out_batch_t *out) {
+	filter_carry_t *c;
+	int i;
+	if (f->multiline) {
+		filter_expire(f, out, true);
+		return;
+	}
+	for (i=0;i<f->num_files;i++) {
+		c = &f->carry[i];
+		if (c->len > 0 && filter_match(f, c->buf, c->len, f->delims[i])) {
+			out_switch_file(out, i);
+			out_pass_copy(out, c->buf, c->len, c->pos);
+		}
+		c->len = 0;
+	}
+}
+
+/*
+ * copy bytes into the batch, for data that doesn't stay where it is
+ * */
+void
+out_append_copy (out_batch_t *out, const char *buf, size_t len) {
+	uint64_t pos = out->pos;
+	out->pos += len;
+	if (out->format != FORMAT_TEXT) {
+		out->recv_us = realtime_us();
+	}
+	if (out->filter) {
+		filter_feed(out->filter, out, buf, len, pos, false);
+		return;
+	}
+	out_pass_copy(out, buf, len, pos);
+}
+
+/*
+ * reference bytes of a mapping, they have to stay mapped until flushed
+ * */
+void
+out_append_mapped (out_batch_t *out, const char *ptr, size_t len) {
+	uint64_t pos = out->pos;
+	out->pos += len;
+	if (out->format != FORMAT_TEXT) {
+		out->recv_us = realtime_us();
+	}
+	if (out->filter) {
+		filter_feed(out->filter, out, ptr, len, pos, true);
+		return;
+	}
+	out_pass_mapped(out, ptr, len, pos);
+}
+
+/*
+ * print the usage of this utility
+ * */
+void
+print_usage (int argc, char **argv) {
+	/* TODO elaborate */
+	fprintf(stderr, "Usage:"
+			"    %s [options] filename... # filename(s) to follow\n"
+			"  -n [+]N     print the last N lines (+N: start at line N)\n"
+			"  -s INTERVAL longest wait before files are inspected again,\n"
+			"              in seconds or with a s/ms/us suffix (default 100ms)\n"
+			"  -p PID      follow until PID exits\n"
+			"  -r GLOB     follow files matching GLOB, found again every\n"
+			"              --rescan and when files are added to its\n"
+			"              directories\n"
+			"  -d CHAR     record delimiter (default \\n), a character, an\n"
+			"              escape like \\0 or \\xff, or a number like 0xff\n"
+			"  -x CHAR     end marker, the byte unwritten space reads as\n"
+			"              (default \\0)\n"
+			"  -q          never print file name headers\n"
+			"  -v          verbose debug output on stderr\n"
+			"  -m, --mmap  map files and follow them without stdio\n"
+			"  --uring     read files with io_uring, one batch of reads per\n"
+			"              pass, for file systems mmap doesn't suit; stdio\n"
+			"              where io_uring is not available\n"
+			"  -j N        poll the files with N reader threads\n"
+			"  -e PATTERN  print only records matching PATTERN, literal or\n"
+			"              extended regex, may be repeated\n"
+			"  -f FILE     read patterns from FILE, one per line\n"
+			"  --scan-kernel=scalar|sse2|avx2|neon\n"
+			"              override the scan kernel picked for this cpu\n"
+			"  --wakeup=auto|poll|inotify\n"
+			"              adaptive polling, inotify events, or both (auto)\n"
+			"  --poll-min=INTERVAL\n"
+			"              shortest adaptive poll interval (default 50us)\n"
+			"  --batch-latency=INTERVAL\n"
+			"              longest time output is held back within a pass\n"
+			"              (default 10ms)\n"
+			"  --no-splice don't vmsplice mapped data when stdout is a pipe\n"
+			"  --max-buffer=SIZE\n"
+			"              memory ceiling per file for -n on pipes (64M)\n"
+			"  --merge     print records of all files in timestamp order\n"
+			"  --merge-window=INTERVAL\n"
+			"              how long records wait for earlier ones (100ms)\n"
+			"  --merge-ts=iso|epoch|FORMAT\n"
+			"              leading timestamp of the records, FORMAT as in\n"
+			"              strptime(3) (default iso: YYYY-MM-DD HH:MM:SS.f)\n"
+			"  --rescan=INTERVAL\n"
+			"              how often -r looks for new files (default 1s, 0\n"
+			"              to glob only at startup)\n"
+			"  --max-files=N\n"
+			"              files -r can follow at the same time (4096)\n"
+			"  --check-interval=INTERVAL\n"
+			"              how often a file name is checked for rotation or\n"
+			"              truncation (default 1s, 0 to never check)\n"
+			"  --ring      the files are circular logs, follow their wraps\n"
+			"  --ring-header=woff=OFF[:W],gen=OFF[:W],data=OFF[,size=SIZE]\n"
+			"              where the ring writer publishes its write offset\n"
+			"              and wrap count (W: 4 or 8 bytes), implies --ring\n"
+			"  --commit=record|lenprefix[,data=OFF]|offset[,word=OFF[:W]]\n"
+			"              emit only committed records: complete up to their\n"
+			"              delimiter, 4 byte length stored after the payload,\n"
+			"              or up to the offset the writer stores in a word\n"
+			"  --state-file=FILE\n"
+			"              save the cursor of each file in FILE and resume\n"
+			"              from it on the next start\n"
+			"  --state-interval=INTERVAL\n"
+			"              how often FILE is written at most (default 1s)\n"
+			"  --format=text|ndjson|frame\n"
+			"              print records as they are (text), as JSON objects\n"
+			"              or as binary frames, with file id, offset and\n"
+			"              time of receipt\n"
+			"  --sink=tcp://HOST:PORT|unix:///PATH\n"
+			"              send the output to a socket instead of stdout,\n"
+			"              reconnecting when the peer goes away\n"
+			"  --zerocopy  with --mmap and --sink, send mapped data with\n"
+			"              MSG_ZEROCOPY\n"
+			"  --compress=zstd|lz4\n"
+			"              compress the output on a helper thread, flushed\n"
+			"              after every batch\n"
+			"  --compress-level=N\n"
+			"              codec level (zstd 3, lz4 0 by default)\n"
+			"  --stats-file=FILE\n"
+			"              write per file and thread counters to FILE,\n"
+			"              SIGUSR1 dumps them to FILE or stderr any time\n"
+			"  --stats-interval=INTERVAL\n"
+			"              how often FILE is rewritten (default 1s)\n"
+			"  --max-lag=SIZE\n"
+			"              how far a file may fall behind its writer before\n"
+			"              --on-lag applies\n"
+			"  --on-lag=catchup|skip[:N]\n"
+			"              write in bigger batches until the file caught up\n"
+			"              (default), or skip to its last N lines (10) and\n"
+			"              say how many bytes were skipped\n"
+			"  --file-delims=GLOB:[DELIM][:END_MARKER]\n"
+			"              -d and -x for the files matching GLOB, may be\n"
+			"              repeated, the first match wins\n"
+			"  --map-window=SIZE\n"
+			"              with --mmap, map at most SIZE of a file and slide\n"
+			"              it along (default: whole files on 64 bit)\n"
+			"  --multiline=indent|start:REGEX\n"
+			"              put the lines of a record together: lines that\n"
+			"              start with a space or a tab, or that don't match\n"
+			"              REGEX, continue the record before them\n"
+			"  --multiline-timeout=INTERVAL\n"
+			"              the last record of a file goes out once nothing\n"
+			"              was added to it for this long (100ms, 0 to wait\n"
+			"              for the next record)\n"
+			"  --max-record=SIZE\n"
+			"              records put together are cut at SIZE (default\n"
+			"              --max-buffer)\n"
+			"  --backfill-threads=N\n"
+			"              threads matching what -n +K starts with against\n"
+			"              -e/-f or --format, 1 to read it in sequence\n"
+			"              (default: one per cpu, up to 16)\n"
+			"  --serve=NAME\n"
+			"              with --mmap, don't print anything but publish\n"
+			"              where the records are in shared memory NAME, a\n"
+			"              path or a name under /dev/shm\n"
+			"  --attach=NAME\n"
+			"              follow the files a --serve instance follows,\n"
+			"              reading records straight from the files, -n +K\n"
+			"              starts with what the index still holds\n",
+			argv[0]);
+}
+
+bool glob_files (char *regex, glob_t* pglob) {
+	int ret;
+	int i;
+	ret = glob(regex, 0, NULL, pglob);
+	if (ret == 0) {
+		for (i=0;i<pglob->gl_pathc;i++) {
+			dbg_printf("%s: %d: %s\n", __FUNCTION__, i+1, pglob->gl_pathv[i]);
+		}
+		return true;
+	} else {
+		globfree(pglob);
+		return false;
+	}
+}
+/*
+ * Close all files in case of error, or if we are finished
+ * */
+void
+close_files (const follow_engine_t *engine, file_data_t *file_data_array,
+		int num_files) {
+	while (num_files-->0) {
+		engine->close(&file_data_array[num_files]);
+	}
+}
+
+/*
+ * descriptor of an open file, whichever engine opened it
+ * */
+static inline int
+file_fd (file_data_t *fdata) {
+	return fdata->fd >= 0 ? fdata->fd : fileno(fdata->fp);
+}
+
+/*
+ * read bytes at off without moving the cursor of either engine
+ * */
+bool
+file_read_at (file_data_t *fdata, size_t off, char *buf, size_t len) {
+	if (fdata->map && off >= fdata->map_off && off + len <= fdata->map_len) {
+		memcpy(buf, fdata->map + (off - fdata->map_off), len);
+		return true;
+	}
+	return pread(file_fd(fdata), buf, len, off) == (ssize_t)len;
+}
+
+/*
+ * remember which inode was opened
+ * */
+void
+file_identify (file_data_t *fdata) {
+	struct stat st;
+	if (fstat(file_fd(fdata), &st) == 0) {
+		fdata->dev = st.st_dev;
+		fdata->ino = st.st_ino;
+	}
+	fdata->head_valid = false;
+}
+
+/*
+ * Every file seen so far by dev/ino: which slot follows it, or where
+ * reading stopped when it was let go. A file that shows up again under a
+ * new name, like a rotated log matching the same glob, is resumed instead
+ * of printed twice. The readers and the discovery share it, it is only
+ * touched when files come and go, and at --state-file checkpoints.
+ * */
+typedef struct registry_entry_ {
+	dev_t dev;
+	ino_t ino;
+	size_t cursor;
+	uint64_t ring_pos;
+	char head[8];       /* see file_data_t, to tell a rewritten file */
+	bool head_valid;
+	int slot;           /* -1 if the file isn't followed right now */
+	bool used;
+} registry_entry_t;
+
+typedef struct registry_ {
+	pthread_mutex_t lock;
+	registry_entry_t *entries; /* open addressing, power of 2 */
+	size_t cap;
+	size_t used;
+	bool dirty;         /* a checkpoint moved since the last save */
+	uint64_t save_us;   /* next --state-file save */
+} registry_t;
+
+static inline size_t
+registry_hash (dev_t dev, ino_t ino) {
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return (size_t)(h ^ (h >> 32));
+}
+
+void
+registry_init (registry_t *r) {
+	pthread_mutex_init(&r->lock, NULL);
+	r->cap = 256;
+	r->used = 0;
+	r->dirty = false;
+	r->save_us = 0;
+	r->entries = calloc(r->cap, sizeof(registry_entry_t));
+}
+
+void
+registry_free (registry_t *r) {
+	pthread_mutex_destroy(&r->lock);
+	free(r->entries);
+}
+
+/*
+ * entry of dev/ino, or the empty one it would go to. Called locked.
+ * */
+registry_entry_t *
+registry_find (registry_t *r, dev_t dev, ino_t ino) {
+	size_t k = registry_hash(dev, ino) & (r->cap - 1);
+	while (r->entries[k].used &&
+			(r->entries[k].dev != dev || r->entries[k].ino != ino)) {
+		k = (k + 1) & (r->cap - 1);
+	}
+	return &r->entries[k];
+}
+
+/*
+ * copy of the entry of dev/ino, false if the file is unknown
+ * */
+bool
+registry_get (registry_t *r, dev_t dev, ino_t ino, registry_entry_t *out) {
+	registry_entry_t *e;
+	bool found;
+	pthread_mutex_lock(&r->lock);
+	e = registry_find(r, dev, ino);
+	found = e->used;
+	if (found) {
+		*out = *e;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return found;
+}
+
+/*
+ * entry of dev/ino, created if it is new. Called locked.
+ * */
+registry_entry_t *
+registry_insert (registry_t *r, dev_t dev, ino_t ino) {
+	registry_entry_t *e, *old;
+	size_t old_cap, k;
+
+	if ((r->used + 1) * 2 > r->cap) {
+		old = r->entries;
+		old_cap = r->cap;
+		r->cap *= 2;
+		r->entries = calloc(r->cap, sizeof(registry_entry_t));
+		for (k=0;k<old_cap;k++) {
+			if (old[k].used) {
+				*registry_find(r, old[k].dev, old[k].ino) = old[k];
+			}
+		}
+		free(old);
+	}
+	e = registry_find(r, dev, ino);
+	if (!e->used) {
+		e->used = true;
+		e->dev = dev;
+		e->ino = ino;
+		e->slot = -1;
+		r->used++;
+	}
+	return e;
+}
+
+void
+registry_put (registry_t *r, file_data_t *fdata, int slot) {
+	registry_entry_t *e;
+
+	pthread_mutex_lock(&r->lock);
+	e = registry_insert(r, fdata->dev, fdata->ino);
+	e->cursor = fdata->cursor;
+	e->ring_pos = fdata->ring_pos;
+	memcpy(e->head, fdata->head, sizeof(e->head));
+	e->head_valid = fdata->head_valid;
+	e->slot = slot;
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * record that file slot i was written out up to held bytes before its
+ * cursor, for the next --state-file save
+ * */
+void
+registry_checkpoint (registry_t *r, file_data_t *fdata, int slot,
+		size_t held) {
+	registry_entry_t *e;
+	size_t cursor = fdata->cursor - held;
+	uint64_t ring_pos = fdata->ring_pos - held;
+
+	pthread_mutex_lock(&r->lock);
+	e = registry_insert(r, fdata->dev, fdata->ino);
+	if (e->cursor != cursor || e->ring_pos != ring_pos || e->slot != slot ||
+			e->head_valid != fdata->head_valid) {
+		e->cursor = cursor;
+		e->ring_pos = ring_pos;
+		memcpy(e->head, fdata->head, sizeof(e->head));
+		e->head_valid = fdata->head_valid;
+		e->slot = slot;
+		r->dirty = true;
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * --state-file: one line per followed file,
+ *   dev ino cursor ring_pos head
+ * head being the hex of the first bytes, - if not known yet. Written to a
+ * temporary file next to it and renamed over it, so a crash leaves either
+ * the old or the new state. Files that are not followed any more are left
+ * out, they would not be resumed anyway.
+ * */
+bool
+registry_save (registry_t *r, const char *path) {
+	char tmp[PATH_MAX];
+	registry_entry_t *e;
+	FILE *fp;
+	size_t k;
+	int c;
+	bool ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+	fprintf(fp, "# mtail-f state 1\n");
+	pthread_mutex_lock(&r->lock);
+	for (k=0;k<r->cap;k++) {
+		e = &r->entries[k];
+		if (!e->used || e->slot < 0) {
+			continue;
+		}
+		fprintf(fp, "%llu %llu %zu %llu ", (unsigned long long)e->dev,
+				(unsigned long long)e->ino, e->cursor,
+				(unsigned long long)e->ring_pos);
+		if (e->head_valid) {
+			for (c=0;c<(int)sizeof(e->head);c++) {
+				fprintf(fp, "%02x", (unsigned char)e->head[c]);
+			}
+		} else {
+			fputc('-', fp);
+		}
+		fputc('\n', fp);
+	}
+	r->dirty = false;
+	pthread_mutex_unlock(&r->lock);
+	ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok &= fclose(fp) == 0;
+	if (!ok || rename(tmp, path) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * read a --state-file into the registry, the entries are resumed by
+ * state_resume once their files are opened. A missing file is a first run.
+ * */
+bool
+registry_load (registry_t *r, const char *path) {
+	unsigned long long dev, ino, ring_pos;
+	char line[256], head[32];
+	registry_entry_t *e;
+	unsigned byte;
+	size_t cursor;
+	FILE *fp;
+	int c, n = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return errno == ENOENT;
+	}
+	pthread_mutex_lock(&r->lock);
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%llu %llu %zu %llu %31s", &dev,
+				&ino, &cursor, &ring_pos, head) != 5) {
+			continue;
+		}
+		e = registry_insert(r, (dev_t)dev, (ino_t)ino);
+		e->cursor = cursor;
+		e->ring_pos = ring_pos;
+		e->head_valid = strlen(head) == 2*sizeof(e->head);
+		for (c=0;e->head_valid && c<(int)sizeof(e->head);c++) {
+			e->head_valid = sscanf(head + 2*c, "%2x", &byte) == 1;
+			e->head[c] = (char)byte;
+		}
+		n++;
+	}
+	pthread_mutex_unlock(&r->lock);
+	fclose(fp);
+	dbg_printf("%s: %d saved cursor(s)\n", path, n);
+	return true;
+}
+
+/*
+ * continue a file where an earlier run, or an earlier name, left it.
+ * False if it shrank or its first bytes changed since, then it is a
+ * different log and is started over.
+ * */
+bool
+state_resume (file_data_t *fdata, const registry_entry_t *e) {
+	char head[sizeof(fdata->head)];
+	struct stat st;
+
+	if (fstat(file_fd(fdata), &st) != 0 || (size_t)st.st_size < e->cursor) {
+		return false;
+	}
+	if (e->head_valid && (!file_read_at(fdata, 0, head, sizeof(head)) ||
+			memcmp(head, e->head, sizeof(head)) != 0)) {
+		return false;
+	}
+	fdata->cursor = e->cursor;
+	fdata->ring_pos = e->ring_pos;
+	memcpy(fdata->head, e->head, sizeof(fdata->head));
+	fdata->head_valid = e->head_valid;
+	fdata->end_reached = true;
+	if (fdata->fp) {
+		fseek(fdata->fp, fdata->cursor, SEEK_SET);
+	}
+	return true;
+}
+
+/*
+ * Attempt to open all the files,
+ * if any file fails to open, close all files opened thus far, and return false
+ * else return true
+ *
+ * */
+bool
+open_files (const follow_engine_t *engine, char *filenames[], int num_files,
+		file_data_t *file_data_array) {
+	int i;
+	for (i=0;i<num_files;i++) {
+		if (file_data_array[i].fp || file_data_array[i].fd >= 0) {
+			/* File is already open, rotation is handled by file_check */
+			continue;
+		}
+		if (!engine->open(&file_data_array[i], filenames[i])) {
+			dbg_printf("Error opening %s for reading: %s\n",
+						filenames[i], strerror(errno));
+			close_files(engine, file_data_array, i);
+			return false;
+		}
+		file_identify(&file_data_array[i]);
+	}
+	return true;
+}
+
+void
+ring_buffer_drop_oldest (ring_buffer_t *rb) {
+	rb_line_t *line = &rb->lines[rb->oldest];
+	rb->head = (rb->head + line->len) % rb->arena_cap;
+	rb->used -= line->len;
+	rb->oldest = (rb->oldest + 1) % rb->capacity;
+	rb->size--;
+}
+
+/*
+ * grow the arena to hold at least need bytes, within max_bytes. The
+ * content is moved to the start of the new arena.
+ * */
+void
+ring_buffer_grow (ring_buffer_t *rb, size_t need) {
+	size_t cap = rb->arena_cap ? rb->arena_cap : BUF_CHUNK_SIZE;
+	char *arena;
+	size_t first;
+	int k, slot;
+
+	while (cap < need) {
+		cap *= 2;
+	}
+	if (cap > rb->max_bytes) {
+		cap = rb->max_bytes;
+	}
+	arena = malloc(cap);
+	if (rb->used) {
+		first = rb->arena_cap - rb->head < rb->used ?
+				rb->arena_cap - rb->head : rb->used;
+		memcpy(arena, rb->arena + rb->head, first);
+		memcpy(arena + first, rb->arena, rb->used - first);
+	}
+	for (k=0;k<rb->size;k++) {
+		slot = (rb->oldest + k) % rb->capacity;
+		rb->lines[slot].off = (rb->lines[slot].off + rb->arena_cap -
+				rb->head) % rb->arena_cap;
+	}
+	free(rb->arena);
+	rb->arena = arena;
+	rb->arena_cap = cap;
+	rb->head = 0;
+}
+
+/*
+ * if size has reached capacity, replace oldest with newest line.
+ * else insert the line into ring buffer.
+ * */
+void
+enqueue (ring_buffer_t *rb, const char *line, size_t len, uint64_t pos) {
+	size_t tail, first;
+	int slot;
+
+	if (rb->capacity <= 0) {
+		return;
+	}
+	if (len > rb->max_bytes) {
+		len = rb->max_bytes;
+		rb->truncated++;
+	}
+	if (rb->size == rb->capacity) {
+		ring_buffer_drop_oldest(rb);
+	}
+	while (rb->used + len > rb->arena_cap) {
+		if (rb->arena_cap < rb->max_bytes) {
+			ring_buffer_grow(rb, rb->used + len);
+		} else {
+			ring_buffer_drop_oldest(rb);
+		}
+	}
+	tail = rb->arena_cap ? (rb->head + rb->used) % rb->arena_cap : 0;
+	first = rb->arena_cap - tail < len ? rb->arena_cap - tail : len;
+	memcpy(rb->arena + tail, line, first);
+	memcpy(rb->arena, line + first, len - first);
+	slot = (rb->oldest + rb->size) % rb->capacity;
+	rb->lines[slot].off = tail;
+	rb->lines[slot].len = len;
+	rb->lines[slot].pos = pos;
+	rb->used += len;
+	rb->size++;
+}
+
+/*
+ * print the lines in buffer for "tail -n <>" functionality
+ */
+void
+print_ring_buffer(ring_buffer_t *rb, out_batch_t *out) {
+	rb_line_t *line;
+	size_t first;
+	int k;
+
+	if (!rb->lines) {
+		/* Nothing to print */
+		return;
+	}
+	for (k=0;k<rb->size;k++) {
+		line = &rb->lines[(rb->oldest + k) % rb->capacity];
+		first = rb->arena_cap - line->off < line->len ?
+				rb->arena_cap - line->off : line->len;
+		out_seek(out, line->pos);
+		out_append_copy(out, rb->arena + line->off, first);
+		if (first < line->len) {
+			out_append_copy(out, rb->arena, line->len - first);
+		}
+	}
+	if (rb->truncated) {
+		dbg_printf("%lu records were cut at %zu bytes\n", rb->truncated,
+				rb->max_bytes);
+	}
+	free(rb->lines);
+	free(rb->arena);
+	rb->lines = NULL;
+	rb->arena = NULL;
+}
+
+void
+ring_buffer_init(ring_buffer_t *rb, int capacity, size_t max_bytes) {
+	memset(rb, 0, sizeof(ring_buffer_t));
+	rb->capacity = capacity;
+	rb->max_bytes = max_bytes;
+	rb->lines = malloc(sizeof(rb_line_t)*(capacity > 0 ? capacity : 1));
+}
+
+/* check if we need to stop tailing based on params
+ * is watched_pid alive?
+ * */
+bool
+stop_conditions_met (mtail_params_t *params) {
+	if (stop_requested) {
+		return true;
+	}
+	if (params->watch_pid!=0) {
+		if (atomic_load_explicit(&watch_pid_gone, memory_order_relaxed)) {
+			return true;
+		}
+		if (watch_pidfd >= 0) {
+			/* the wait of the event loop returns when it exits */
+			return false;
+		}
+#ifdef _POSIX_VERSION
+		dbg_printf("Checking pid:%d is alive\n", params->watch_pid);
+		if (kill(params->watch_pid, 0) != 0 && errno == ESRCH) {
+			atomic_store(&watch_pid_gone, true);
+			return true;
+		}
+#else
+		fprintf(stderr, "pid check unsupported on non-posix systems\n");
+		return true;
+#endif
+	}
+	return false;
+}
+
+/*
+ * -p: a pidfd of the process for the event loops to wait on, on kernels
+ * before 5.3 stop_conditions_met() keeps checking with kill(2)
+ * */
+void
+watch_pid_open (pid_t pid) {
+#ifdef __NR_pidfd_open
+	watch_pidfd = syscall(__NR_pidfd_open, pid, 0);
+	if (watch_pidfd >= 0) {
+		dbg_printf("pid %d: watched through pidfd %d\n", (int)pid,
+				watch_pidfd);
+		return;
+	}
+	if (errno == ESRCH) {
+		atomic_store(&watch_pid_gone, true);
+		return;
+	}
+	dbg_printf("pidfd_open: %s, checking pid %d with kill\n",
+			strerror(errno), (int)pid);
+#else
+	(void)pid;
+#endif
+}
+
+/*
+ * parse an interval like "2", "0.5s", "20ms" or "100us" into microseconds,
+ * plain numbers are seconds. Returns -1 if it can't be parsed.
+ * */
+long
+parse_interval (const char *str) {
+	char *end;
+	double value = strtod(str, &end);
+	double scale = 1e6;
+
+	if (end == str || value < 0) {
+		return -1;
+	}
+	if (strcmp(end, "ms") == 0) {
+		scale = 1e3;
+	} else if (strcmp(end, "us") == 0) {
+		scale = 1;
+	} else if (*end != '\0' && strcmp(end, "s") != 0) {
+		return -1;
+	}
+	return (long)(value * scale);
+}
+
+/*
+ * parse a size like "4096", "64k", "16M" or "1G" into bytes, 0 if it can't
+ * be parsed
+ * */
+size_t
+parse_size (const char *str) {
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+
+	if (end == str) {
+		return 0;
+	}
+	switch (*end) {
+	case 'k': case 'K':
+		value <<= 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		value <<= 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		value <<= 30;
+		end++;
+		break;
+	}
+	return *end == '\0' ? (size_t)value : 0;
+}
+
+/*
+ * a delim or end marker: one character, a C escape like "\0", "\n" or
+ * "\xff", or a number like "0xff". Returns false if it can't be parsed.
+ * */
+bool
+parse_char (const char *str, char *c) {
+	const char *digits = str;
+	char *end;
+	unsigned long value;
+
+	if (str[0] == '\\' && str[1] != '\0' && str[2] == '\0') {
+		switch (str[1]) {
+		case 'n': *c = '\n'; return true;
+		case 't': *c = '\t'; return true;
+		case 'r': *c = '\r'; return true;
+		case '0': *c = '\0'; return true;
+		case '\\': *c = '\\'; return true;
+		}
+		return false;
+	}
+	if (str[0] == '\\' && str[1] == 'x') {
+		digits = str + 2;
+		value = strtoul(digits, &end, 16);
+	} else if (str[0] != '\0' && str[1] == '\0') {
+		*c = str[0];
+		return true;
+	} else if (str[0] == '\0') {
+		/* -d '' */
+		*c = '\0';
+		return true;
+	} else {
+		value = strtoul(str, &end, 0);
+	}
+	if (*end != '\0' || end == digits || value > 0xff) {
+		return false;
+	}
+	*c = (char)value;
+	return true;
+}
+
+/*
+ * --file-delims=GLOB:DELIM[:END_MARKER], may be repeated, the first glob
+ * that matches a file name wins. A glob without a '/' also matches the
+ * base name.
+ * */
+typedef struct file_delims_ {
+	char *glob;
+	char delim;
+	char end_marker;
+	bool has_delim;    /* DELIM was given, -d otherwise */
+	bool has_end;      /* END_MARKER was given, -x otherwise */
+} file_delims_t;
+
+bool
+add_file_delims (mtail_params_t *params, const char *arg) {
+	const char *colon = strchr(arg, ':');
+	file_delims_t fd;
+	char *val, *end;
+
+	if (!colon || colon == arg) {
+		return false;
+	}
+	fd.glob = strndup(arg, colon - arg);
+	val = strdup(colon + 1);
+	if ((end = strchr(val + (val[0] != '\0'), ':')) != NULL) {
+		/* the delim itself may be a ':' */
+		*end++ = '\0';
+	}
+	fd.has_delim = val[0] != '\0';
+	fd.has_end = end != NULL;
+	if ((fd.has_delim && !parse_char(val, &fd.delim)) ||
+			(fd.has_end && !parse_char(end, &fd.end_marker))) {
+		free(val);
+		free(fd.glob);
+		return false;
+	}
+	free(val);
+	params->file_delims = realloc(params->file_delims,
+			sizeof(file_delims_t) * (params->num_file_delims + 1));
+	params->file_delims[params->num_file_delims++] = fd;
+	return true;
+}
+
+/*
+ * the delim and end_marker of the file in slot i, from its name
+ * */
+void
+file_delims_assign (mtail_params_t *params, int i) {
+	const char *name = params->files[i];
+	const char *base = strrchr(name, '/');
+	file_delims_t *fd;
+	int k;
+
+	params->delims[i] = params->delim;
+	params->end_markers[i] = params->end_marker;
+	for (k=0;k<params->num_file_delims;k++) {
+		fd = &params->file_delims[k];
+		if (fnmatch(fd->glob, name, 0) == 0 ||
+				(base && !strchr(fd->glob, '/') &&
+				fnmatch(fd->glob, base + 1, 0) == 0)) {
+			if (fd->has_delim) {
+				params->delims[i] = fd->delim;
+			}
+			if (fd->has_end) {
+				params->end_markers[i] = fd->end_marker;
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * -e: one more pattern a record may match
+ * */
+void
+add_pattern (mtail_params_t *params, const char *pattern) {
+	params->patterns = realloc(params->patterns,
+			sizeof(char *) * (params->num_patterns + 1));
+	params->patterns[params->num_patterns++] = strdup(pattern);
+}
+
+/*
+ * -f: one pattern per line, like grep -f
+ * */
+bool
+add_pattern_file (mtail_params_t *params, const char *filename) {
+	FILE *fp = fopen(filename, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	if (!fp) {
+		return false;
+	}
+	while ((len = getline(&line, &cap, fp)) > 0) {
+		if (line[len-1] == '\n') {
+			line[--len] = '\0';
+		}
+		if (len > 0) {
+			add_pattern(params, line);
+		}
+	}
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+/*
+ * -e/-f: the patterns that aren't literals have to compile
+ * */
+bool
+check_patterns (mtail_params_t *params) {
+	char msg[256];
+	regex_t re;
+	int i, err;
+
+	for (i=0;i<params->num_patterns;i++) {
+		if (pattern_is_literal(params->patterns[i])) {
+			continue;
+		}
+		if ((err = regcomp(&re, params->patterns[i],
+				REG_EXTENDED | REG_NOSUB)) != 0) {
+			regerror(err, &re, msg, sizeof(msg));
+			fprintf(stderr, "%s: %s\n", params->patterns[i], msg);
+			return false;
+		}
+		regfree(&re);
+	}
+	return true;
+}
+
+/*
+ * --ring-header=woff=OFF[:WIDTH],gen=OFF[:WIDTH],data=OFF[,size=SIZE]
+ * */
+bool
+parse_ring_layout (const char *spec, ring_layout_t *l) {
+	char buf[MAX_ARG_SIZE];
+	char *tok, *save, *val, *end;
+	unsigned long off, width;
+
+	strncpy(buf, spec, sizeof(buf));
+	buf[sizeof(buf)-1] = '\0';
+	memset(l, 0, sizeof(ring_layout_t));
+	for (tok = strtok_r(buf, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(tok, '=')) == NULL) {
+			return false;
+		}
+		*val++ = '\0';
+		if (strcmp(tok, "size") == 0) {
+			if ((l->size = parse_size(val)) == 0) {
+				return false;
+			}
+			continue;
+		}
+		off = strtoul(val, &end, 0);
+		width = 8;
+		if (*end == ':') {
+			width = strtoul(end + 1, &end, 0);
+		}
+		if (end == val || *end != '\0' || (width != 4 && width != 8)) {
+			return false;
+		}
+		if (strcmp(tok, "woff") == 0) {
+			l->woff_off = off;
+			l->woff_width = width;
+			l->header = true;
+		} else if (strcmp(tok, "gen") == 0) {
+			l->gen_off = off;
+			l->gen_width = width;
+		} else if (strcmp(tok, "data") == 0) {
+			l->data_off = off;
+		} else {
+			return false;
+		}
+	}
+	return l->header;
+}
+
+/*
+ * --commit=record|lenprefix[,data=OFF]|offset[,word=OFF[:WIDTH]][,data=OFF]
+ * */
+bool
+parse_commit (const char *spec, mtail_params_t *params) {
+	char buf[MAX_ARG_SIZE];
+	char *tok, *save, *end;
+	bool data_set = false;
+
+	strncpy(buf, spec, sizeof(buf));
+	buf[sizeof(buf)-1] = '\0';
+	params->commit_word_off = 0;
+	params->commit_word_width = 8;
+	params->commit_data_off = 0;
+	tok = strtok_r(buf, ",", &save);
+	if (!tok) {
+		return false;
+	} else if (strcmp(tok, "record") == 0) {
+		params->commit = COMMIT_RECORD;
+	} else if (strcmp(tok, "lenprefix") == 0) {
+		params->commit = COMMIT_LENPREFIX;
+	} else if (strcmp(tok, "offset") == 0) {
+		params->commit = COMMIT_OFFSET;
+	} else {
+		return false;
+	}
+	while ((tok = strtok_r(NULL, ",", &save)) != NULL) {
+		if (strncmp(tok, "data=", 5) == 0) {
+			params->commit_data_off = strtoul(tok + 5, &end, 0);
+			data_set = true;
+		} else if (strncmp(tok, "word=", 5) == 0 &&
+				params->commit == COMMIT_OFFSET) {
+			params->commit_word_off = strtoul(tok + 5, &end, 0);
+			if (*end == ':') {
+				params->commit_word_width = strtoul(end + 1, &end, 0);
+			}
+		} else {
+			return false;
+		}
+		if (*end != '\0' || (params->commit_word_width != 4 &&
+				params->commit_word_width != 8)) {
+			return false;
+		}
+	}
+	if (params->commit == COMMIT_OFFSET && !data_set) {
+		/* the records follow the word */
+		params->commit_data_off = params->commit_word_off +
+				params->commit_word_width;
+	}
+	if (params->commit == COMMIT_LENPREFIX && params->commit_data_off % 4) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * --multiline=indent|start:REGEX
+ * */
+bool
+parse_multiline (const char *spec, mtail_params_t *params) {
+	char msg[256];
+	regex_t re;
+	int err;
+
+	if (strcmp(spec, "indent") == 0) {
+		params->multiline = MULTILINE_INDENT;
+		return true;
+	}
+	if (strncmp(spec, "start:", 6) != 0 || spec[6] == '\0') {
+		fprintf(stderr, "invalid --multiline: %s\n", spec);
+		return false;
+	}
+	if ((err = regcomp(&re, spec + 6, REG_EXTENDED | REG_NOSUB)) != 0) {
+		regerror(err, &re, msg, sizeof(msg));
+		fprintf(stderr, "%s: %s\n", spec + 6, msg);
+		return false;
+	}
+	regfree(&re);
+	params->multiline = MULTILINE_START;
+	params->multiline_re = spec + 6;
+	return true;
+}
+
+/*
+ * Parse and validate the cmdline options
+ * */
+bool
+parse_opts (int argc, char *argv[], mtail_params_t *params) {
+    int opt;
+    int i;
+    glob_t pglob;
+    enum {
+    	OPT_SCAN_KERNEL = 256,
+    	OPT_WAKEUP,
+    	OPT_POLL_MIN,
+    	OPT_BATCH_LATENCY,
+    	OPT_NO_SPLICE,
+    	OPT_MAX_BUFFER,
+    	OPT_MERGE,
+    	OPT_MERGE_WINDOW,
+    	OPT_MERGE_TS,
+    	OPT_CHECK_INTERVAL,
+    	OPT_RING,
+    	OPT_RING_HEADER,
+    	OPT_COMMIT,
+    	OPT_RESCAN,
+    	OPT_MAX_FILES,
+    	OPT_STATE_FILE,
+    	OPT_STATE_INTERVAL,
+    	OPT_FORMAT,
+    	OPT_SINK,
+    	OPT_ZEROCOPY,
+    	OPT_COMPRESS,
+    	OPT_COMPRESS_LEVEL,
+    	OPT_STATS_FILE,
+    	OPT_STATS_INTERVAL,
+    	OPT_MAX_LAG,
+    	OPT_ON_LAG,
+    	OPT_MAP_WINDOW,
+    	OPT_URING,
+    	OPT_FILE_DELIMS,
+    	OPT_MULTILINE,
+    	OPT_MULTILINE_TIMEOUT,
+    	OPT_MAX_RECORD,
+    	OPT_BACKFILL_THREADS,
+    	OPT_SERVE,
+    	OPT_ATTACH,
+    };
+    static const struct option long_opts[] = {
+    		{ "mmap", no_argument, NULL, 'm' },
+    		{ "scan-kernel", required_argument, NULL, OPT_SCAN_KERNEL },
+    		{ "wakeup", required_argument, NULL, OPT_WAKEUP },
+    		{ "poll-min", required_argument, NULL, OPT_POLL_MIN },
+    		{ "batch-latency", required_argument, NULL, OPT_BATCH_LATENCY },
+    		{ "no-splice", no_argument, NULL, OPT_NO_SPLICE },
+    		{ "max-buffer", required_argument, NULL, OPT_MAX_BUFFER },
+    		{ "merge", no_argument, NULL, OPT_MERGE },
+    		{ "merge-window", required_argument, NULL, OPT_MERGE_WINDOW },
+    		{ "merge-ts", required_argument, NULL, OPT_MERGE_TS },
+    		{ "check-interval", required_argument, NULL, OPT_CHECK_INTERVAL },
+    		{ "ring", no_argument, NULL, OPT_RING },
+    		{ "ring-header", required_argument, NULL, OPT_RING_HEADER },
+    		{ "commit", required_argument, NULL, OPT_COMMIT },
+    		{ "rescan", required_argument, NULL, OPT_RESCAN },
+    		{ "max-files", required_argument, NULL, OPT_MAX_FILES },
+    		{ "state-file", required_argument, NULL, OPT_STATE_FILE },
+    		{ "state-interval", required_argument, NULL, OPT_STATE_INTERVAL },
+    		{ "format", required_argument, NULL, OPT_FORMAT },
+    		{ "sink", required_argument, NULL, OPT_SINK },
+    		{ "zerocopy", no_argument, NULL, OPT_ZEROCOPY },
+    		{ "compress", required_argument, NULL, OPT_COMPRESS },
+    		{ "compress-level", required_argument, NULL, OPT_COMPRESS_LEVEL },
+    		{ "stats-file", required_argument, NULL, OPT_STATS_FILE },
+    		{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    		{ "max-lag", required_argument, NULL, OPT_MAX_LAG },
+    		{ "on-lag", required_argument, NULL, OPT_ON_LAG },
+    		{ "map-window", required_argument, NULL, OPT_MAP_WINDOW },
+    		{ "uring", no_argument, NULL, OPT_URING },
+    		{ "file-delims", required_argument, NULL, OPT_FILE_DELIMS },
+    		{ "multiline", required_argument, NULL, OPT_MULTILINE },
+    		{ "multiline-timeout", required_argument, NULL,
+    				OPT_MULTILINE_TIMEOUT },
+    		{ "max-record", required_argument, NULL, OPT_MAX_RECORD },
+    		{ "backfill-threads", required_argument, NULL,
+    				OPT_BACKFILL_THREADS },
+    		{ "serve", required_argument, NULL, OPT_SERVE },
+    		{ "attach", required_argument, NULL, OPT_ATTACH },
+    		{ NULL, 0, NULL, 0 }
+    };
+	if (argc<2) {
+		print_usage(argc, argv);
+		return false;
+	}
+	memset(params,0,sizeof(mtail_params_t));
+	memset(&pglob,0,sizeof(pglob));
+
+	/* initialize defaults */
+	params->num_lines = 10;
+	params->delim = '\n';
+	params->delay_us = 100000;
+	params->poll_min_us = 50;
+	params->batch_latency_us = 10000;
+	params->max_buffer = 64*1024*1024;
+	params->wakeup = WAKEUP_POLL | WAKEUP_INOTIFY;
+	params->merge_window_us = 100000;
+	params->merge_ts = "iso";
+	params->check_us = 1000000;
+	params->rescan_us = 1000000;
+	params->max_files = DISCOVERY_MAX_FILES;
+	params->state_interval_us = 1000000;
+	params->compress_level = -1;
+	params->stats_interval_us = 1000000;
+	params->lag_lines = 10;
+	params->map_window = MAP_WINDOW_DEFAULT;
+	params->multiline_timeout_us = 100000;
+
+	/* write a better string */
+	while ((opt = getopt_long(argc, argv, "n:s:vp:qr:d:x:mj:e:f:", long_opts,
+			NULL)) != -1) {
+		dbg_printf("opt:%c optarg:%s\n", opt, optarg);
+		switch (opt) {
+		case 'n':
+			if (optarg[0]=='+') {
+				params->lines_from_start = true;
+				optarg++;
+			}
+			params->num_lines = atoi(optarg);
+			break;
+		case 's':
+			if ((params->delay_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'v':
+			params->verbose = true;
+			debug = true;
+			break;
+		case 'p':
+			params->watch_pid = atoi(optarg);
+			break;
+		case 'q':
+			params->quiet = true;
+			break;
+		case 'r':
+			strncpy(params->regex, optarg, MAX_ARG_SIZE);
+			params->regex[MAX_ARG_SIZE-1]='\0';
+			glob_files(params->regex, &pglob);
+			break;
+		case 'd':
+			if (!parse_char(optarg, &params->delim)) {
+				fprintf(stderr, "invalid delimiter: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'x':
+			if (!parse_char(optarg, &params->end_marker)) {
+				fprintf(stderr, "invalid end marker: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'm':
+			params->use_mmap = true;
+			break;
+		case 'j':
+			params->threads = atoi(optarg);
+			break;
+		case 'e':
+			add_pattern(params, optarg);
+			break;
+		case 'f':
+			if (!add_pattern_file(params, optarg)) {
+				fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+				return false;
+			}
+			break;
+		case OPT_SCAN_KERNEL:
+			params->scan_kernel = optarg;
+			break;
+		case OPT_WAKEUP:
+			if (strcmp(optarg, "poll") == 0) {
+				params->wakeup = WAKEUP_POLL;
+			} else if (strcmp(optarg, "inotify") == 0) {
+				params->wakeup = WAKEUP_INOTIFY;
+			} else if (strcmp(optarg, "auto") == 0) {
+				params->wakeup = WAKEUP_POLL | WAKEUP_INOTIFY;
+			} else {
+				fprintf(stderr, "unknown wakeup backend: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_BATCH_LATENCY:
+			if ((params->batch_latency_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_NO_SPLICE:
+			params->no_splice = true;
+			break;
+		case OPT_MAX_BUFFER:
+			if ((params->max_buffer = parse_size(optarg)) == 0) {
+				fprintf(stderr, "invalid size: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MERGE:
+			params->merge = true;
+			break;
+		case OPT_MERGE_WINDOW:
+			if ((params->merge_window_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MERGE_TS:
+			params->merge_ts = optarg;
+			break;
+		case OPT_CHECK_INTERVAL:
+			if ((params->check_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_RING:
+			params->ring = true;
+			params->use_mmap = true;
+			break;
+		case OPT_RING_HEADER:
+			if (!parse_ring_layout(optarg, &params->ring_layout)) {
+				fprintf(stderr, "invalid ring header layout: %s\n", optarg);
+				return false;
+			}
+			params->ring = true;
+			params->use_mmap = true;
+			break;
+		case OPT_COMMIT:
+			if (!parse_commit(optarg, params)) {
+				fprintf(stderr, "invalid commit protocol: %s\n", optarg);
+				return false;
+			}
+			params->use_mmap = true;
+			break;
+		case OPT_RESCAN:
+			if ((params->rescan_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MAX_FILES:
+			if ((params->max_files = atoi(optarg)) <= 0) {
+				fprintf(stderr, "invalid number of files: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_FORMAT:
+			if (strcmp(optarg, "text") == 0) {
+				params->format = FORMAT_TEXT;
+			} else if (strcmp(optarg, "ndjson") == 0) {
+				params->format = FORMAT_NDJSON;
+			} else if (strcmp(optarg, "frame") == 0) {
+				params->format = FORMAT_FRAME;
+			} else {
+				fprintf(stderr, "unknown format: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_SINK:
+			params->sink_url = optarg;
+			break;
+		case OPT_FILE_DELIMS:
+			if (!add_file_delims(params, optarg)) {
+				fprintf(stderr, "invalid --file-delims: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MULTILINE:
+			if (!parse_multiline(optarg, params)) {
+				return false;
+			}
+			break;
+		case OPT_MULTILINE_TIMEOUT:
+			if ((params->multiline_timeout_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MAX_RECORD:
+			if ((params->max_record = parse_size(optarg)) == 0) {
+				fprintf(stderr, "invalid size: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_BACKFILL_THREADS:
+			params->backfill_threads = atoi(optarg);
+			if (params->backfill_threads < 1 ||
+					params->backfill_threads > BACKFILL_MAX_THREADS) {
+				fprintf(stderr, "invalid number of threads: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_SERVE:
+			params->serve = optarg;
+			break;
+		case OPT_ATTACH:
+			params->attach = optarg;
+			break;
+		case OPT_URING:
+			params->use_uring = true;
+			break;
+		case OPT_ZEROCOPY:
+			params->zerocopy = true;
+			break;
+		case OPT_COMPRESS:
+			params->compress = optarg;
+			break;
+		case OPT_COMPRESS_LEVEL:
+			params->compress_level = atoi(optarg);
+			break;
+		case OPT_STATS_FILE:
+			params->stats_file = optarg;
+			break;
+		case OPT_MAX_LAG:
+			if ((params->max_lag = parse_size(optarg)) == 0) {
+				fprintf(stderr, "invalid size: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_ON_LAG:
+			if (strcmp(optarg, "catchup") == 0) {
+				params->lag_skip = false;
+			} else if (strncmp(optarg, "skip", 4) == 0 &&
+					(optarg[4] == '\0' || optarg[4] == ':')) {
+				params->lag_skip = true;
+				if (optarg[4] == ':') {
+					params->lag_lines = atoi(optarg + 5);
+				}
+			} else {
+				fprintf(stderr, "invalid --on-lag: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_MAP_WINDOW:
+			params->map_window = parse_size(optarg);
+			if (params->map_window < MAP_WINDOW_MIN) {
+				fprintf(stderr, "invalid --map-window: %s, at least %dM\n",
+						optarg, MAP_WINDOW_MIN >> 20);
+				return false;
+			}
+			break;
+		case OPT_STATS_INTERVAL:
+			if ((params->stats_interval_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_STATE_FILE:
+			params->state_file = optarg;
+			break;
+		case OPT_STATE_INTERVAL:
+			if ((params->state_interval_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_POLL_MIN:
+			if ((params->poll_min_us = parse_interval(optarg)) < 0) {
+				fprintf(stderr, "invalid interval: %s\n", optarg);
+				return false;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (params->poll_min_us > params->delay_us) {
+		params->poll_min_us = params->delay_us;
+	}
+	if (!check_patterns(params)) {
+		return false;
+	}
+	if (params->ring && params->commit != COMMIT_NONE) {
+		fprintf(stderr, "--commit can't be combined with --ring\n");
+		return false;
+	}
+	if (params->max_lag && params->commit >= COMMIT_LENPREFIX) {
+		fprintf(stderr, "--max-lag can't be combined with --commit=%s\n",
+				params->commit == COMMIT_LENPREFIX ? "lenprefix" : "offset");
+		return false;
+	}
+	if (params->ring || params->commit >= COMMIT_LENPREFIX) {
+		/* those protocols address the file as a whole */
+		params->map_window = 0;
+	}
+	map_window = params->map_window & ~(size_t)(MAP_WINDOW_ALIGN - 1);
+	if (params->num_patterns == 0 && params->format == FORMAT_TEXT &&
+			!params->merge) {
+		/* the same bytes come out, record by record or not */
+		params->multiline = MULTILINE_NONE;
+	}
+	if (params->serve && (params->attach || params->num_patterns > 0 ||
+			params->format != FORMAT_TEXT || params->merge ||
+			params->sink_url || params->compress || params->ring ||
+			params->commit >= COMMIT_LENPREFIX)) {
+		/* the clients filter and format, the records stay where they are */
+		fprintf(stderr, "--serve can't be combined with --attach, -e/-f, "
+				"--format, --merge, --sink, --compress, --ring or "
+				"--commit=lenprefix|offset\n");
+		return false;
+	}
+	if (params->serve) {
+		/* only mapped runs can be published */
+		params->use_mmap = true;
+	}
+	if (params->attach && (optind < argc || params->regex[0] ||
+			params->merge || params->sink_url || params->compress ||
+			params->state_file)) {
+		fprintf(stderr, "--attach takes no files and can't be combined "
+				"with --merge, --sink, --compress or --state-file\n");
+		return false;
+	}
+	if (!params->backfill_threads) {
+		params->backfill_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (params->backfill_threads > BACKFILL_MAX_THREADS) {
+			params->backfill_threads = BACKFILL_MAX_THREADS;
+		}
+	}
+	if (params->regex[0]=='\0') {
+		params->files = &argv[optind];
+		params->num_files = argc - optind;
+		params->max_files = params->num_files > 0 ? params->num_files : 1;
+		params->rescan_us = 0;
+	} else {
+		/* slots for the files found later on, the names are owned */
+		if (params->max_files < (int)pglob.gl_pathc || params->rescan_us == 0) {
+			params->max_files = pglob.gl_pathc > 0 ? pglob.gl_pathc : 1;
+		}
+		params->files = calloc(params->max_files, sizeof(char *));
+		for (i=0;i<(int)pglob.gl_pathc;i++) {
+			params->files[i] = strdup(pglob.gl_pathv[i]);
+		}
+		params->num_files = pglob.gl_pathc;
+		globfree(&pglob);
+		if (params->num_files == 0) {
+			fprintf(stderr, "glob: %s Input files not found\n",
+					params->regex);
+		}
+	}
+	params->delims = malloc(params->max_files);
+	params->end_markers = malloc(params->max_files);
+	for (i=0;i<params->max_files;i++) {
+		params->delims[i] = params->delim;
+		params->end_markers[i] = params->end_marker;
+	}
+	for (i=0;i<params->num_files;i++) {
+		file_delims_assign(params, i);
+	}
+	dbg_printf("argv[%d] = %s\n", optind, argv[optind]);
+	return true;
+}
+
+/*
+ * Scan kernels: one pass over a region finds the first end_marker and records
+ * every delim before it. Scanning stops early once max_delims positions were
+ * collected, the caller resumes at buf+scanned. With max_delims == 0 only the
+ * end_marker is searched for.
+ * */
+typedef struct scan_result_ {
+	size_t scanned;    /* bytes consumed, == offset of end_marker if found */
+	size_t num_delims; /* delim offsets stored in the caller's array */
+	bool end_found;    /* scanning stopped at an end_marker */
+} scan_result_t;
+
+typedef void (*scan_fn_t) (const char *buf, size_t len, char end_marker,
+		char delim, size_t *delims, size_t max_delims, scan_result_t *res);
+
+/*
+ * Every kernel is written once as an always inlined body and instantiated
+ * twice: for any pair of end_marker and delim, and with the common '\0'
+ * and '\n' folded in as constants. scan_region() picks the instance.
+ * */
+#define SCAN_INSTANCES(isa, attr) \
+attr void \
+scan_region_##isa (const char *buf, size_t len, char end_marker, \
+		char delim, size_t *delims, size_t max_delims, scan_result_t *res) { \
+	scan_##isa##_body(buf, len, end_marker, delim, delims, max_delims, \
+			res); \
+} \
+attr void \
+scan_region_##isa##_nl (const char *buf, size_t len, char end_marker, \
+		char delim, size_t *delims, size_t max_delims, scan_result_t *res) { \
+	(void)end_marker; \
+	(void)delim; \
+	scan_##isa##_body(buf, len, '\0', '\n', delims, max_delims, res); \
+}
+
+/*
+ * scalar scan from offset i, shared by all kernels for their unaligned tail
+ * */
+static inline __attribute__((always_inline)) void
+scan_scalar_from (const char *buf, size_t i, size_t len, char end_marker,
+		char delim, size_t *delims, size_t max_delims, scan_result_t *res) {
+	for (; i<len; i++) {
+		if (buf[i]==end_marker) {
+			res->end_found = true;
+			res->scanned = i;
+			return;
+		}
+		if (max_delims && buf[i]==delim) {
+			delims[res->num_delims++] = i;
+			if (res->num_delims == max_delims) {
+				res->scanned = i+1;
+				return;
+			}
+		}
+	}
+	res->scanned = len;
+}
+
+/*
+ * record the delims set in mask, each byte of the block owns 1<<shift bits.
+ * Returns false once delims[] is full.
+ * */
+static inline bool
+scan_take_delims (uint64_t mask, int shift, size_t base, size_t *delims,
+		size_t max_delims, scan_result_t *res) {
+	size_t off;
+	while (mask) {
+		off = __builtin_ctzll(mask) >> shift;
+		delims[res->num_delims++] = base + off;
+		if (res->num_delims == max_delims) {
+			res->scanned = base + off + 1;
+			return false;
+		}
+		mask &= ~((((uint64_t)1 << (1 << shift)) - 1) << (off << shift));
+	}
+	return true;
+}
+
+static inline __attribute__((always_inline)) void
+scan_scalar_body (const char *buf, size_t len, char end_marker, char delim,
+		size_t *delims, size_t max_delims, scan_result_t *res) {
+	res->num_delims = 0;
+	res->end_found = false;
+	scan_scalar_from(buf, 0, len, end_marker, delim, delims, max_delims, res);
+}
+
+SCAN_INSTANCES(scalar, )
+
+#if defined(__SSE2__)
+static inline __attribute__((always_inline)) void
+scan_sse2_body (const char *buf, size_t len, char end_marker, char delim,
+		size_t *delims, size_t max_delims, scan_result_t *res) {
+	const __m128i ve = _mm_set1_epi8(end_marker);
+	const __m128i vd = _mm_set1_epi8(delim);
+	uint64_t emask, dmask;
+	size_t i = 0;
+	__m128i v;
+
+	res->num_delims = 0;
+	res->end_found = false;
+	for (; i+16<=len; i+=16) {
+		v = _mm_loadu_si128((const __m128i *)(buf+i));
+		emask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ve));
+		dmask = max_delims ?
+				(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vd)) : 0;
+		if (emask) {
+			/* only delims before the end_marker count */
+			dmask &= (emask & -emask) - 1;
+		}
+		if (dmask && !scan_take_delims(dmask, 0, i, delims, max_delims, res)) {
+			return;
+		}
+		if (emask) {
+			res->end_found = true;
+			res->scanned = i + __builtin_ctzll(emask);
+			return;
+		}
+	}
+	scan_scalar_from(buf, i, len, end_marker, delim, delims, max_delims, res);
+}
+
+SCAN_INSTANCES(sse2, )
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void
+scan_avx2_body (const char *buf, size_t len, char end_marker, char delim,
+		size_t *delims, size_t max_delims, scan_result_t *res) {
+	const __m256i ve = _mm256_set1_epi8(end_marker);
+	const __m256i vd = _mm256_set1_epi8(delim);
+	uint64_t emask, dmask;
+	size_t i = 0;
+	__m256i v0, v1;
+
+	res->num_delims = 0;
+	res->end_found = false;
+	for (; i+64<=len; i+=64) {
+		v0 = _mm256_loadu_si256((const __m256i *)(buf+i));
+		v1 = _mm256_loadu_si256((const __m256i *)(buf+i+32));
+		emask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, ve)) |
+				((uint64_t)(uint32_t)_mm256_movemask_epi8(
+						_mm256_cmpeq_epi8(v1, ve)) << 32);
+		dmask = 0;
+		if (max_delims) {
+			dmask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, vd)) |
+					((uint64_t)(uint32_t)_mm256_movemask_epi8(
+							_mm256_cmpeq_epi8(v1, vd)) << 32);
+		}
+		if (emask) {
+			dmask &= (emask & -emask) - 1;
+		}
+		if (dmask && !scan_take_delims(dmask, 0, i, delims, max_delims, res)) {
+			return;
+		}
+		if (emask) {
+			res->end_found = true;
+			res->scanned = i + __builtin_ctzll(emask);
+			return;
+		}
+	}
+	scan_scalar_from(buf, i, len, end_marker, delim, delims, max_delims, res);
+}
+
+SCAN_INSTANCES(avx2, __attribute__((target("avx2"))))
+#endif
+
+#if defined(__aarch64__)
+/*
+ * NEON has no movemask, narrowing the compare result by 4 bits gives a
+ * 64 bit mask with a nibble per byte instead.
+ * */
+static inline uint64_t
+neon_mask (uint8x16_t eq) {
+	return vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static inline __attribute__((always_inline)) void
+scan_neon_body (const char *buf, size_t len, char end_marker, char delim,
+		size_t *delims, size_t max_delims, scan_result_t *res) {
+	const uint8x16_t ve = vdupq_n_u8((uint8_t)end_marker);
+	const uint8x16_t vd = vdupq_n_u8((uint8_t)delim);
+	uint64_t emask, dmask;
+	size_t i = 0;
+	uint8x16_t v;
+
+	res->num_delims = 0;
+	res->end_found = false;
+	for (; i+16<=len; i+=16) {
+		v = vld1q_u8((const uint8_t *)(buf+i));
+		emask = neon_mask(vceqq_u8(v, ve));
+		dmask = max_delims ? neon_mask(vceqq_u8(v, vd)) : 0;
+		if (emask) {
+			dmask &= (emask & -emask) - 1;
+		}
+		if (dmask && !scan_take_delims(dmask, 2, i, delims, max_delims, res)) {
+			return;
+		}
+		if (emask) {
+			res->end_found = true;
+			res->scanned = i + (__builtin_ctzll(emask) >> 2);
+			return;
+		}
+	}
+	scan_scalar_from(buf, i, len, end_marker, delim, delims, max_delims, res);
+}
+
+SCAN_INSTANCES(neon, )
+#endif
+
+typedef struct scan_kernel_ {
+	const char *name;
+	scan_fn_t fn;
+	scan_fn_t fn_nl;   /* the instance for '\0' and '\n' */
+	bool (*supported) (void);
+} scan_kernel_t;
+
+bool
+cpu_always (void) {
+	return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+bool
+cpu_has_avx2 (void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* best kernel first */
+const scan_kernel_t scan_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", scan_region_avx2, scan_region_avx2_nl, cpu_has_avx2 },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", scan_region_sse2, scan_region_sse2_nl, cpu_always },
+#endif
+#if defined(__aarch64__)
+	{ "neon", scan_region_neon, scan_region_neon_nl, cpu_always },
+#endif
+	{ "scalar", scan_region_scalar, scan_region_scalar_nl, cpu_always },
+};
+
+/* kernel used by all engines, picked once by scan_init() */
+scan_fn_t scan_region_any = scan_region_scalar;
+scan_fn_t scan_region_nl = scan_region_scalar_nl;
+
+static inline void
+scan_region (const char *buf, size_t len, char end_marker, char delim,
+		size_t *delims, size_t max_delims, scan_result_t *res) {
+	if (end_marker == '\0' && (delim == '\n' || max_delims == 0)) {
+		scan_region_nl(buf, len, end_marker, delim, delims, max_delims, res);
+	} else {
+		scan_region_any(buf, len, end_marker, delim, delims, max_delims, res);
+	}
+}
+
+/*
+ * runtime cpu dispatch: use the first supported kernel, or the one named
+ * with --scan-kernel
+ * */
+bool
+scan_init (const char *name) {
+	size_t i;
+	for (i=0;i<sizeof(scan_kernels)/sizeof(scan_kernels[0]);i++) {
+		if (name && strcmp(name, scan_kernels[i].name) != 0) {
+			continue;
+		}
+		if (!scan_kernels[i].supported()) {
+			continue;
+		}
+		scan_region_any = scan_kernels[i].fn;
+		scan_region_nl = scan_kernels[i].fn_nl;
+		dbg_printf("scan kernel: %s\n", scan_kernels[i].name);
+		return true;
+	}
+	fprintf(stderr, "scan kernel %s is not available\n", name);
+	return false;
+}
+
+/*
+ * Helper function to determine first index of end_marker in given char *buf
+ * */
+int
+find_end_index (char *buf, char end_marker, int limit) {
+	scan_result_t res;
+	scan_region(buf, limit, end_marker, end_marker, NULL, 0, &res);
+	return res.end_found ? (int)res.scanned : -1;
+}
+
+/*
+ * Pre-zeroed logs are filled as a prefix, so a page is written iff its first
+ * byte is not the end_marker. Gallop over pages until an unwritten one is
+ * found, then binary search the last written page within the last step.
+ * Touches O(log pages) pages instead of everything written so far. Returns
+ * the offset of the last written page, or len if page 0 is unwritten.
+ * */
+size_t
+search_last_written_page (size_t len, bool (*written) (void *ctx, size_t off),
+		void *ctx) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t pages = (len + page - 1) / page;
+	size_t lo = 0; /* last page known to be written */
+	size_t hi;     /* first page known to be unwritten, or pages */
+	size_t step = 1;
+	size_t mid;
+
+	if (pages == 0 || !written(ctx, 0)) {
+		return len;
+	}
+	while (lo + step < pages && written(ctx, (lo + step) * page)) {
+		lo += step;
+		step <<= 1;
+	}
+	hi = lo + step < pages ? lo + step : pages;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (written(ctx, mid * page)) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	dbg_printf("last written page %zu of %zu\n", lo, pages);
+	return lo * page;
+}
+
+/* what the page probes of the engines need to know */
+typedef struct frontier_probe_ {
+	file_data_t *fdata;
+	char end_marker;
+} frontier_probe_t;
+
+/*
+ * --max-lag: file i is lag bytes behind its writer. Past the limit the
+ * follower's batches grow and are no longer flushed for latency, until
+ * the file is back under half the limit; memory stays bounded by the
+ * bigger batch. Returns true if --on-lag=skip wants the caller to jump
+ * to the last lag_lines lines instead, see lag_skipped.
+ * */
+bool
+lag_check (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out, uint64_t lag) {
+	file_data_t *fdata = &f_array[i];
+	if (lag > params->max_lag && params->max_lag) {
+		if (params->lag_skip) {
+			return true;
+		}
+		if (!fdata->catchup) {
+			dbg_printf("%s: %llu bytes behind, catching up\n",
+					params->files[i], (unsigned long long)lag);
+			fdata->catchup = true;
+			out->lagging++;
+			stat_add(&fdata->stats->catchups, 1);
+		}
+	} else if (fdata->catchup && lag <= params->max_lag / 2) {
+		dbg_printf("%s: caught up\n", params->files[i]);
+		fdata->catchup = false;
+		out->lagging--;
+	}
+	return false;
+}
+
+/*
+ * the caller skipped ahead to offset pos of file i, tell the output
+ * */
+void
+lag_skipped (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out, uint64_t pos, uint64_t skipped) {
+	dbg_printf("%s: skipped %llu bytes to %llu\n", params->files[i],
+			(unsigned long long)skipped, (unsigned long long)pos);
+	stat_add(&f_array[i].stats->catchups, 1);
+	stat_add(&f_array[i].stats->skipped, skipped);
+	out_switch_file(out, i);
+	out_add_skip(out, params->files[i], pos, skipped);
+}
+
+/*
+ * Backfill: -n +K through a filter. What was written before we started is
+ * cut into chunks that a pool of threads goes through at once, each
+ * finding the records that start in its chunk and matching them with a
+ * filter of its own (regexec locks a shared pattern). The chunks are
+ * emitted in order, in place out of a mapping or copied from the chunk
+ * buffers, and at most twice as many chunks as threads are in memory.
+ * Returns the end of the last complete record, the engine goes on from
+ * there as usual. A record longer than --max-record ends the backfill
+ * at its start, the filter cuts it as it would otherwise.
+ * */
+typedef struct backfill_chunk_ {
+	size_t off;           /* records starting in [off, end) are this chunk's */
+	size_t end;
+	char *buf;            /* without a mapping: the bytes from buf_off on */
+	size_t buf_off;
+	size_t buf_len;
+	size_t buf_cap;
+	size_t *spans;        /* offset and length of each accepted record */
+	int num_spans;
+	int spans_cap;
+	size_t last;          /* end of its last complete record, 0 if none */
+	bool cut;             /* a record was too long */
+	bool done;
+} backfill_chunk_t;
+
+typedef struct backfill_ {
+	mtail_params_t *params;
+	file_data_t *fdata;
+	const char *base;     /* mapping of the whole region, NULL to pread */
+	char delim;
+	bool join;            /* text: adjacent records are one span */
+	size_t start;
+	size_t end;
+	int num_chunks;
+	backfill_chunk_t *chunks; /* chunk k is in slot k % window */
+	int window;
+	int next;             /* the next chunk a thread takes */
+	int emitted;          /* chunks written to the output */
+	bool stop;
+	unsigned long matched;
+	unsigned long rejected;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} backfill_t;
+
+/*
+ * without a mapping: make the bytes up to off readable in the chunk
+ * buffer, false if the region ends before them
+ * */
+static bool
+backfill_read (backfill_t *b, backfill_chunk_t *c, size_t off) {
+	size_t want;
+	ssize_t n;
+
+	if (off > b->end) {
+		return false;
+	}
+	while (c->buf_off + c->buf_len < off) {
+		want = off - c->buf_off - c->buf_len;
+		if (want < BACKFILL_CHUNK / 4) {
+			want = BACKFILL_CHUNK / 4;
+		}
+		if (c->buf_off + c->buf_len + want > b->end) {
+			want = b->end - c->buf_off - c->buf_len;
+		}
+		if (c->buf_len + want > c->buf_cap) {
+			while (c->buf_len + want > c->buf_cap) {
+				c->buf_cap = c->buf_cap ? c->buf_cap*2 : BACKFILL_CHUNK + 1;
+			}
+			c->buf = realloc(c->buf, c->buf_cap);
+		}
+		n = pread(file_fd(b->fdata), c->buf + c->buf_len, want,
+				c->buf_off + c->buf_len);
+		if (n <= 0) {
+			return false;
+		}
+		c->buf_len += n;
+	}
+	return true;
+}
+
+static inline const char *
+backfill_at (backfill_t *b, backfill_chunk_t *c, size_t off) {
+	return b->base ? b->base + off : c->buf + (off - c->buf_off);
+}
+
+/*
+ * the records that start in chunk c, matched with filter f
+ * */
+void
+backfill_chunk (backfill_t *b, backfill_chunk_t *c, filter_t *f) {
+	size_t p = c->off, avail, n;
+	const char *d, *rec;
+
+	c->num_spans = 0;
+	c->last = 0;
+	c->cut = false;
+	c->buf_off = c->off > b->start ? c->off - 1 : c->off;
+	c->buf_len = 0;
+	if (!b->base && !backfill_read(b, c, c->end)) {
+		/* a read failed, the engine takes it from here */
+		c->cut = true;
+		return;
+	}
+	if (c->off > b->start) {
+		/* the record going on from the chunk before is that one's */
+		d = memchr(backfill_at(b, c, c->off - 1), b->delim, c->end - c->off + 1);
+		if (!d) {
+			return;
+		}
+		p = c->off - 1 + (d - backfill_at(b, c, c->off - 1)) + 1;
+	}
+	avail = b->base ? b->end : c->buf_off + c->buf_len;
+	while (p < c->end) {
+		while ((d = memchr(backfill_at(b, c, p), b->delim, avail - p)) == NULL) {
+			/* the last record goes on past the chunk */
+			if (avail - p >= f->max_record) {
+				c->cut = true;
+				return;
+			}
+			if (b->base || avail == b->end) {
+				/* incomplete, left to the engine */
+				return;
+			}
+			if (!backfill_read(b, c, avail + BACKFILL_CHUNK / 4 < b->end ?
+					avail + BACKFILL_CHUNK / 4 : b->end)) {
+				c->cut = true;
+				return;
+			}
+			avail = c->buf_off + c->buf_len;
+		}
+		rec = backfill_at(b, c, p);
+		n = d + 1 - rec;
+		if (filter_match(f, rec, n, b->delim)) {
+			if (b->join && c->num_spans > 0 && c->spans[2*c->num_spans-2] +
+					c->spans[2*c->num_spans-1] == p) {
+				c->spans[2*c->num_spans-1] += n;
+			} else {
+				if (c->num_spans == c->spans_cap) {
+					c->spans_cap = c->spans_cap ? c->spans_cap*2 : 256;
+					c->spans = realloc(c->spans,
+							2 * sizeof(size_t) * c->spans_cap);
+				}
+				c->spans[2*c->num_spans] = p;
+				c->spans[2*c->num_spans+1] = n;
+				c->num_spans++;
+			}
+			f->matched++;
+		} else {
+			f->rejected++;
+		}
+		p += n;
+		c->last = p;
+	}
+}
+
+void *
+backfill_run (void *arg) {
+	backfill_t *b = arg;
+	backfill_chunk_t *c;
+	filter_t f;
+	int k;
+
+	filter_init(&f, b->params);
+	pthread_mutex_lock(&b->lock);
+	while (true) {
+		while (!b->stop && b->next < b->num_chunks &&
+				b->next >= b->emitted + b->window) {
+			pthread_cond_wait(&b->cond, &b->lock);
+		}
+		if (b->stop || b->next >= b->num_chunks) {
+			break;
+		}
+		k = b->next++;
+		c = &b->chunks[k % b->window];
+		pthread_mutex_unlock(&b->lock);
+		c->off = b->start + (size_t)k * BACKFILL_CHUNK;
+		c->end = c->off + BACKFILL_CHUNK < b->end ?
+				c->off + BACKFILL_CHUNK : b->end;
+		backfill_chunk(b, c, &f);
+		pthread_mutex_lock(&b->lock);
+		c->done = true;
+		pthread_cond_broadcast(&b->cond);
+	}
+	b->matched += f.matched;
+	b->rejected += f.rejected;
+	pthread_mutex_unlock(&b->lock);
+	filter_free(&f);
+	return NULL;
+}
+
+/*
+ * emit [start, end) of file i through the filter of out with the pool,
+ * base is the mapping of the file if it covers the region. Returns how
+ * far it got, start if the region is not worth it.
+ * */
+size_t
+backfill (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out, const char *base, size_t start, size_t end) {
+	pthread_t threads[BACKFILL_MAX_THREADS];
+	backfill_chunk_t *c;
+	backfill_t b;
+	size_t done = start;
+	int num_threads, k, s;
+
+	if (!out->filter || out->filter->multiline || end - start < BACKFILL_MIN ||
+			params->backfill_threads < 2) {
+		return start;
+	}
+	memset(&b, 0, sizeof(b));
+	b.params = params;
+	b.fdata = &f_array[i];
+	b.base = base;
+	b.delim = params->delims[i];
+	b.join = params->format == FORMAT_TEXT;
+	b.start = start;
+	b.end = end;
+	b.num_chunks = (end - start + BACKFILL_CHUNK - 1) / BACKFILL_CHUNK;
+	num_threads = params->backfill_threads < b.num_chunks ?
+			params->backfill_threads : b.num_chunks;
+	b.window = 2 * num_threads;
+	b.chunks = calloc(b.window, sizeof(backfill_chunk_t));
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+	for (k=0;k<num_threads;k++) {
+		pthread_create(&threads[k], NULL, backfill_run, &b);
+	}
+	dbg_printf("%s: backfill of %zu bytes in %d chunks, %d threads\n",
+			params->files[i], end - start, b.num_chunks, num_threads);
+
+	out_switch_file(out, i);
+	for (k=0;k<b.num_chunks && !stop_requested;k++) {
+		c = &b.chunks[k % b.window];
+		pthread_mutex_lock(&b.lock);
+		while (!c->done) {
+			pthread_cond_wait(&b.cond, &b.lock);
+		}
+		pthread_mutex_unlock(&b.lock);
+		if (out->format != FORMAT_TEXT) {
+			out->recv_us = realtime_us();
+		}
+		for (s=0;s<c->num_spans;s++) {
+			if (base) {
+				out_pass_mapped(out, base + c->spans[2*s], c->spans[2*s+1],
+						c->spans[2*s]);
+			} else {
+				out_pass_copy(out, backfill_at(&b, c, c->spans[2*s]),
+						c->spans[2*s+1], c->spans[2*s]);
+			}
+		}
+		if (c->last) {
+			done = c->last;
+		}
+		pthread_mutex_lock(&b.lock);
+		c->done = false;
+		b.emitted++;
+		if (c->cut) {
+			b.stop = true;
+		}
+		pthread_cond_broadcast(&b.cond);
+		pthread_mutex_unlock(&b.lock);
+		if (c->cut) {
+			break;
+		}
+	}
+	pthread_mutex_lock(&b.lock);
+	b.stop = true;
+	pthread_cond_broadcast(&b.cond);
+	pthread_mutex_unlock(&b.lock);
+	for (k=0;k<num_threads;k++) {
+		pthread_join(threads[k], NULL);
+	}
+	out->filter->matched += b.matched;
+	out->filter->rejected += b.rejected;
+	for (k=0;k<b.window;k++) {
+		free(b.chunks[k].buf);
+		free(b.chunks[k].spans);
+	}
+	free(b.chunks);
+	pthread_mutex_destroy(&b.lock);
+	pthread_cond_destroy(&b.cond);
+	dbg_printf("%s: backfill emitted up to %zu\n", params->files[i], done);
+	return done;
+}
+
+/*
+ * stdio engine: read through a FILE* with getdelim and fseek back to the
+ * first end_marker, so that the next pass sees whatever was written there.
+ * */
+bool
+stdio_open_file (file_data_t *fdata, const char *filename) {
+	fdata->fp = fopen(filename, "r");
+	return fdata->fp != NULL;
+}
+
+void
+stdio_close_file (file_data_t *fdata) {
+	if (fdata->fp) {
+		fclose(fdata->fp);
+		fdata->fp = NULL;
+	}
+}
+
+bool
+stdio_page_written (void *ctx, size_t off) {
+	frontier_probe_t *probe = ctx;
+	char c;
+	return pread(file_fd(probe->fdata), &c, 1, off) == 1 &&
+			c != probe->end_marker;
+}
+
+/*
+ * frontier of a seekable file: the first end_marker, or the file size
+ * */
+off_t
+stdio_search_frontier (file_data_t *fdata, char end_marker, off_t size) {
+	frontier_probe_t probe = { fdata, end_marker };
+	char buf[BUF_CHUNK_SIZE];
+	off_t off = search_last_written_page(size, stdio_page_written, &probe);
+	ssize_t n;
+	int end;
+
+	if (off == size) {
+		/* not even the first page has been written */
+		return 0;
+	}
+	while ((n = pread(file_fd(fdata), buf, sizeof(buf), off)) > 0) {
+		if ((end = find_end_index(buf, end_marker, n)) >= 0) {
+			return off + end;
+		}
+		off += n;
+	}
+	return off;
+}
+
+/*
+ * offset where the last num_lines records before frontier start, read
+ * backwards in chunks. A trailing partial record counts as a line. The
+ * delim is passed in, fdata->delim is the end marker once the end was
+ * reached.
+ * */
+off_t
+stdio_tail_start (file_data_t *fdata, off_t frontier, int num_lines,
+		char delim) {
+	char buf[16*BUF_CHUNK_SIZE];
+	off_t end = frontier;
+	off_t begin;
+	const char *p;
+	size_t lim;
+	int count = 0;
+	bool last_chunk = true;
+
+	if (num_lines <= 0) {
+		return frontier;
+	}
+	while (end > 0) {
+		begin = end > (off_t)sizeof(buf) ? end - (off_t)sizeof(buf) : 0;
+		if (pread(file_fd(fdata), buf, end - begin, begin) != end - begin) {
+			return begin;
+		}
+		lim = end - begin;
+		if (last_chunk && buf[lim-1] == delim) {
+			/* the last record is complete, its delim doesn't start a line */
+			lim--;
+		}
+		last_chunk = false;
+		while ((p = memrchr(buf, delim, lim)) != NULL) {
+			if (++count == num_lines) {
+				return begin + (p - buf) + 1;
+			}
+			lim = p - buf;
+		}
+		end = begin;
+	}
+	return 0;
+}
+
+/*
+ * offset of record num_lines (1 based) for "tail -n +N" on a seekable
+ * file, read forward in chunks up to the first end_marker
+ * */
+off_t
+stdio_skip_records (mtail_params_t *params, file_data_t *fdata) {
+	char buf[16*BUF_CHUNK_SIZE];
+	size_t delims[SCAN_BATCH];
+	scan_result_t res;
+	size_t skip = params->num_lines > 0 ? params->num_lines - 1 : 0;
+	size_t count = 0;
+	size_t pos;
+	off_t off = 0;
+	ssize_t n;
+
+	while (count < skip &&
+			(n = pread(file_fd(fdata), buf, sizeof(buf), off)) > 0) {
+		pos = 0;
+		while (count < skip && pos < (size_t)n) {
+			scan_region(buf + pos, n - pos, fdata->end_marker, fdata->delim,
+					delims, skip - count < SCAN_BATCH ?
+							skip - count : SCAN_BATCH, &res);
+			count += res.num_delims;
+			pos += res.scanned;
+			if (res.end_found) {
+				return off + pos;
+			}
+		}
+		off += pos;
+	}
+	return off;
+}
+
+/*
+ * copy [start, end) of the file to stdout, in-kernel where possible
+ * */
+void
+stdio_emit_range (file_data_t *fdata, off_t start, off_t end,
+		out_batch_t *out) {
+	char buf[16*BUF_CHUNK_SIZE];
+	int fd = file_fd(fdata);
+	off_t off = start;
+	ssize_t n;
+	const char *hdr;
+	uint64_t start_ns, records = 0;
+
+	out_seek(out, start);
+	if (out->queue || out->merge || out->filter || out->sink->url ||
+			out->sink->comp) {
+		/*
+		 * -j: only the writer thread may write to the sink,
+		 * --merge: the records have to be held back,
+		 * -e/-f: the records have to be matched,
+		 * --sink: writes are retried after a reconnect,
+		 * --compress: the codec needs the bytes
+		 * */
+		while (off < end && (n = pread(fd, buf, end - off < (off_t)sizeof(buf) ?
+				end - off : (off_t)sizeof(buf), off)) > 0) {
+			out_append_copy(out, buf, n);
+			off += n;
+		}
+		return;
+	}
+	/* keep the order with whatever is pending */
+	out_flush(out);
+	start_ns = monotonic_ns();
+	if (out->sink->headers && out->sink->last_file != out->cur_file) {
+		hdr = out_sink_header(out->sink, out->cur_file);
+		if (write(out->sink->fd, hdr, strlen(hdr)) < 0) {
+			return;
+		}
+		out->sink->last_file = out->cur_file;
+	}
+	while (off < end) {
+		n = sendfile(out->sink->fd, fd, &off, end - off);
+		if (n <= 0) {
+			break;
+		}
+	}
+	while (off < end) {
+		n = pread(fd, buf, end - off < (off_t)sizeof(buf) ?
+				end - off : (off_t)sizeof(buf), off);
+		if (n <= 0 || write(out->sink->fd, buf, n) != n) {
+			break;
+		}
+		records += count_delims(buf, n, out->delims[out->cur_file]);
+		off += n;
+	}
+	/*
+	 * what went out bypassed the batch, count it as out_count would. The
+	 * records sendfile moved never passed through here and aren't counted.
+	 * */
+	if (out->stats && out->cur_file >= 0) {
+		stat_add(&out->stats[out->cur_file].bytes, off - start);
+		stat_add(&out->stats[out->cur_file].records, records);
+	}
+	if (out->sink->stats && off > start) {
+		stat_add(&out->sink->stats->writes, 1);
+		stat_add(&out->sink->stats->write_bytes, off - start);
+		stat_add(&out->sink->stats->write_ns, monotonic_ns() - start_ns);
+	}
+}
+
+/*
+ * tail -n on a seekable file: find the frontier, walk back num_lines
+ * records, or skip to record K for -n +K, and print that range at once,
+ * through the backfill threads if it is big and has to be filtered.
+ * Returns false if the file is not seekable and the ring buffer has to be
+ * used.
+ * */
+bool
+stdio_print_backlog (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	struct stat st;
+	off_t frontier;
+	off_t start;
+
+	if (fstat(file_fd(fdata), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	frontier = stdio_search_frontier(fdata, fdata->end_marker, st.st_size);
+	if (params->lines_from_start) {
+		start = stdio_skip_records(params, fdata);
+		if (start < frontier) {
+			start = backfill(params, f_array, i, out, NULL, start, frontier);
+		}
+	} else {
+		start = stdio_tail_start(fdata, frontier, params->num_lines,
+				fdata->delim);
+	}
+	if (frontier > start) {
+		out_switch_file(out, i);
+		stdio_emit_range(fdata, start, frontier, out);
+	}
+	dbg_printf("%s: printed %s%d lines from %lld, frontier at %lld\n",
+			params->files[i], params->lines_from_start ? "from +" : "last ",
+			params->num_lines, (long long)start, (long long)frontier);
+	if (fdata->fp) {
+		fseek(fdata->fp, frontier, SEEK_SET);
+	}
+	fdata->cursor = frontier;
+	fdata->end_reached = true;
+	fdata->delim = fdata->end_marker;
+	return true;
+}
+
+/*
+ * --max-lag through stdio: a byte written max_lag past the cursor means
+ * the file is behind, only then the frontier is searched for. Writers are
+ * taken to fill the file front to back.
+ * */
+void
+stdio_check_lag (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	int fd = file_fd(fdata);
+	uint64_t lag = params->max_lag;
+	struct stat st;
+	off_t frontier = fdata->cursor, start;
+	char c;
+
+	if (pread(fd, &c, 1, fdata->cursor + params->max_lag) == 1 &&
+			c != fdata->end_marker && fstat(fd, &st) == 0) {
+		frontier = stdio_search_frontier(fdata, fdata->end_marker,
+				st.st_size);
+		lag = (size_t)frontier > fdata->cursor ? frontier - fdata->cursor : 0;
+	} else if (!fdata->catchup || pread(fd, &c, 1,
+			fdata->cursor + params->max_lag/2) != 1 ||
+			c == fdata->end_marker) {
+		lag = 0;
+	}
+	if (!lag_check(params, f_array, i, out, lag)) {
+		return;
+	}
+	start = stdio_tail_start(fdata, frontier, params->lag_lines,
+			params->delims[i]);
+	if ((size_t)start > fdata->cursor) {
+		lag_skipped(params, f_array, i, out, start, start - fdata->cursor);
+		if (fdata->fp) {
+			fseek(fdata->fp, start, SEEK_SET);
+		}
+		fdata->cursor = start;
+	}
+}
+
+/*
+ * Cheap change check before touching stdio: peek the single byte at the
+ * cursor. Returns false only if it is known that nothing was written. If
+ * something was, stdio's buffer is stale and gets dropped.
+ * */
+bool
+stdio_peek_changed (file_data_t *fdata, char end_marker) {
+	char c;
+	ssize_t n = pread(fileno(fdata->fp), &c, 1, fdata->cursor);
+	if (n == 0 || (n == 1 && c == end_marker)) {
+		return false;
+	}
+	if (n == 1) {
+		fflush(fdata->fp);
+		fseek(fdata->fp, fdata->cursor, SEEK_SET);
+	}
+	return true;
+}
+
+bool
+stdio_poll_file (mtail_params_t *param_args, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	static __thread char *buf = NULL;
+	static __thread size_t chunk_size = BUF_CHUNK_SIZE;
+	FILE* fp = f_array[i].fp; /* Get the file pointer */
+	int read_chars = 0;
+	int move_by = 0;
+	int len;
+	bool printed = false;
+	uint64_t pos;
+
+	if (!f_array[i].end_reached && !f_array[i].rb.lines) {
+		if (stdio_print_backlog(param_args, f_array, i, out)) {
+			return true;
+		}
+		/* not seekable, keep the last lines around while reading */
+		ring_buffer_init(&f_array[i].rb, param_args->num_lines,
+				param_args->max_buffer);
+	} else if (f_array[i].end_reached &&
+			!stdio_peek_changed(&f_array[i], f_array[i].end_marker)) {
+		return false;
+	} else if (f_array[i].end_reached && param_args->max_lag) {
+		stdio_check_lag(param_args, f_array, i, out);
+	}
+
+	/* getdelim is problematic with huge files fix this */
+	pos = f_array[i].cursor;
+	while((read_chars =
+			getdelim(&buf, &chunk_size, f_array[i].delim, fp))>0) {
+		/* print, if we read anything other than just end_marker */
+		if (buf[0]!=f_array[i].end_marker) {
+			/* the content, without the unwritten space after it */
+			len = buf[read_chars-1]==f_array[i].end_marker ?
+					find_end_index(buf, f_array[i].end_marker, read_chars) :
+					read_chars;
+			printed = true;
+			out_switch_file(out, i);
+			if (f_array[i].end_reached) {
+				/* print the actual content */
+				out_seek(out, pos);
+				out_append_copy(out, buf, len);
+			} else {
+				/* mtail-f -n specified, enqueue content */
+				enqueue(&f_array[i].rb, buf, len, pos);
+			}
+		}
+		pos += read_chars;
+
+		/* Check if end_marker was found */
+		if (buf[read_chars-1]==f_array[i].end_marker) {
+			if (!f_array[i].end_reached) {
+				print_ring_buffer(&f_array[i].rb, out);
+				f_array[i].end_reached = true;
+				f_array[i].delim = f_array[i].end_marker;
+			}
+			/* move cursor to first occurrence of end_marker */
+			move_by = read_chars-find_end_index(buf,
+									f_array[i].end_marker, read_chars);
+
+
+			fseek(fp,
+					-move_by,
+					SEEK_CUR);
+			dbg_printf("%s: end_marker ASCII:%d found, cursor at %ld\n",
+					param_args->files[i], (int)(f_array[i].end_marker),
+					ftell(fp));
+			break; /* so that we pause before we retry reading */
+		}
+	}
+	dbg_printf("%s: %d chars read, cursor at %ld, errno:%s\n",
+			param_args->files[i], read_chars, ftell(fp),
+			strerror(errno));
+	fseek(fp, 0, SEEK_CUR);
+	f_array[i].cursor = ftell(fp);
+	if (chunk_size > param_args->max_buffer) {
+		/* getdelim grew it for one huge record, don't keep that around */
+		free(buf);
+		buf = NULL;
+		chunk_size = BUF_CHUNK_SIZE;
+	}
+	return printed;
+}
+
+/*
+ * mmap engine: the file is mapped read-only and shared with the writer,
+ * so new data becomes visible in place. A byte cursor per file remembers how
+ * far we have emitted, the first end_marker at or after it is the frontier.
+ * The mapping covers [map_off, map_len) of the file, that is all of it
+ * unless --map-window slides a smaller window along with the cursor.
+ * */
+
+/* byte at file offset off, which has to be mapped */
+static inline const char *
+mmap_at (file_data_t *fdata, size_t off) {
+	return fdata->map + (off - fdata->map_off);
+}
+
+/*
+ * Map the window of the file that starts at the MAP_WINDOW_ALIGN boundary
+ * before off, or the whole file without --map-window. The reader goes
+ * through it front to back, and file systems that can back it with huge
+ * pages (tmpfs with huge=advise) are asked to; hugetlbfs maps huge pages
+ * anyway. Pending output may point into the old mapping, it is synced
+ * before that goes away. out may be NULL when nothing is mapped yet.
+ * */
+bool
+mmap_map_window (file_data_t *fdata, size_t off, size_t size,
+		out_batch_t *out) {
+	size_t start = 0, end = size;
+	void *map;
+
+	if (map_window) {
+		start = off & ~(size_t)(MAP_WINDOW_ALIGN - 1);
+		end = size - start > map_window ? start + map_window : size;
+	}
+	if (fdata->map && start == fdata->map_off && end == fdata->map_len) {
+		return true;
+	}
+	map = mmap(NULL, end - start, PROT_READ, MAP_SHARED, fdata->fd, start);
+	if (map == MAP_FAILED) {
+		dbg_printf("mapping %zu bytes at %zu failed: %s\n", end - start,
+				start, strerror(errno));
+		return false;
+	}
+	madvise(map, end - start, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(map, end - start, MADV_HUGEPAGE);
+#endif
+	if (fdata->map) {
+		/* pending output may point into the old mapping */
+		out_sync(out);
+		munmap((void *)fdata->map, fdata->map_len - fdata->map_off);
+	}
+	fdata->map = map;
+	fdata->map_off = start;
+	fdata->map_len = end;
+	fdata->advised = start;
+	fdata->reclaimed = start;
+	return true;
+}
+
+bool
+mmap_open_file (file_data_t *fdata, const char *filename) {
+	struct stat st;
+	int saved_errno;
+
+	fdata->fd = open(filename, O_RDONLY);
+	if (fdata->fd < 0) {
+		return false;
+	}
+	if (fstat(fdata->fd, &st) != 0) {
+		goto fail;
+	}
+	fdata->map = NULL;
+	fdata->map_off = 0;
+	fdata->map_len = 0;
+	fdata->cursor = 0;
+	if (st.st_size > 0 && !mmap_map_window(fdata, 0, st.st_size, NULL)) {
+		goto fail;
+	}
+	dbg_printf("%s: mapped %zu bytes\n", filename, fdata->map_len);
+	return true;
+fail:
+	saved_errno = errno;
+	close(fdata->fd);
+	fdata->fd = -1;
+	errno = saved_errno;
+	return false;
+}
+
+void
+mmap_close_file (file_data_t *fdata) {
+	if (fdata->map) {
+		munmap((void *)fdata->map, fdata->map_len - fdata->map_off);
+		fdata->map = NULL;
+	}
+	fdata->map_off = 0;
+	fdata->map_len = 0;
+	if (fdata->fd >= 0) {
+		close(fdata->fd);
+		fdata->fd = -1;
+	}
+}
+
+/*
+ * The reader got to the end of the mapping, check if the file was extended
+ * in the meantime and map the new size, or the next window, if so.
+ * */
+void
+mmap_remap_if_grown (file_data_t *fdata, out_batch_t *out) {
+	struct stat st;
+	if (fstat(fdata->fd, &st) != 0 || (size_t)st.st_size <= fdata->map_len) {
+		return;
+	}
+	mmap_map_window(fdata, fdata->cursor, st.st_size, out);
+}
+
+/*
+ * --map-window: the frontier ran into the end of the window, move the
+ * window up to the cursor if the file goes on, so a record across the
+ * window end can be seen in one piece. Returns true if it moved.
+ * */
+static bool
+mmap_slide_window (file_data_t *fdata, out_batch_t *out) {
+	struct stat st;
+	if (!map_window || (fdata->cursor & ~(size_t)(MAP_WINDOW_ALIGN - 1)) ==
+			fdata->map_off || fstat(fdata->fd, &st) != 0 ||
+			(size_t)st.st_size <= fdata->map_len) {
+		return false;
+	}
+	return mmap_map_window(fdata, fdata->cursor, st.st_size, out);
+}
+
+/*
+ * Called as the cursor moves: the page tables just ahead of it are
+ * populated so the hot path takes no minor faults, and the pages emitted
+ * a while ago are dropped from the mapping so the RSS doesn't grow to the
+ * size of the file. They stay in the page cache, deactivated, should any
+ * output still pointing there fault them back in.
+ * */
+static void
+mmap_advise (file_data_t *fdata) {
+	size_t from, to;
+
+	if (fdata->advised < fdata->cursor + MAP_PREFAULT / 2 &&
+			fdata->advised < fdata->map_len) {
+		from = fdata->cursor & ~(size_t)(MAP_PREFAULT - 1);
+		if (from < fdata->advised) {
+			from = fdata->advised;
+		}
+		to = fdata->map_len - from > MAP_PREFAULT ?
+				from + MAP_PREFAULT : fdata->map_len;
+		if (madvise((void *)mmap_at(fdata, from), to - from,
+				MADV_POPULATE_READ) != 0) {
+			/* before linux 5.14, or past the end of a truncated file */
+			madvise((void *)mmap_at(fdata, from), to - from, MADV_WILLNEED);
+		}
+		fdata->advised = to;
+	}
+	if (fdata->cursor - fdata->reclaimed >=
+			MAP_RECLAIM_BEHIND + MAP_RECLAIM_STEP) {
+		to = (fdata->cursor - MAP_RECLAIM_BEHIND) &
+				~(size_t)(MAP_PREFAULT - 1);
+		madvise((void *)mmap_at(fdata, fdata->reclaimed),
+				to - fdata->reclaimed, MADV_COLD);
+		madvise((void *)mmap_at(fdata, fdata->reclaimed),
+				to - fdata->reclaimed, MADV_DONTNEED);
+		fdata->reclaimed = to;
+	}
+}
+
+/*
+ * offset of the first end_marker at or after start, or map_len if the
+ * mapping is written up to its end
+ * */
+size_t
+mmap_find_frontier (file_data_t *fdata, char end_marker, size_t start) {
+	scan_result_t res;
+	scan_region(mmap_at(fdata, start), fdata->map_len - start, end_marker,
+			fdata->delim, NULL, 0, &res);
+	return start + res.scanned;
+}
+
+bool
+mmap_page_written (void *ctx, size_t off) {
+	frontier_probe_t *probe = ctx;
+	return *mmap_at(probe->fdata, off) != probe->end_marker;
+}
+
+/*
+ * frontier on startup, only the last written page is scanned. With
+ * --map-window the pages are probed through the descriptor and the
+ * window is put around the last written one, half of it before for
+ * "tail -n".
+ * */
+size_t
+mmap_search_frontier (file_data_t *fdata, char end_marker, out_batch_t *out) {
+	frontier_probe_t probe = { fdata, end_marker };
+	struct stat st;
+	size_t off;
+
+	if (map_window) {
+		if (fstat(fdata->fd, &st) != 0) {
+			return fdata->map_off;
+		}
+		off = search_last_written_page(st.st_size, stdio_page_written,
+				&probe);
+		if (off == (size_t)st.st_size) {
+			return 0;
+		}
+		if (!mmap_map_window(fdata, off > map_window / 2 ?
+				off - map_window / 2 : 0, st.st_size, out)) {
+			/* still the first window, followed from the start */
+			return fdata->map_off;
+		}
+		return mmap_find_frontier(fdata, end_marker, off);
+	}
+	off = search_last_written_page(fdata->map_len, mmap_page_written,
+			&probe);
+	if (off == fdata->map_len) {
+		/* not even the first page has been written */
+		return 0;
+	}
+	return mmap_find_frontier(fdata, end_marker, off);
+}
+
+/*
+ * offset where the output for "tail -n" starts, found by walking backwards
+ * from the frontier over num_lines delims. A trailing partial record counts
+ * as a line, like it does for tail. With --map-window it goes back to the
+ * first record of the window at most.
+ * */
+size_t
+mmap_tail_start (file_data_t *fdata, size_t frontier, int num_lines) {
+	size_t end = frontier - fdata->map_off;
+	const char *p, *first = NULL;
+	int count = 0;
+
+	if (num_lines <= 0) {
+		return frontier;
+	}
+	if (end > 0 && fdata->map[end-1] == fdata->delim) {
+		/* the last record is complete, its delim doesn't start a line */
+		end--;
+	}
+	while ((p = memrchr(fdata->map, fdata->delim, end)) != NULL) {
+		if (++count == num_lines) {
+			return fdata->map_off + (p - fdata->map) + 1;
+		}
+		end = p - fdata->map;
+		first = p;
+	}
+	if (first && fdata->map_off > 0) {
+		/* the window starts in the middle of a record */
+		return fdata->map_off + (first - fdata->map) + 1;
+	}
+	return fdata->map_off;
+}
+
+/*
+ * offset of record num_lines (1 based) for "tail -n +N", counted from the
+ * record at from. The region before has to be scanned forward, window by
+ * window with --map-window. Scanning stops at end or the end_marker.
+ * */
+size_t
+mmap_skip_records (mtail_params_t *params, file_data_t *fdata, size_t from,
+		size_t end, out_batch_t *out) {
+	size_t delims[SCAN_BATCH];
+	scan_result_t res;
+	size_t skip = params->num_lines > 0 ? params->num_lines - 1 : 0;
+	size_t pos = from;
+	size_t count = 0;
+	size_t limit;
+
+	while (count < skip && pos < (limit = end < fdata->map_len ?
+			end : fdata->map_len)) {
+		scan_region(mmap_at(fdata, pos), limit - pos,
+				fdata->end_marker, fdata->delim, delims,
+				skip - count < SCAN_BATCH ? skip - count : SCAN_BATCH, &res);
+		count += res.num_delims;
+		pos += res.scanned;
+		if (res.end_found) {
+			break;
+		}
+		if (pos == fdata->map_len && map_window) {
+			fdata->cursor = pos;
+			mmap_remap_if_grown(fdata, out);
+		}
+	}
+	return pos;
+}
+
+/*
+ * --commit=record: end of the last complete record in [start, frontier),
+ * start if there is none yet
+ * */
+static inline size_t
+mmap_record_end (file_data_t *fdata, size_t start, size_t frontier) {
+	const char *d;
+	if (frontier == start || *mmap_at(fdata, frontier-1) == fdata->delim) {
+		return frontier;
+	}
+	d = memrchr(mmap_at(fdata, start), fdata->delim, frontier - start);
+	return d ? (size_t)(d - fdata->map) + fdata->map_off + 1 : start;
+}
+
+bool
+mmap_poll_file (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	size_t frontier, start;
+
+	/*
+	 * Nothing new unless the byte at the cursor changed. An idle file costs
+	 * one load from the mapping: no syscall, no scan.
+	 * */
+	if (__builtin_expect(fdata->end_reached && fdata->cursor < fdata->map_len &&
+			*mmap_at(fdata, fdata->cursor) == fdata->end_marker, 1)) {
+		return false;
+	}
+	if (fdata->cursor >= fdata->map_len) {
+		mmap_remap_if_grown(fdata, out);
+		if (fdata->cursor >= fdata->map_len) {
+			if (!params->lines_from_start) {
+				/* empty at the first check, there is no backlog to tail */
+				fdata->end_reached = true;
+			}
+			return false;
+		}
+	}
+	if (!fdata->end_reached) {
+		if (params->lines_from_start) {
+			fdata->cursor = mmap_skip_records(params, fdata,
+					fdata->map_off, SIZE_MAX, out);
+			frontier = mmap_find_frontier(fdata, fdata->end_marker,
+					fdata->cursor);
+			if (frontier > fdata->cursor && !map_window) {
+				fdata->cursor = backfill(params, f_array, i, out,
+						fdata->map, fdata->cursor, frontier);
+			}
+		} else {
+			frontier = mmap_search_frontier(fdata, fdata->end_marker, out);
+			if (params->commit == COMMIT_RECORD) {
+				frontier = mmap_record_end(fdata, fdata->map_off, frontier);
+			}
+			fdata->cursor = mmap_tail_start(fdata, frontier,
+					params->num_lines);
+		}
+		fdata->end_reached = true;
+	} else {
+		frontier = mmap_find_frontier(fdata, fdata->end_marker,
+				fdata->cursor);
+		if (frontier == fdata->map_len && mmap_slide_window(fdata, out)) {
+			frontier = mmap_find_frontier(fdata, fdata->end_marker,
+					fdata->cursor);
+		}
+		if (lag_check(params, f_array, i, out, frontier - fdata->cursor)) {
+			start = mmap_tail_start(fdata, frontier, params->lag_lines);
+			if (start > fdata->cursor) {
+				lag_skipped(params, f_array, i, out, start,
+						start - fdata->cursor);
+				fdata->cursor = start;
+			}
+		}
+	}
+	if (params->commit == COMMIT_RECORD) {
+		frontier = mmap_record_end(fdata, fdata->cursor, frontier);
+	}
+	if (frontier > fdata->cursor) {
+		out_switch_file(out, i);
+		out_seek(out, fdata->cursor);
+		out_append_mapped(out, mmap_at(fdata, fdata->cursor),
+				frontier - fdata->cursor);
+		dbg_printf("%s: emitted %zu bytes, cursor at %zu\n", params->files[i],
+				frontier - fdata->cursor, frontier);
+		fdata->cursor = frontier;
+		mmap_advise(fdata);
+		return true;
+	}
+	return false;
+}
+
+const follow_engine_t stdio_engine = {
+	.name = "stdio", .open = stdio_open_file, .poll = stdio_poll_file, .close = stdio_close_file
+};
+
+const follow_engine_t mmap_engine = {
+	.name = "mmap", .open = mmap_open_file, .poll = mmap_poll_file, .close = mmap_close_file
+};
+
+/*
+ * Ring-log engine. The writer wraps to the start of a fixed size data area
+ * and overwrites the oldest records. With a header the writer position is
+ * loaded with acquire semantics, the records are copied out of the ring in
+ * chunks and a chunk only counts if the writer hadn't lapped its start
+ * when the copy finished; whatever was overwritten is reported as lost and
+ * reading resumes at the next record boundary. Nothing is referenced in
+ * place, so vmsplice never sees ring pages.
+ *
+ * Without a header a writer is assumed to terminate its last record with
+ * the end marker, as snprintf does, and a wrap shows as the first bytes of
+ * the data area changing.
+ * */
+static inline uint64_t
+ring_load (const char *p, int width) {
+	uint32_t v32;
+	uint64_t v64;
+	if (((uintptr_t)p & (width-1)) == 0) {
+		return width == 8 ?
+				__atomic_load_n((const uint64_t *)p, __ATOMIC_ACQUIRE) :
+				__atomic_load_n((const uint32_t *)p, __ATOMIC_ACQUIRE);
+	}
+	if (width == 8) {
+		memcpy(&v64, p, 8);
+	} else {
+		memcpy(&v32, p, 4);
+		v64 = v32;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return v64;
+}
+
+static inline size_t
+ring_size (mtail_params_t *params, file_data_t *fdata) {
+	ring_layout_t *l = &params->ring_layout;
+	return l->size ? l->size : fdata->map_len - l->data_off;
+}
+
+/*
+ * the writer may be copying in up to this much past what it published,
+ * bytes closer than that to a lap behind it can't be trusted
+ * */
+static inline size_t
+ring_guard (size_t size) {
+	return size/4 < RING_CHUNK ? size/4 : RING_CHUNK;
+}
+
+/*
+ * position of the writer in the stream, generation and offset re-read
+ * until they agree
+ * */
+uint64_t
+ring_writer_pos (mtail_params_t *params, file_data_t *fdata) {
+	ring_layout_t *l = &params->ring_layout;
+	uint64_t gen, woff;
+	if (!l->gen_width) {
+		return ring_load(fdata->map + l->woff_off, l->woff_width);
+	}
+	do {
+		gen = ring_load(fdata->map + l->gen_off, l->gen_width);
+		woff = ring_load(fdata->map + l->woff_off, l->woff_width);
+	} while (gen != ring_load(fdata->map + l->gen_off, l->gen_width));
+	return gen * ring_size(params, fdata) + woff;
+}
+
+static inline const char *
+ring_at (mtail_params_t *params, file_data_t *fdata, uint64_t pos) {
+	return fdata->map + params->ring_layout.data_off +
+			pos % ring_size(params, fdata);
+}
+
+/*
+ * stream position just past the first delim in [from, to), to if none
+ * */
+uint64_t
+ring_next_record (mtail_params_t *params, file_data_t *fdata, uint64_t from,
+		uint64_t to) {
+	size_t size = ring_size(params, fdata);
+	const char *p, *d;
+	size_t n;
+	while (from < to) {
+		p = ring_at(params, fdata, from);
+		n = size - from % size;
+		n = n < to - from ? n : to - from;
+		if ((d = memchr(p, fdata->delim, n)) != NULL) {
+			return from + (d - p) + 1;
+		}
+		from += n;
+	}
+	return to;
+}
+
+/*
+ * start of the last num_lines records before the writer position w
+ * */
+uint64_t
+ring_last_lines (mtail_params_t *params, file_data_t *fdata, uint64_t w,
+		int num_lines) {
+	size_t size = ring_size(params, fdata);
+	uint64_t lo = w > size - ring_guard(size) ?
+			w - size + ring_guard(size) : 0;
+	uint64_t end = w;
+	const char *p, *d;
+	size_t n;
+	int count = 0;
+
+	if (num_lines <= 0) {
+		return w;
+	}
+	if (end > lo && *ring_at(params, fdata, end-1) == fdata->delim) {
+		end--;
+	}
+	while (end > lo) {
+		n = end % size ? end % size : size;
+		n = n < end - lo ? n : end - lo;
+		p = ring_at(params, fdata, end - n);
+		if ((d = memrchr(p, fdata->delim, n)) == NULL) {
+			end -= n;
+			continue;
+		}
+		end = end - n + (d - p);
+		if (++count == num_lines) {
+			return end + 1;
+		}
+	}
+	return lo > 0 ? ring_next_record(params, fdata, lo, w) : lo;
+}
+
+/*
+ * where tail -n starts: num_lines records back from the writer, at most
+ * one ring size back
+ * */
+uint64_t
+ring_tail_start (mtail_params_t *params, file_data_t *fdata, uint64_t w) {
+	size_t size = ring_size(params, fdata);
+	uint64_t lo = w > size - ring_guard(size) ?
+			w - size + ring_guard(size) : 0;
+
+	if (params->lines_from_start || params->num_lines <= 0) {
+		/* the oldest complete record, or nothing with -n 0 */
+		if (params->num_lines <= 0 && !params->lines_from_start) {
+			return w;
+		}
+		return lo > 0 ? ring_next_record(params, fdata, lo, w) : lo;
+	}
+	return ring_last_lines(params, fdata, w, params->num_lines);
+}
+
+/*
+ * the writer overwrote what wasn't read yet, a known amount also shows
+ * in the output as skipped before the position reading goes on at
+ * */
+void
+ring_report_lost (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out, uint64_t pos, uint64_t lost) {
+	file_data_t *fdata = &f_array[i];
+	fdata->lost += lost;
+	if (lost) {
+		fprintf(stderr, "%s: lapped by the writer, %llu bytes lost\n",
+				params->files[i], (unsigned long long)lost);
+		stat_add(&fdata->stats->skipped, lost);
+		out_add_skip(out, params->files[i], pos, lost);
+	} else {
+		fprintf(stderr, "%s: lapped by the writer, records lost\n",
+				params->files[i]);
+	}
+}
+
+bool
+ring_poll_header (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	static __thread char *chunk = NULL;
+	file_data_t *fdata = &f_array[i];
+	size_t size = ring_size(params, fdata);
+	uint64_t w = ring_writer_pos(params, fdata);
+	uint64_t from, lost;
+	size_t guard = ring_guard(size);
+	size_t n;
+	bool emitted = false;
+
+	if (__builtin_expect(fdata->end_reached && w == fdata->ring_pos, 1)) {
+		return false;
+	}
+	if (!fdata->end_reached) {
+		fdata->ring_pos = ring_tail_start(params, fdata, w);
+		fdata->end_reached = true;
+	}
+	if (w < fdata->ring_pos) {
+		/* the writer started over */
+		dbg_printf("%s: writer restarted at %llu\n", params->files[i],
+				(unsigned long long)w);
+		fdata->ring_pos = 0;
+	}
+	if (lag_check(params, f_array, i, out, w - fdata->ring_pos)) {
+		from = ring_last_lines(params, fdata, w, params->lag_lines);
+		if (from > fdata->ring_pos) {
+			lag_skipped(params, f_array, i, out, from,
+					from - fdata->ring_pos);
+			fdata->ring_pos = from;
+		}
+	}
+	if (!chunk) {
+		chunk = malloc(RING_CHUNK);
+	}
+	out_switch_file(out, i);
+	while (fdata->ring_pos < w) {
+		if (w - fdata->ring_pos > size - guard) {
+			/* lapped, skip to the oldest complete record */
+			from = fdata->ring_pos;
+			fdata->ring_pos = ring_next_record(params, fdata,
+					w - size + guard, w);
+			lost = fdata->ring_pos - from;
+			ring_report_lost(params, f_array, i, out, fdata->ring_pos, lost);
+			continue;
+		}
+		from = fdata->ring_pos;
+		n = size - from % size;
+		n = n < RING_CHUNK ? n : RING_CHUNK;
+		n = n < w - from ? n : w - from;
+		memcpy(chunk, ring_at(params, fdata, from), n);
+		w = ring_writer_pos(params, fdata);
+		if (w > from + size - guard) {
+			/* maybe overwritten while copying, the loop reports it */
+			continue;
+		}
+		if (from % size + n == size) {
+			fdata->laps++;
+		}
+		out_seek(out, from);
+		out_append_copy(out, chunk, n);
+		fdata->ring_pos += n;
+		emitted = true;
+	}
+	return emitted;
+}
+
+/*
+ * first end marker at or after start, without leaving the data area
+ * */
+static inline size_t
+ring_frontier (file_data_t *fdata, size_t start) {
+	return start < fdata->map_len ?
+			mmap_find_frontier(fdata, fdata->end_marker, start) : start;
+}
+
+bool
+ring_poll_heuristic (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	bool wrapped = fdata->ring_sampled &&
+			memcmp(fdata->map, fdata->ring_sample, RING_SAMPLE) != 0;
+	size_t frontier, start;
+	bool emitted = false;
+
+	if (__builtin_expect(fdata->end_reached && !wrapped &&
+			fdata->cursor < fdata->map_len &&
+			fdata->map[fdata->cursor] == fdata->end_marker, 1)) {
+		return false;
+	}
+	out_switch_file(out, i);
+	if (!fdata->end_reached) {
+		/* a ring that is wrapped already is read from its newest lap */
+		frontier = ring_frontier(fdata, 0);
+		fdata->cursor = params->lines_from_start ? 0 :
+				mmap_tail_start(fdata, frontier, params->num_lines);
+		fdata->end_reached = true;
+	} else if (wrapped) {
+		frontier = ring_frontier(fdata, 0);
+		if (frontier > fdata->cursor) {
+			/* the new lap passed the rest of the old one */
+			ring_report_lost(params, f_array, i, out, 0, 0);
+		} else {
+			/* the rest of the old lap is still intact */
+			frontier = ring_frontier(fdata, fdata->cursor);
+			if (frontier > fdata->cursor) {
+				out_seek(out, fdata->cursor);
+				out_append_copy(out, fdata->map + fdata->cursor,
+						frontier - fdata->cursor);
+				emitted = true;
+			}
+		}
+		fdata->cursor = 0;
+		fdata->ring_sampled = false;
+		fdata->laps++;
+	}
+	frontier = ring_frontier(fdata, fdata->cursor);
+	if (lag_check(params, f_array, i, out, frontier - fdata->cursor)) {
+		start = mmap_tail_start(fdata, frontier, params->lag_lines);
+		if (start > fdata->cursor) {
+			lag_skipped(params, f_array, i, out, start, start - fdata->cursor);
+			fdata->cursor = start;
+		}
+	}
+	if (frontier > fdata->cursor) {
+		/* copied, the writer may overwrite it before the flush */
+		out_seek(out, fdata->cursor);
+		out_append_copy(out, fdata->map + fdata->cursor,
+				frontier - fdata->cursor);
+		fdata->cursor = frontier;
+		emitted = true;
+	}
+	if (!fdata->ring_sampled && fdata->cursor >= RING_SAMPLE) {
+		memcpy(fdata->ring_sample, fdata->map, RING_SAMPLE);
+		fdata->ring_sampled = true;
+	}
+	return emitted;
+}
+
+bool
+ring_open_file (file_data_t *fdata, const char *filename) {
+	if (!mmap_open_file(fdata, filename)) {
+		return false;
+	}
+	fdata->ring_pos = 0;
+	fdata->ring_sampled = false;
+	return true;
+}
+
+/*
+ * without a valid header the file is followed like any mmap file
+ * */
+bool
+ring_poll_file (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	ring_layout_t *l = &params->ring_layout;
+	file_data_t *fdata = &f_array[i];
+	size_t need = l->data_off + (l->size ? l->size : 1);
+	if (l->header) {
+		if (fdata->map_len < need ||
+				fdata->map_len < l->woff_off + l->woff_width ||
+				fdata->map_len < l->gen_off + l->gen_width) {
+			return mmap_poll_file(params, f_array, i, out);
+		}
+		return ring_poll_header(params, f_array, i, out);
+	}
+	if (fdata->map_len < RING_SAMPLE) {
+		return mmap_poll_file(params, f_array, i, out);
+	}
+	return ring_poll_heuristic(params, f_array, i, out);
+}
+
+const follow_engine_t ring_engine = {
+	.name = "ring", .open = ring_open_file, .poll = ring_poll_file, .close = mmap_close_file
+};
+
+/*
+ * Commit engine, for writers that publish records explicitly instead of
+ * relying on the end marker. Nothing is shared with the writer but the
+ * mapping, the reader only does acquire loads.
+ *
+ * lenprefix: every record is a 4 byte length followed by the payload, the
+ * next record starts 4 byte aligned. The writer fills the payload first
+ * and stores the length last with release semantics, so a length other
+ * than 0 means the whole record is there.
+ *
+ * offset: a header word holds the file offset up to which the records are
+ * complete, the writer advances it with release semantics after each
+ * record (or batch of records).
+ *
+ * Committed bytes don't change any more, they are emitted in place.
+ * */
+static inline size_t
+commit_align (size_t off) {
+	return (off + 3) & ~(size_t)3;
+}
+
+/*
+ * committed length of the record at off, 0 if not there yet
+ * */
+static inline uint32_t
+commit_record_len (file_data_t *fdata, size_t off) {
+	if (off + 4 > fdata->map_len) {
+		return 0;
+	}
+	return (uint32_t)ring_load(fdata->map + off, 4);
+}
+
+/*
+ * where tail -n starts in a lenprefix file: walk the records and keep the
+ * offsets of the last num_lines
+ * */
+size_t
+commit_lenprefix_start (mtail_params_t *params, file_data_t *fdata) {
+	size_t off = params->commit_data_off;
+	size_t *last;
+	uint32_t len;
+	int n = 0, skip;
+
+	if (params->lines_from_start) {
+		for (skip = params->num_lines - 1; skip > 0 &&
+				(len = commit_record_len(fdata, off)) != 0 &&
+				off + 4 + len <= fdata->map_len; skip--) {
+			off = commit_align(off + 4 + len);
+		}
+		return off;
+	}
+	if (params->num_lines <= 0) {
+		/* skip everything committed so far */
+		while ((len = commit_record_len(fdata, off)) != 0 &&
+				off + 4 + len <= fdata->map_len) {
+			off = commit_align(off + 4 + len);
+		}
+		return off;
+	}
+	last = malloc(sizeof(size_t) * params->num_lines);
+	while ((len = commit_record_len(fdata, off)) != 0 &&
+			off + 4 + len <= fdata->map_len) {
+		last[n++ % params->num_lines] = off;
+		off = commit_align(off + 4 + len);
+	}
+	if (n >= params->num_lines) {
+		off = last[n % params->num_lines];
+	} else {
+		off = params->commit_data_off;
+	}
+	free(last);
+	return off;
+}
+
+bool
+commit_poll_lenprefix (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	bool emitted = false;
+	uint32_t len;
+
+	if (__builtin_expect(fdata->end_reached &&
+			commit_record_len(fdata, fdata->cursor) == 0, 1)) {
+		if (fdata->cursor + 4 <= fdata->map_len) {
+			return false;
+		}
+		mmap_remap_if_grown(fdata, out);
+	}
+	if (!fdata->end_reached) {
+		fdata->cursor = commit_lenprefix_start(params, fdata);
+		fdata->end_reached = true;
+	}
+	out_switch_file(out, i);
+	while ((len = commit_record_len(fdata, fdata->cursor)) != 0) {
+		if (fdata->cursor + 4 + len > fdata->map_len) {
+			/* the record runs past what is mapped */
+			mmap_remap_if_grown(fdata, out);
+			if (fdata->cursor + 4 + len > fdata->map_len) {
+				break;
+			}
+		}
+		out_seek(out, fdata->cursor + 4);
+		out_append_mapped(out, fdata->map + fdata->cursor + 4, len);
+		if (fdata->map[fdata->cursor + 4 + len - 1] != fdata->delim) {
+			out_append_copy(out, &fdata->delim, 1);
+		}
+		fdata->cursor = commit_align(fdata->cursor + 4 + len);
+		emitted = true;
+	}
+	return emitted;
+}
+
+bool
+commit_poll_offset (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	size_t committed;
+
+	if (fdata->map_len < params->commit_word_off + params->commit_word_width) {
+		mmap_remap_if_grown(fdata, out);
+		if (fdata->map_len <
+				params->commit_word_off + params->commit_word_width) {
+			return false;
+		}
+	}
+	committed = ring_load(fdata->map + params->commit_word_off,
+			params->commit_word_width);
+	if (__builtin_expect(fdata->end_reached && committed == fdata->cursor, 1)) {
+		return false;
+	}
+	if (committed > fdata->map_len) {
+		mmap_remap_if_grown(fdata, out);
+		if (committed > fdata->map_len) {
+			committed = fdata->map_len;
+		}
+	}
+	if (committed < params->commit_data_off) {
+		committed = params->commit_data_off;
+	}
+	if (!fdata->end_reached) {
+		fdata->cursor = params->lines_from_start ?
+				mmap_skip_records(params, fdata, params->commit_data_off,
+				committed, out) :
+				mmap_tail_start(fdata, committed, params->num_lines);
+		if (fdata->cursor < params->commit_data_off) {
+			fdata->cursor = params->commit_data_off;
+		}
+		fdata->end_reached = true;
+	} else if (committed < fdata->cursor) {
+		/* the writer started over */
+		dbg_printf("%s: committed offset went back to %zu\n",
+				params->files[i], committed);
+		fdata->cursor = params->commit_data_off;
+	}
+	if (committed > fdata->cursor) {
+		out_switch_file(out, i);
+		out_seek(out, fdata->cursor);
+		out_append_mapped(out, fdata->map + fdata->cursor,
+				committed - fdata->cursor);
+		fdata->cursor = committed;
+		return true;
+	}
+	return false;
+}
+
+bool
+commit_poll_file (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	if (params->commit == COMMIT_LENPREFIX) {
+		return commit_poll_lenprefix(params, f_array, i, out);
+	}
+	return commit_poll_offset(params, f_array, i, out);
+}
+
+const follow_engine_t commit_engine = {
+	.name = "commit", .open = mmap_open_file, .poll = commit_poll_file, .close = mmap_close_file
+};
+
+/*
+ * io_uring engine, for files where mapping is slow or broken, like on
+ * network file systems and FUSE. Each pass reads at the cursor of every
+ * due file into its own chunk of a registered buffer, all of the reads
+ * submitted and reaped with one io_uring_enter, and the polls that follow
+ * only look at what came back. Pipes and devices can't be read at an
+ * offset, they go through the stdio engine.
+ * */
+typedef struct uring_ {
+	int fd;
+	unsigned entries;     /* reads per pass */
+	_Atomic unsigned *sq_head;
+	_Atomic unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;        /* sq_ring with IORING_FEAT_SINGLE_MMAP */
+	size_t cq_ring_size;
+	size_t sqes_size;
+	char *bufs;           /* entries chunks of URING_CHUNK */
+	bool fixed;           /* bufs are registered, reads use READ_FIXED */
+	bool broken;          /* io_uring_enter failed, reads are done by poll */
+} uring_t;
+
+#ifdef HAVE_IO_URING
+void
+uring_free (void *ctx) {
+	uring_t *u = ctx;
+	if (!u) {
+		return;
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	close(u->fd);
+	free(u->bufs);
+	free(u);
+}
+
+/*
+ * The ring of a follower, NULL where io_uring isn't there: older kernels,
+ * or a seccomp profile that forbids it. The buffers are registered if
+ * RLIMIT_MEMLOCK allows, plain IORING_OP_READ is used otherwise.
+ * */
+void *
+uring_new (mtail_params_t *params) {
+	struct io_uring_params p;
+	struct iovec iov;
+	uring_t *u;
+	void *map;
+	int fd;
+
+	(void)params;
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		dbg_printf("io_uring_setup: %s\n", strerror(errno));
+		return NULL;
+	}
+	u = calloc(1, sizeof(*u));
+	u->fd = fd;
+	u->entries = p.sq_entries < URING_ENTRIES ? p.sq_entries : URING_ENTRIES;
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size) {
+			u->sq_ring_size = u->cq_ring_size;
+		}
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	map = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	u->sq_ring = map;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = map;
+	} else {
+		map = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED) {
+			goto fail;
+		}
+		u->cq_ring = map;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	map = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	u->sqes = map;
+	u->sq_head = (void *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (void *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (void *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (void *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (void *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (void *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	u->bufs = aligned_alloc(BUF_CHUNK_SIZE, (size_t)u->entries * URING_CHUNK);
+	iov.iov_base = u->bufs;
+	iov.iov_len = (size_t)u->entries * URING_CHUNK;
+	u->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+			&iov, 1) == 0;
+	if (!u->fixed) {
+		dbg_printf("io_uring: buffers not registered: %s\n", strerror(errno));
+	}
+	return u;
+fail:
+	dbg_printf("io_uring: mapping the rings failed: %s\n", strerror(errno));
+	uring_free(u);
+	return NULL;
+}
+
+/*
+ * one read at the cursor of each due file, as many as the ring holds, all
+ * submitted and waited for at once. fdata->uring_data is where the bytes
+ * are until the next pass, uring_res what the read returned.
+ * */
+void
+uring_read_due (void *ctx, mtail_params_t *params, file_data_t *f_array,
+		const int *due, int num_due) {
+	uring_t *u = ctx;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	file_data_t *fdata;
+	unsigned tail, head, n = 0, done = 0;
+	int k, ret;
+
+	(void)params;
+	if (!u || u->broken) {
+		return;
+	}
+	tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+	for (k=0; k<num_due && n<u->entries; k++) {
+		fdata = &f_array[due[k]];
+		if (!fdata->end_reached || fdata->fd < 0 || fdata->fp) {
+			/* the start and the stdio files are read by poll */
+			continue;
+		}
+		sqe = &u->sqes[tail & u->sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = fdata->fd;
+		sqe->off = fdata->cursor;
+		sqe->addr = (uintptr_t)(u->bufs + (size_t)n * URING_CHUNK);
+		sqe->len = fdata->uring_len;
+		sqe->user_data = due[k];
+		u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+		fdata->uring_data = u->bufs + (size_t)n * URING_CHUNK;
+		fdata->uring_res = -EINPROGRESS;
+		tail++;
+		n++;
+	}
+	if (n == 0) {
+		return;
+	}
+	atomic_store_explicit(u->sq_tail, tail, memory_order_release);
+	while (true) {
+		head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+		while (head != atomic_load_explicit(u->cq_tail,
+				memory_order_acquire)) {
+			cqe = &u->cqes[head & u->cq_mask];
+			f_array[cqe->user_data].uring_res = cqe->res;
+			head++;
+			done++;
+		}
+		atomic_store_explicit(u->cq_head, head, memory_order_release);
+		if (done == n) {
+			break;
+		}
+		ret = syscall(__NR_io_uring_enter, u->fd, tail -
+				atomic_load_explicit(u->sq_head, memory_order_acquire),
+				n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			/*
+			 * reads may still be in flight into the buffers, they are
+			 * left alone and poll reads with pread from now on
+			 * */
+			dbg_printf("io_uring_enter: %s\n", strerror(errno));
+			u->broken = true;
+			break;
+		}
+	}
+}
+
+bool
+uring_available (void) {
+	void *u = uring_new(NULL);
+	uring_free(u);
+	return u != NULL;
+}
+#else
+void *
+uring_new (mtail_params_t *params) {
+	(void)params;
+	return NULL;
+}
+
+void
+uring_free (void *ctx) {
+	(void)ctx;
+}
+
+void
+uring_read_due (void *ctx, mtail_params_t *params, file_data_t *f_array,
+		const int *due, int num_due) {
+	(void)ctx; (void)params; (void)f_array; (void)due; (void)num_due;
+}
+
+bool
+uring_available (void) {
+	return false;
+}
+#endif
+
+bool
+uring_open_file (file_data_t *fdata, const char *filename) {
+	struct stat st;
+
+	fdata->uring_data = NULL;
+	fdata->uring_len = BUF_CHUNK_SIZE;
+	fdata->fd = open(filename, O_RDONLY);
+	if (fdata->fd < 0) {
+		return false;
+	}
+	if (fstat(fdata->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		fdata->cursor = 0;
+		return true;
+	}
+	close(fdata->fd);
+	fdata->fd = -1;
+	return stdio_open_file(fdata, filename);
+}
+
+void
+uring_close_file (file_data_t *fdata) {
+	stdio_close_file(fdata);
+	if (fdata->fd >= 0) {
+		close(fdata->fd);
+		fdata->fd = -1;
+	}
+	fdata->uring_data = NULL;
+}
+
+/*
+ * emit what this pass read at the cursor, up to the first end_marker. A
+ * file that wasn't part of the batch, because more were due than the ring
+ * has room for, is read right here, and so is the rest of a file that
+ * filled its chunk, up to a batch.
+ * */
+bool
+uring_poll_file (mtail_params_t *params, file_data_t *f_array, int i,
+		out_batch_t *out) {
+	static __thread char *buf = NULL;
+	file_data_t *fdata = &f_array[i];
+	char *data = fdata->uring_data;
+	ssize_t n = fdata->uring_res;
+	size_t len = fdata->uring_len;
+	size_t cursor = fdata->cursor;
+	int end;
+
+	if (fdata->fp) {
+		return stdio_poll_file(params, f_array, i, out);
+	}
+	fdata->uring_data = NULL;
+	if (!fdata->end_reached) {
+		return stdio_print_backlog(params, f_array, i, out);
+	}
+	if (params->max_lag) {
+		stdio_check_lag(params, f_array, i, out);
+		if (fdata->cursor != cursor) {
+			/* skipped ahead, what was read is behind the cursor */
+			return true;
+		}
+	}
+	if (!buf) {
+		buf = malloc(URING_CHUNK);
+	}
+	if (!data || n < 0) {
+		data = buf;
+		len = URING_CHUNK;
+		n = pread(fdata->fd, buf, len, fdata->cursor);
+	}
+	if (n > 0 && (end = find_end_index(data, fdata->end_marker, n)) >= 0) {
+		n = end;
+	}
+	/*
+	 * A pre-allocated file reads as end markers past the frontier, the
+	 * batched reads only ask for about what the writer adds per pass:
+	 * twice as much after a read that came back full, half after one
+	 * that was mostly empty.
+	 * */
+	if ((size_t)n == len && fdata->uring_len < URING_CHUNK) {
+		fdata->uring_len *= 2;
+	} else if ((size_t)n < len / 4 && fdata->uring_len > BUF_CHUNK_SIZE) {
+		fdata->uring_len /= 2;
+	}
+	while (n > 0) {
+		out_switch_file(out, i);
+		out_seek(out, fdata->cursor);
+		out_append_copy(out, data, n);
+		fdata->cursor += n;
+		if ((size_t)n < len || fdata->cursor - cursor >= OUT_MAX_BYTES) {
+			break;
+		}
+		/* the read came back full, the file is catching up: read on */
+		data = buf;
+		len = URING_CHUNK;
+		n = pread(fdata->fd, buf, len, fdata->cursor);
+		if (n > 0 && (end = find_end_index(data, fdata->end_marker,
+				n)) >= 0) {
+			n = end;
+		}
+	}
+	return fdata->cursor > cursor;
+}
+
+const follow_engine_t uring_engine = {
+	.name = "uring", .open = uring_open_file, .poll = uring_poll_file,
+	.close = uring_close_file, .attach = uring_new,
+	.prepare = uring_read_due, .detach = uring_free
+};
+
+/*
+ * Waiting between passes. Writers using write(2) or msync wake us through
+ * inotify right away. Writers that only store into their mapping don't
+ * generate any event, for them the poll interval starts at poll_min_us
+ * after a pass that emitted something and doubles with every idle pass, up
+ * to delay_us. All event sources sit in one epoll set, which is waited on
+ * with ppoll for sub-millisecond timeouts.
+ * */
+typedef struct waiter_ {
+	file_data_t *f_array;
+	int wakeup;      /* WAKEUP_* backends in use */
+	int epfd;        /* epoll set of all event sources, or -1 */
+	int inotify_fd;  /* -1 if inotify is not used */
+	long cur_us;     /* timeout of the next wait */
+	long min_us;
+	long max_us;
+	int *wd_index;   /* inotify watch descriptor -> file index */
+	int wd_cap;
+	int *woken;      /* files with inotify events since the last wait */
+	int num_woken;
+	int woken_cap;
+	bool dir_changed; /* -r: a file was created in a watched directory */
+} waiter_t;
+
+void
+waiter_init (waiter_t *w, mtail_params_t *params, file_data_t *f_array) {
+	struct epoll_event ev;
+
+	memset(w, 0, sizeof(waiter_t));
+	w->f_array = f_array;
+	w->wakeup = params->wakeup;
+	w->min_us = params->poll_min_us;
+	w->max_us = params->delay_us;
+	w->cur_us = (w->wakeup & WAKEUP_POLL) ? w->min_us : w->max_us;
+	w->epfd = -1;
+	w->inotify_fd = -1;
+	if (!(w->wakeup & WAKEUP_INOTIFY) && watch_pidfd < 0) {
+		return;
+	}
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0) {
+		dbg_printf("epoll unavailable: %s\n", strerror(errno));
+		return;
+	}
+	if (watch_pidfd >= 0) {
+		/* -p: the wait returns as soon as the process exits */
+		ev.events = EPOLLIN;
+		ev.data.fd = watch_pidfd;
+		epoll_ctl(w->epfd, EPOLL_CTL_ADD, watch_pidfd, &ev);
+	}
+	if (!(w->wakeup & WAKEUP_INOTIFY)) {
+		return;
+	}
+	w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->inotify_fd < 0) {
+		dbg_printf("inotify unavailable: %s\n", strerror(errno));
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = w->inotify_fd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->inotify_fd, &ev) != 0) {
+		goto fail;
+	}
+	return;
+fail:
+	if (w->inotify_fd >= 0) {
+		close(w->inotify_fd);
+	}
+	w->inotify_fd = -1;
+	if (watch_pidfd < 0) {
+		close(w->epfd);
+		w->epfd = -1;
+	}
+}
+
+void
+waiter_close (waiter_t *w) {
+	if (w->inotify_fd >= 0) {
+		close(w->inotify_fd);
+	}
+	if (w->epfd >= 0) {
+		close(w->epfd);
+	}
+	free(w->wd_index);
+	free(w->woken);
+}
+
+/*
+ * stop watching a file that is about to be reopened
+ * */
+void
+waiter_unwatch (waiter_t *w, file_data_t *fdata) {
+	if (fdata->wd < 0) {
+		return;
+	}
+	inotify_rm_watch(w->inotify_fd, fdata->wd);
+	w->wd_index[fdata->wd] = -1;
+	fdata->wd = -1;
+}
+
+/*
+ * start watching a newly opened file for modifications
+ * */
+void
+waiter_watch (waiter_t *w, file_data_t *fdata, int index,
+		const char *filename) {
+	int cap;
+	if (w->inotify_fd < 0 || fdata->wd >= 0) {
+		return;
+	}
+	/* the *_SELF events and IN_ATTRIB (unlink) trigger an identity check */
+	fdata->wd = inotify_add_watch(w->inotify_fd, filename,
+			IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF |
+			IN_ATTRIB);
+	if (fdata->wd < 0) {
+		dbg_printf("%s: inotify_add_watch: %s\n", filename, strerror(errno));
+		return;
+	}
+	if (fdata->wd >= w->wd_cap) {
+		cap = w->wd_cap ? w->wd_cap : 64;
+		while (cap <= fdata->wd) {
+			cap *= 2;
+		}
+		w->wd_index = realloc(w->wd_index, sizeof(int)*cap);
+		memset(w->wd_index + w->wd_cap, -1, sizeof(int)*(cap - w->wd_cap));
+		w->wd_cap = cap;
+	}
+	w->wd_index[fdata->wd] = index;
+}
+
+/*
+ * consume pending inotify events and remember which files they were for,
+ * true if there were any
+ * */
+bool
+waiter_drain_inotify (waiter_t *w) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool woken = false;
+	ssize_t len;
+	int index;
+	char *p;
+
+	while ((len = read(w->inotify_fd, buf, sizeof(buf))) > 0) {
+		woken = true;
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				/* only the directory watches ask for these */
+				w->dir_changed = true;
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= w->wd_cap ||
+					w->wd_index[ev->wd] < 0) {
+				continue;
+			}
+			index = w->wd_index[ev->wd];
+			if (ev->mask & IN_IGNORED) {
+				/* the watched inode is gone */
+				w->wd_index[ev->wd] = -1;
+				if (w->f_array[index].wd == ev->wd) {
+					w->f_array[index].wd = -1;
+				}
+			}
+			if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB |
+					IN_IGNORED)) {
+				w->f_array[index].check_us = 0;
+			}
+			if (w->num_woken == w->woken_cap) {
+				w->woken_cap = w->woken_cap ? w->woken_cap*2 : 64;
+				w->woken = realloc(w->woken, sizeof(int)*w->woken_cap);
+			}
+			w->woken[w->num_woken++] = index;
+		}
+	}
+	return woken;
+}
+
+/*
+ * wait until the next pass is due, progress tells whether the last pass
+ * emitted anything. limit_us caps the wait, -1 for no cap.
+ * */
+void
+waiter_wait (waiter_t *w, bool progress, long limit_us) {
+	struct epoll_event evs[8];
+	struct pollfd pfd;
+	struct timespec ts;
+	int n, k;
+
+	if (w->wakeup & WAKEUP_POLL) {
+		if (progress) {
+			w->cur_us = w->min_us;
+		} else if (w->cur_us < w->max_us) {
+			w->cur_us = w->cur_us*2 < w->max_us ? w->cur_us*2 : w->max_us;
+			if (w->cur_us == 0) {
+				w->cur_us = 1;
+			}
+		}
+	}
+	if (limit_us < 0 || limit_us > w->cur_us) {
+		limit_us = w->cur_us;
+	}
+	ts.tv_sec = limit_us / 1000000;
+	ts.tv_nsec = (limit_us % 1000000) * 1000;
+	if (w->epfd < 0) {
+		nanosleep(&ts, NULL);
+		return;
+	}
+	pfd.fd = w->epfd;
+	pfd.events = POLLIN;
+	if (ppoll(&pfd, 1, &ts, NULL) <= 0) {
+		return;
+	}
+	n = epoll_wait(w->epfd, evs, sizeof(evs)/sizeof(evs[0]), 0);
+	for (k=0;k<n;k++) {
+		if (evs[k].data.fd == watch_pidfd) {
+			atomic_store(&watch_pid_gone, true);
+		} else if (evs[k].data.fd == w->inotify_fd &&
+				waiter_drain_inotify(w)) {
+			/* a writer is active, poll eagerly again */
+			w->cur_us = w->min_us;
+		}
+	}
+}
+
+/*
+ * Adaptive polling of many files. Files that recently had new data are on
+ * the hot list and polled on every pass. After SCHED_HOT_IDLE_POLLS empty
+ * polls a file moves to a hashed timer wheel, and its interval doubles with
+ * every further empty poll up to delay_us. A pass only visits the hot list
+ * and the wheel slots that came due, so its cost scales with active files.
+ * Lists are intrusive and doubly linked through file_data_t, list
+ * SCHED_SLOTS is the hot list.
+ * */
+typedef struct scheduler_ {
+	int heads[SCHED_SLOTS+1];
+	uint64_t tick;       /* last wheel tick that was processed */
+	uint64_t start_us;   /* monotonic time of tick 0 */
+	uint64_t stats_us;   /* next -v statistics dump */
+	long max_backoff_us;
+	int num_hot;
+	int num_idle;
+	int *due;            /* files to poll in this pass */
+	int num_due;
+} scheduler_t;
+
+#define SCHED_HOT SCHED_SLOTS
+
+void
+sched_link (scheduler_t *s, file_data_t *f_array, int i, int list) {
+	file_data_t *fdata = &f_array[i];
+	fdata->sched_list = list;
+	fdata->sched_prev = -1;
+	fdata->sched_next = s->heads[list];
+	if (s->heads[list] >= 0) {
+		f_array[s->heads[list]].sched_prev = i;
+	}
+	s->heads[list] = i;
+	if (list == SCHED_HOT) {
+		s->num_hot++;
+	} else {
+		s->num_idle++;
+	}
+}
+
+void
+sched_unlink (scheduler_t *s, file_data_t *f_array, int i) {
+	file_data_t *fdata = &f_array[i];
+	if (fdata->sched_list < 0) {
+		return;
+	}
+	if (fdata->sched_prev >= 0) {
+		f_array[fdata->sched_prev].sched_next = fdata->sched_next;
+	} else {
+		s->heads[fdata->sched_list] = fdata->sched_next;
+	}
+	if (fdata->sched_next >= 0) {
+		f_array[fdata->sched_next].sched_prev = fdata->sched_prev;
+	}
+	if (fdata->sched_list == SCHED_HOT) {
+		s->num_hot--;
+	} else {
+		s->num_idle--;
+	}
+	fdata->sched_list = -1;
+}
+
+uint64_t
+sched_now_tick (scheduler_t *s) {
+	return (monotonic_us() - s->start_us) / SCHED_TICK_US;
+}
+
+void
+sched_init (scheduler_t *s, mtail_params_t *params, file_data_t *f_array,
+		int *files, int num_files) {
+	int i;
+	memset(s, 0, sizeof(scheduler_t));
+	for (i=0;i<=SCHED_SLOTS;i++) {
+		s->heads[i] = -1;
+	}
+	s->start_us = monotonic_us();
+	s->stats_us = s->start_us + SCHED_STATS_INTERVAL_US;
+	s->max_backoff_us = params->delay_us;
+	s->due = malloc(sizeof(int)*params->max_files);
+	/* every file starts hot, the first poll prints its backlog */
+	for (i=num_files-1;i>=0;i--) {
+		f_array[files[i]].sched_list = -1;
+		sched_link(s, f_array, files[i], SCHED_HOT);
+	}
+}
+
+void
+sched_free (scheduler_t *s) {
+	free(s->due);
+}
+
+/*
+ * a file got an inotify event, poll it on the next pass
+ * */
+void
+sched_make_hot (scheduler_t *s, file_data_t *f_array, int i) {
+	if (f_array[i].sched_list == SCHED_HOT) {
+		return;
+	}
+	sched_unlink(s, f_array, i);
+	f_array[i].idle_polls = 0;
+	sched_link(s, f_array, i, SCHED_HOT);
+}
+
+/*
+ * collect the files to poll in this pass into s->due: the hot list and
+ * the idle files of every wheel slot passed since the last pass
+ * */
+void
+sched_collect_due (scheduler_t *s, file_data_t *f_array) {
+	uint64_t now = sched_now_tick(s);
+	uint64_t t;
+	int i, next;
+
+	s->num_due = 0;
+	for (i = s->heads[SCHED_HOT]; i >= 0; i = f_array[i].sched_next) {
+		s->due[s->num_due++] = i;
+	}
+	if (now - s->tick > SCHED_SLOTS) {
+		s->tick = now - SCHED_SLOTS;
+	}
+	for (t = s->tick + 1; t <= now && s->num_idle > 0; t++) {
+		for (i = s->heads[t % SCHED_SLOTS]; i >= 0; i = next) {
+			next = f_array[i].sched_next;
+			if (f_array[i].due_tick <= now) {
+				sched_unlink(s, f_array, i);
+				s->due[s->num_due++] = i;
+			}
+		}
+	}
+	s->tick = now;
+}
+
+/*
+ * put a polled file back on the hot list or the wheel
+ * */
+void
+sched_update (scheduler_t *s, file_data_t *f_array, int i, bool progress) {
+	file_data_t *fdata = &f_array[i];
+	uint64_t ticks;
+
+	stat_add(&fdata->stats->polls, 1);
+	if (progress) {
+		fdata->idle_polls = 0;
+		fdata->backoff_us = 0;
+		if (fdata->sched_list != SCHED_HOT) {
+			sched_link(s, f_array, i, SCHED_HOT);
+		}
+		return;
+	}
+	stat_add(&fdata->stats->empty_polls, 1);
+	/* nothing new, whatever lag the last check saw was caught up on */
+	atomic_store_explicit(&fdata->stats->lag, 0, memory_order_relaxed);
+	if (fdata->sched_list == SCHED_HOT &&
+			++fdata->idle_polls < SCHED_HOT_IDLE_POLLS) {
+		return;
+	}
+	sched_unlink(s, f_array, i);
+	fdata->backoff_us = fdata->backoff_us ? fdata->backoff_us*2 : SCHED_TICK_US;
+	if (fdata->backoff_us > s->max_backoff_us) {
+		fdata->backoff_us = s->max_backoff_us;
+	}
+	ticks = fdata->backoff_us / SCHED_TICK_US;
+	fdata->due_tick = s->tick + (ticks ? ticks : 1);
+	sched_link(s, f_array, i, fdata->due_tick % SCHED_SLOTS);
+}
+
+/*
+ * how long the next wait may be at most: on the hot path the waiter's own
+ * adaptive interval, else until the next occupied wheel slot
+ * */
+long
+sched_wait_limit (scheduler_t *s) {
+	uint64_t t;
+	int64_t due;
+	if (s->num_hot > 0) {
+		return -1;
+	}
+	for (t = s->tick + 1; t <= s->tick + SCHED_SLOTS; t++) {
+		if (s->heads[t % SCHED_SLOTS] >= 0) {
+			due = (int64_t)(s->start_us + t * SCHED_TICK_US - monotonic_us());
+			return due > 0 ? (long)due : 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * per file poll statistics, -v only
+ * */
+void
+sched_dump_stats (scheduler_t *s, mtail_params_t *params,
+		file_data_t *f_array, int *files, int num_files) {
+	int i, k;
+	if (!debug) {
+		return;
+	}
+	fprintf(stderr, "scheduler: %d hot, %d idle\n", s->num_hot, s->num_idle);
+	for (k=0;k<num_files;k++) {
+		i = files[k];
+		fprintf(stderr, "%s: polls=%lu empty=%lu %s backoff=%ldus "
+				"reopens=%lu laps=%lu lost=%lu\n",
+				params->files[i],
+				(unsigned long)stat_get(&f_array[i].stats->polls),
+				(unsigned long)stat_get(&f_array[i].stats->empty_polls),
+				f_array[i].sched_list == SCHED_HOT ? "hot" : "idle",
+				f_array[i].backoff_us, f_array[i].reopens, f_array[i].laps,
+				f_array[i].lost);
+	}
+}
+
+/*
+ * All counters: one file_stats_t per slot, one thread_stats_t per reader
+ * and, with -j, one more for the writer thread. The thread that writes to
+ * the sink dumps them, on SIGUSR1 to stderr or the --stats-file, and
+ * every --stats-interval to the --stats-file.
+ * */
+typedef struct stats_ {
+	file_stats_t *files;
+	thread_stats_t *threads;
+	int num_readers;
+	bool writer;        /* threads[num_readers] is the writer thread */
+	uint64_t dump_us;   /* next --stats-file dump */
+} stats_t;
+
+void
+stats_init (stats_t *st, mtail_params_t *params, file_data_t *f_array,
+		int num_readers) {
+	int i;
+	memset(st, 0, sizeof(stats_t));
+	st->num_readers = num_readers;
+	st->writer = num_readers > 1;
+	st->files = aligned_alloc(STATS_ALIGN,
+			sizeof(file_stats_t)*params->max_files);
+	st->threads = aligned_alloc(STATS_ALIGN,
+			sizeof(thread_stats_t)*(num_readers + 1));
+	memset(st->files, 0, sizeof(file_stats_t)*params->max_files);
+	memset(st->threads, 0, sizeof(thread_stats_t)*(num_readers + 1));
+	for (i=0;i<params->max_files;i++) {
+		f_array[i].stats = &st->files[i];
+	}
+	st->dump_us = monotonic_us() + params->stats_interval_us;
+}
+
+void
+stats_free (stats_t *st) {
+	free(st->files);
+	free(st->threads);
+}
+
+void
+stats_print (stats_t *st, mtail_params_t *params, file_data_t *f_array,
+		FILE *fp) {
+	thread_stats_t *t;
+	file_stats_t *fs;
+	int i;
+
+	for (i=0;i<=st->num_readers;i++) {
+		t = &st->threads[i];
+		if (i == st->num_readers && !st->writer) {
+			break;
+		}
+		if (i < st->num_readers) {
+			fprintf(fp, "reader %d: passes=%llu scan_us=%llu ", i,
+					(unsigned long long)stat_get(&t->passes),
+					(unsigned long long)stat_get(&t->scan_ns) / 1000);
+		} else {
+			fprintf(fp, "writer: ");
+		}
+		fprintf(fp, "writes=%llu write_bytes=%llu write_us=%llu\n",
+				(unsigned long long)stat_get(&t->writes),
+				(unsigned long long)stat_get(&t->write_bytes),
+				(unsigned long long)stat_get(&t->write_ns) / 1000);
+	}
+	for (i=0;i<params->max_files;i++) {
+		if (f_array[i].owner < 0 || !params->files[i]) {
+			continue;
+		}
+		fs = &st->files[i];
+		fprintf(fp, "%s: bytes=%llu records=%llu polls=%llu empty=%llu "
+				"lag=%llu scan_us=%llu catchups=%llu skipped=%llu\n",
+				params->files[i],
+				(unsigned long long)stat_get(&fs->bytes),
+				(unsigned long long)stat_get(&fs->records),
+				(unsigned long long)stat_get(&fs->polls),
+				(unsigned long long)stat_get(&fs->empty_polls),
+				(unsigned long long)stat_get(&fs->lag),
+				(unsigned long long)stat_get(&fs->scan_ns) / 1000,
+				(unsigned long long)stat_get(&fs->catchups),
+				(unsigned long long)stat_get(&fs->skipped));
+	}
+}
+
+/*
+ * dump the counters if SIGUSR1 asked for it or the --stats-file is due,
+ * the file is replaced as a whole so a reader never sees half a dump
+ * */
+void
+stats_dump (stats_t *st, mtail_params_t *params, file_data_t *f_array) {
+	char tmp[PATH_MAX];
+	FILE *fp;
+	bool ok;
+
+	if (!stats_requested && (!params->stats_file ||
+			monotonic_us() < st->dump_us)) {
+		return;
+	}
+	stats_requested = 0;
+	st->dump_us = monotonic_us() + params->stats_interval_us;
+	if (!params->stats_file) {
+		stats_print(st, params, f_array, stderr);
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", params->stats_file);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		dbg_printf("%s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	fprintf(fp, "# mtail-f stats 1\n");
+	stats_print(st, params, f_array, fp);
+	ok = fclose(fp) == 0;
+	if (!ok || rename(tmp, params->stats_file) != 0) {
+		dbg_printf("%s: %s\n", params->stats_file, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/*
+ * A follower polls a shard of the files: all of them when running single
+ * threaded, every -j'th file for each reader thread.
+ * */
+typedef struct discovery_ discovery_t;
+
+typedef struct follower_ {
+	pthread_t thread;
+	int index;
+	mtail_params_t *params;
+	const follow_engine_t *engine;
+	void *engine_ctx;   /* the engine's state, see follow_engine_t.attach */
+	file_data_t *f_array;
+	int *files;         /* indices into f_array, max_files of them */
+	int num_files;
+	registry_t *registry;
+	discovery_t *discovery; /* -r, NULL if the files are fixed */
+	/*
+	 * files handed over or taken away by the discovery: i to follow slot
+	 * i, -(i+1) to let it go
+	 * */
+	pthread_mutex_t inbox_lock;
+	_Atomic bool inbox_pending;
+	int *inbox;
+	int inbox_len;
+	int inbox_cap;
+	out_batch_t out;
+	merge_t merge;
+	filter_t filter;
+	waiter_t waiter;
+	scheduler_t sched;
+	bool threaded;
+	uint64_t checkpoint_us; /* next --state-file checkpoint */
+	stats_t *stats;     /* the thread's own counters are threads[index] */
+	_Atomic bool done;  /* the thread pushed its last batch */
+} follower_t;
+
+void
+follower_init (follower_t *f, mtail_params_t *params,
+		const follow_engine_t *engine, file_data_t *f_array,
+		out_sink_t *sink, out_queue_t *queue, registry_t *registry) {
+	int k;
+	f->params = params;
+	f->engine = engine;
+	f->engine_ctx = engine->attach ? engine->attach(params) : NULL;
+	f->f_array = f_array;
+	f->registry = registry;
+	f->threaded = queue != NULL;
+	pthread_mutex_init(&f->inbox_lock, NULL);
+	atomic_store(&f->inbox_pending, false);
+	atomic_store(&f->done, false);
+	out_init(&f->out, sink, queue, params);
+	f->out.stats = f->stats->files;
+	if (params->merge) {
+		merge_init(&f->merge, params);
+		f->out.merge = &f->merge;
+	}
+	if (params->num_patterns > 0 || params->format != FORMAT_TEXT ||
+			params->multiline != MULTILINE_NONE) {
+		filter_init(&f->filter, params);
+		f->out.filter = &f->filter;
+	}
+	waiter_init(&f->waiter, params, f_array);
+	sched_init(&f->sched, params, f_array, f->files, f->num_files);
+	for (k=0;k<f->num_files;k++) {
+		waiter_watch(&f->waiter, &f_array[f->files[k]], f->files[k],
+				params->files[f->files[k]]);
+		f_array[f->files[k]].owner = f->index;
+		registry_put(registry, &f_array[f->files[k]], f->files[k]);
+	}
+}
+
+void
+follower_free (follower_t *f) {
+	if (f->engine->detach) {
+		f->engine->detach(f->engine_ctx);
+	}
+	if (f->out.merge) {
+		dbg_printf("merge: %lu record(s) without a timestamp\n",
+				f->merge.unparsed);
+		merge_free(&f->merge);
+	}
+	if (f->out.filter) {
+		dbg_printf("filter: %lu record(s) matched, %lu rejected\n",
+				f->filter.matched, f->filter.rejected);
+		filter_free(&f->filter);
+	}
+	out_free(&f->out);
+	sched_free(&f->sched);
+	waiter_close(&f->waiter);
+	pthread_mutex_destroy(&f->inbox_lock);
+	free(f->inbox);
+	free(f->files);
+}
+
+/*
+ * bytes written to a file but not emitted yet: up to the end marker in a
+ * mapping, through stdio the frontier is searched once the byte at the
+ * cursor was written. Ring logs and commit protocols have no plain
+ * frontier and report none.
+ * */
+void
+file_update_lag (mtail_params_t *params, file_data_t *fdata,
+		const struct stat *st) {
+	uint64_t lag = 0;
+	off_t frontier;
+	char c;
+	if (params->ring || params->commit >= COMMIT_LENPREFIX ||
+			!fdata->end_reached) {
+		/* nothing */
+	} else if (fdata->map) {
+		if (fdata->cursor < fdata->map_len) {
+			lag = mmap_find_frontier(fdata, fdata->end_marker,
+					fdata->cursor) - fdata->cursor;
+		}
+		if (fdata->cursor + lag == fdata->map_len &&
+				(size_t)st->st_size > fdata->map_len) {
+			/* written past the --map-window */
+			frontier = stdio_search_frontier(fdata, fdata->end_marker,
+					st->st_size);
+			lag = (size_t)frontier > fdata->cursor ?
+					frontier - fdata->cursor : 0;
+		}
+	} else if ((fdata->fp || fdata->fd >= 0) &&
+			(size_t)st->st_size > fdata->cursor &&
+			file_read_at(fdata, fdata->cursor, &c, 1) &&
+			c != fdata->end_marker) {
+		frontier = stdio_search_frontier(fdata, fdata->end_marker,
+				st->st_size);
+		lag = (size_t)frontier > fdata->cursor ? frontier - fdata->cursor : 0;
+	}
+	atomic_store_explicit(&fdata->stats->lag, lag, memory_order_relaxed);
+}
+
+/*
+ * Rate limited identity check of a followed name. A stat of the name tells
+ * if it was rotated (another inode) or truncated (shorter than what was
+ * read). A file that is rewritten in place from the start is noticed by
+ * the byte behind the cursor going back to the end marker, or by the first
+ * bytes changing. Either way the file is reopened and followed from its
+ * start. A rotated file is drained first, a deleted one is followed until
+ * a new file shows up under its name.
+ * */
+void
+file_check (follower_t *f, int i, uint64_t now) {
+	mtail_params_t *params = f->params;
+	file_data_t *fdata = &f->f_array[i];
+	const char *why = NULL;
+	struct stat st;
+	char head[sizeof(fdata->head)], c;
+
+	fdata->check_us = now + params->check_us;
+	if (fstatat(AT_FDCWD, params->files[i], &st, 0) != 0) {
+		return;
+	}
+	file_update_lag(params, fdata, &st);
+	if (st.st_dev != fdata->dev || st.st_ino != fdata->ino) {
+		why = "rotated";
+		/* whatever made it to the old file before the rename */
+		f->engine->poll(params, f->f_array, i, &f->out);
+	} else if ((size_t)st.st_size < fdata->cursor) {
+		why = "truncated";
+	} else if (params->ring || params->commit >= COMMIT_LENPREFIX) {
+		/*
+		 * wraps are what a ring does, the ring engine follows them; with a
+		 * commit protocol the padding and the header word aren't data
+		 * */
+	} else if (fdata->end_reached && fdata->cursor > 0 &&
+			file_read_at(fdata, fdata->cursor-1, &c, 1) &&
+			c == fdata->end_marker) {
+		why = "wrapped";
+	} else if (fdata->cursor >= sizeof(head) &&
+			file_read_at(fdata, 0, head, sizeof(head))) {
+		if (!fdata->head_valid) {
+			memcpy(fdata->head, head, sizeof(head));
+			fdata->head_valid = true;
+		} else if (memcmp(fdata->head, head, sizeof(head)) != 0) {
+			why = "rewritten";
+		}
+	}
+	if (!why) {
+		return;
+	}
+	dbg_printf("%s: %s, reopening\n", params->files[i], why);
+	/* pending output may point into the old mapping */
+	out_sync(&f->out);
+	waiter_unwatch(&f->waiter, fdata);
+	/* a rotated file may be found again under its new name */
+	registry_put(f->registry, fdata, -1);
+	f->engine->close(fdata);
+	if (!f->engine->open(fdata, params->files[i])) {
+		dbg_printf("%s: reopen: %s\n", params->files[i], strerror(errno));
+		return;
+	}
+	file_identify(fdata);
+	fdata->cursor = 0;
+	fdata->ring_pos = 0;
+	fdata->end_reached = true;
+	fdata->reopens++;
+	registry_put(f->registry, fdata, i);
+	waiter_watch(&f->waiter, fdata, i, params->files[i]);
+	sched_make_hot(&f->sched, f->f_array, i);
+}
+
+/*
+ * hand slot i over to follower f, or take it away, see the inbox
+ * */
+void
+follower_post (follower_t *f, int msg) {
+	pthread_mutex_lock(&f->inbox_lock);
+	if (f->inbox_len == f->inbox_cap) {
+		f->inbox_cap = f->inbox_cap ? f->inbox_cap*2 : 64;
+		f->inbox = realloc(f->inbox, sizeof(int)*f->inbox_cap);
+	}
+	f->inbox[f->inbox_len++] = msg;
+	atomic_store_explicit(&f->inbox_pending, true, memory_order_release);
+	pthread_mutex_unlock(&f->inbox_lock);
+}
+
+/*
+ * begin following a slot the discovery opened
+ * */
+void
+follower_adopt (follower_t *f, int i) {
+	file_data_t *fdata = &f->f_array[i];
+	f->files[f->num_files++] = i;
+	fdata->sched_list = -1;
+	waiter_watch(&f->waiter, fdata, i, f->params->files[i]);
+	sched_make_hot(&f->sched, f->f_array, i);
+}
+
+void discovery_release_slot (discovery_t *d, int i);
+
+/*
+ * stop following slot i: print what is left, remember where reading
+ * stopped and give the slot back
+ * */
+void
+follower_retire (follower_t *f, int i) {
+	file_data_t *fdata = &f->f_array[i];
+	int k;
+
+	f->engine->poll(f->params, f->f_array, i, &f->out);
+	if (f->out.filter && f->filter.multiline && filter_held(&f->filter, i)) {
+		/* the slot may be given to another file */
+		filter_release(&f->filter, &f->out, i, filter_held(&f->filter, i));
+	}
+	out_sync(&f->out);
+	for (k=0;k<f->num_files;k++) {
+		if (f->files[k] == i) {
+			f->files[k] = f->files[--f->num_files];
+			break;
+		}
+	}
+	sched_unlink(&f->sched, f->f_array, i);
+	waiter_unwatch(&f->waiter, fdata);
+	registry_put(f->registry, fdata, -1);
+	f->engine->close(fdata);
+	if (fdata->catchup) {
+		fdata->catchup = false;
+		f->out.lagging--;
+	}
+	fdata->owner = -1;
+	discovery_release_slot(f->discovery, i);
+}
+
+/*
+ * process what the discovery posted since the last pass
+ * */
+void
+follower_take_inbox (follower_t *f) {
+	int *msgs;
+	int n, k;
+
+	if (!atomic_load_explicit(&f->inbox_pending, memory_order_acquire)) {
+		return;
+	}
+	pthread_mutex_lock(&f->inbox_lock);
+	msgs = f->inbox;
+	n = f->inbox_len;
+	f->inbox = NULL;
+	f->inbox_len = f->inbox_cap = 0;
+	atomic_store_explicit(&f->inbox_pending, false, memory_order_relaxed);
+	pthread_mutex_unlock(&f->inbox_lock);
+	/* retiring syncs with the writer, which may be posting right now */
+	for (k=0;k<n;k++) {
+		if (msgs[k] >= 0) {
+			follower_adopt(f, msgs[k]);
+		} else {
+			follower_retire(f, -msgs[k] - 1);
+		}
+	}
+	free(msgs);
+}
+
+/*
+ * -r discovery: the glob is evaluated again every rescan_us, and right
+ * away when a file is created in or moved into one of the directories it
+ * names. New names get a free slot and go to the follower with the fewest
+ * files. Names that stopped matching are retired once they stayed away
+ * for a rescan interval, their slot is reused. The names are kept in a
+ * hash set of slots. It runs on the main thread: in the poll loop when
+ * single threaded, in the writer loop with -j.
+ * */
+struct discovery_ {
+	mtail_params_t *params;
+	const follow_engine_t *engine;
+	file_data_t *f_array;
+	out_sink_t *sink;
+	follower_t *followers;
+	int num_followers;
+	registry_t *registry;
+	waiter_t *dir_waiter; /* inotify instance the directory watches go to */
+	uint64_t next_us;     /* next rescan */
+	int *names;           /* slots by name hash, -1 empty, -2 deleted */
+	size_t names_cap;
+	unsigned *seen;       /* per slot, rescan that last matched it */
+	uint64_t *missing_us; /* per slot, when the name went away, 0 if not */
+	unsigned gen;
+	pthread_mutex_t free_lock;
+	int *free_slots;
+	int num_free;
+	unsigned long added;  /* statistics for -v */
+	unsigned long retired;
+};
+
+#define NAME_EMPTY   (-1)
+#define NAME_DELETED (-2)
+
+static inline size_t
+name_hash (const char *name) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+	}
+	return (size_t)h;
+}
+
+/*
+ * position of name in the set, or where it would be inserted
+ * */
+size_t
+discovery_name_find (discovery_t *d, const char *name, bool *found) {
+	size_t k = name_hash(name) & (d->names_cap - 1);
+	size_t insert = (size_t)-1;
+	int slot;
+	while ((slot = d->names[k]) != NAME_EMPTY) {
+		if (slot == NAME_DELETED) {
+			if (insert == (size_t)-1) {
+				insert = k;
+			}
+		} else if (strcmp(d->params->files[slot], name) == 0) {
+			*found = true;
+			return k;
+		}
+		k = (k + 1) & (d->names_cap - 1);
+	}
+	*found = false;
+	return insert != (size_t)-1 ? insert : k;
+}
+
+void
+discovery_name_add (discovery_t *d, int slot) {
+	bool found;
+	size_t k = discovery_name_find(d, d->params->files[slot], &found);
+	d->names[k] = slot;
+}
+
+void
+discovery_name_remove (discovery_t *d, int slot) {
+	bool found;
+	size_t k = discovery_name_find(d, d->params->files[slot], &found);
+	if (found) {
+		d->names[k] = NAME_DELETED;
+	}
+}
+
+void
+discovery_release_slot (discovery_t *d, int i) {
+	pthread_mutex_lock(&d->free_lock);
+	d->free_slots[d->num_free++] = i;
+	pthread_mutex_unlock(&d->free_lock);
+}
+
+/*
+ * watch the directories the pattern names for new files
+ * */
+void
+discovery_watch_dirs (discovery_t *d) {
+	char dir[MAX_ARG_SIZE];
+	char *slash;
+	glob_t dirs;
+	size_t k;
+
+	if (!d->dir_waiter || d->dir_waiter->inotify_fd < 0) {
+		return;
+	}
+	strncpy(dir, d->params->regex, sizeof(dir));
+	dir[sizeof(dir)-1] = '\0';
+	if ((slash = strrchr(dir, '/')) == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	if (glob(dir, GLOB_ONLYDIR | GLOB_NOSORT, NULL, &dirs) != 0) {
+		return;
+	}
+	for (k=0;k<dirs.gl_pathc;k++) {
+		/* watching a directory again returns the same watch */
+		if (inotify_add_watch(d->dir_waiter->inotify_fd, dirs.gl_pathv[k],
+				IN_CREATE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+			dbg_printf("%s: inotify_add_watch: %s\n", dirs.gl_pathv[k],
+					strerror(errno));
+		}
+	}
+	globfree(&dirs);
+}
+
+void
+discovery_init (discovery_t *d, mtail_params_t *params,
+		const follow_engine_t *engine, file_data_t *f_array,
+		out_sink_t *sink, follower_t *followers, int num_followers,
+		registry_t *registry, waiter_t *dir_waiter) {
+	int i;
+	memset(d, 0, sizeof(discovery_t));
+	d->params = params;
+	d->engine = engine;
+	d->f_array = f_array;
+	d->sink = sink;
+	d->followers = followers;
+	d->num_followers = num_followers;
+	d->registry = registry;
+	d->dir_waiter = dir_waiter;
+	d->next_us = monotonic_us() + params->rescan_us;
+	for (d->names_cap = 64; d->names_cap < (size_t)params->max_files * 2;
+			d->names_cap *= 2) {
+	}
+	d->names = malloc(sizeof(int) * d->names_cap);
+	memset(d->names, -1, sizeof(int) * d->names_cap);
+	d->seen = calloc(params->max_files, sizeof(unsigned));
+	d->missing_us = calloc(params->max_files, sizeof(uint64_t));
+	d->free_slots = malloc(sizeof(int) * params->max_files);
+	pthread_mutex_init(&d->free_lock, NULL);
+	for (i=params->max_files-1;i>=params->num_files;i--) {
+		d->free_slots[d->num_free++] = i;
+	}
+	for (i=0;i<params->num_files;i++) {
+		discovery_name_add(d, i);
+	}
+	for (i=0;i<num_followers;i++) {
+		followers[i].discovery = d;
+	}
+	discovery_watch_dirs(d);
+}
+
+void
+discovery_free (discovery_t *d) {
+	dbg_printf("discovery: %lu file(s) added, %lu retired\n", d->added,
+			d->retired);
+	pthread_mutex_destroy(&d->free_lock);
+	free(d->names);
+	free(d->seen);
+	free(d->missing_us);
+	free(d->free_slots);
+}
+
+/*
+ * open a newly matched name in a free slot and hand it to a follower
+ * */
+void
+discovery_add (discovery_t *d, const char *name) {
+	mtail_params_t *params = d->params;
+	registry_entry_t known;
+	file_data_t *fdata;
+	follower_t *f;
+	int i, k;
+
+	pthread_mutex_lock(&d->free_lock);
+	i = d->num_free > 0 ? d->free_slots[--d->num_free] : -1;
+	pthread_mutex_unlock(&d->free_lock);
+	if (i < 0) {
+		dbg_printf("%s: no free slot, see --max-files\n", name);
+		return;
+	}
+	fdata = &d->f_array[i];
+	free(params->files[i]);
+	params->files[i] = strdup(name);
+	file_delims_assign(params, i);
+	fdata->delim = params->delims[i];
+	fdata->end_marker = params->end_markers[i];
+	free(d->sink->header[i]);
+	d->sink->header[i] = NULL;
+	if (!d->engine->open(fdata, name)) {
+		dbg_printf("%s: %s\n", name, strerror(errno));
+		discovery_release_slot(d, i);
+		return;
+	}
+	file_identify(fdata);
+	fdata->cursor = 0;
+	fdata->ring_pos = 0;
+	/* a new file is printed from its start */
+	fdata->end_reached = true;
+	fdata->check_us = 0;
+	fdata->idle_polls = 0;
+	fdata->backoff_us = 0;
+	stats_reset(fdata->stats);
+	if (registry_get(d->registry, fdata->dev, fdata->ino, &known)) {
+		if (known.slot >= 0) {
+			/* followed already, under another name */
+			d->engine->close(fdata);
+			discovery_release_slot(d, i);
+			return;
+		}
+		state_resume(fdata, &known);
+	}
+	for (f = &d->followers[0], k = 1; k < d->num_followers; k++) {
+		if (d->followers[k].num_files < f->num_files) {
+			f = &d->followers[k];
+		}
+	}
+	fdata->owner = f->index;
+	registry_put(d->registry, fdata, i);
+	discovery_name_add(d, i);
+	d->seen[i] = d->gen;
+	d->missing_us[i] = 0;
+	d->added++;
+	dbg_printf("%s: following in slot %d\n", name, i);
+	follower_post(f, i);
+}
+
+/*
+ * evaluate the glob again if it is time to, or a directory changed
+ * */
+void
+discovery_poll (discovery_t *d) {
+	mtail_params_t *params = d->params;
+	uint64_t now = monotonic_us();
+	glob_t pglob;
+	bool found;
+	size_t k;
+	int i;
+
+	if (d->dir_waiter && d->dir_waiter->dir_changed) {
+		d->dir_waiter->dir_changed = false;
+	} else if (now < d->next_us) {
+		return;
+	}
+	d->next_us = now + params->rescan_us;
+	d->gen++;
+	discovery_watch_dirs(d);
+	memset(&pglob, 0, sizeof(pglob));
+	if (glob(params->regex, 0, NULL, &pglob) == 0) {
+		for (k=0;k<pglob.gl_pathc;k++) {
+			i = d->names[discovery_name_find(d, pglob.gl_pathv[k], &found)];
+			if (found) {
+				d->seen[i] = d->gen;
+				d->missing_us[i] = 0;
+			} else {
+				discovery_add(d, pglob.gl_pathv[k]);
+			}
+		}
+	}
+	globfree(&pglob);
+	for (k=0;k<d->names_cap;k++) {
+		i = d->names[k];
+		if (i < 0 || d->seen[i] == d->gen) {
+			continue;
+		}
+		/* the name is gone, give a writer one rescan to finish */
+		if (d->missing_us[i] == 0) {
+			d->missing_us[i] = now;
+		}
+		if (now - d->missing_us[i] < (uint64_t)params->rescan_us) {
+			continue;
+		}
+		d->missing_us[i] = 0;
+		dbg_printf("%s: no longer matches, retiring slot %d\n",
+				params->files[i], i);
+		d->names[k] = NAME_DELETED;
+		d->retired++;
+		follower_post(&d->followers[d->f_array[i].owner], -(i + 1));
+	}
+}
+
+/*
+ * us until the next rescan
+ * */
+long
+discovery_wait_limit (discovery_t *d) {
+	int64_t due = (int64_t)(d->next_us - monotonic_us());
+	return due > 0 ? (long)due : 0;
+}
+
+bool
+follower_should_stop (follower_t *f) {
+	if (f->threaded) {
+		return atomic_load_explicit(&followers_stop, memory_order_relaxed) ||
+				atomic_load_explicit(&watch_pid_gone, memory_order_relaxed);
+	}
+	return stop_conditions_met(f->params);
+}
+
+/*
+ * -p: the process exited, emit what it wrote last on every file, as long
+ * as the passes find more
+ * */
+void
+follower_drain (follower_t *f) {
+	bool progress = true;
+	int pass, k;
+
+	for (pass=0; pass<DRAIN_MAX_PASSES && progress && !stop_requested;
+			pass++) {
+		progress = false;
+		for (k=0; k<f->num_files; k++) {
+			progress |= f->engine->poll(f->params, f->f_array, f->files[k],
+					&f->out);
+		}
+		out_flush(&f->out);
+	}
+	dbg_printf("drained after the watched process exited, %d pass(es)\n",
+			pass);
+}
+
+/*
+ * bytes of file i the engine emitted but the merge or the filter still
+ * holds back. False if they don't map back to bytes of the file: ring
+ * wraps, length prefixes, or records the filter dropped in between.
+ * */
+bool
+follower_held (follower_t *f, int i, size_t *held) {
+	merge_stream_t *st;
+	size_t merged = 0;
+	*held = f->out.filter ? filter_held(&f->filter, i) : 0;
+	if (f->out.merge) {
+		st = &f->merge.streams[i];
+		merged = st->len - (st->rec_head < st->num_recs ?
+				st->recs[st->rec_head].off : st->partial);
+		if (merged > 0 && f->out.filter) {
+			return false;
+		}
+		*held += merged;
+	}
+	return *held == 0 ||
+			(!f->params->ring && f->params->commit < COMMIT_LENPREFIX);
+}
+
+/*
+ * --state-file: wait until everything emitted so far is written out, then
+ * record the cursors in the registry, so a saved cursor never covers bytes
+ * that didn't reach the output. A file whose held back bytes can't be
+ * accounted for keeps its previous checkpoint.
+ * */
+void
+follower_checkpoint (follower_t *f) {
+	file_data_t *fdata;
+	size_t held;
+	int i, k;
+
+	out_sync(&f->out);
+	for (k=0;k<f->num_files;k++) {
+		i = f->files[k];
+		fdata = &f->f_array[i];
+		if (!fdata->head_valid && fdata->cursor >= sizeof(fdata->head) &&
+				file_read_at(fdata, 0, fdata->head, sizeof(fdata->head))) {
+			/* lets the next run tell the file was replaced in place */
+			fdata->head_valid = true;
+		}
+		if (fdata->end_reached && follower_held(f, i, &held)) {
+			registry_checkpoint(f->registry, fdata, i, held);
+		}
+	}
+	f->checkpoint_us = monotonic_us() + f->params->state_interval_us;
+}
+
+/*
+ * the poll loop: poll what the scheduler says is due, emit it all at once,
+ * wait for the next pass
+ * */
+void *
+follower_run (void *arg) {
+	follower_t *f = arg;
+	file_data_t *f_array = f->f_array;
+	thread_stats_t *ts = &f->stats->threads[f->index];
+	bool progress, polled;
+	long limit, merge_limit;
+	unsigned long faults = 0;
+	uint64_t now, t0, t1, t2;
+	int i, k;
+
+	while (true) {
+		progress = false;
+		if (f->discovery) {
+			if (!f->threaded) {
+				discovery_poll(f->discovery);
+			}
+			follower_take_inbox(f);
+		}
+		sched_collect_due(&f->sched, f_array);
+		now = f->params->check_us > 0 ? monotonic_us() : 0;
+		if (__builtin_expect(atomic_load_explicit(&mapping_faults,
+				memory_order_relaxed) != faults, 0)) {
+			/* some mapping lost its pages, check everything now */
+			faults = atomic_load(&mapping_faults);
+			for (k=0; k<f->num_files; k++) {
+				f_array[f->files[k]].check_us = 0;
+			}
+			now = monotonic_us();
+		}
+		/* one clock read per poll, each one closes the previous poll */
+		t0 = t1 = monotonic_ns();
+		if (f->engine->prepare) {
+			f->engine->prepare(f->engine_ctx, f->params, f_array,
+					f->sched.due, f->sched.num_due);
+			t1 = monotonic_ns();
+		}
+		for (k=0; k<f->sched.num_due; k++) { /* for each file due */
+			i = f->sched.due[k];
+			if (now >= f_array[i].check_us && now > 0) {
+				file_check(f, i, now);
+			}
+			polled = f->engine->poll(f->params, f_array, i, &f->out);
+			sched_update(&f->sched, f_array, i, polled);
+			if (!polled && f_array[i].catchup) {
+				/* nothing new, the file caught up */
+				lag_check(f->params, f_array, i, &f->out, 0);
+			}
+			progress |= polled;
+			t2 = monotonic_ns();
+			stat_add(&f_array[i].stats->scan_ns, t2 - t1);
+			t1 = t2;
+		}
+		stat_add(&ts->passes, 1);
+		stat_add(&ts->scan_ns, t1 - t0);
+		limit = sched_wait_limit(&f->sched);
+		if (f->out.filter && f->filter.multiline && f->filter.timeout_us > 0) {
+			merge_limit = filter_expire(&f->filter, &f->out, false);
+			if (merge_limit >= 0 && (limit < 0 || merge_limit < limit)) {
+				limit = merge_limit;
+			}
+		}
+		if (f->out.merge) {
+			merge_release(f->out.merge, &f->out, false);
+			merge_limit = merge_wait_limit(f->out.merge);
+			if (merge_limit >= 0 && (limit < 0 || merge_limit < limit)) {
+				limit = merge_limit;
+			}
+		}
+		if (f->discovery && !f->threaded) {
+			merge_limit = discovery_wait_limit(f->discovery);
+			if (limit < 0 || merge_limit < limit) {
+				limit = merge_limit;
+			}
+		}
+		/* one write for everything this pass emitted */
+		out_flush(&f->out);
+		if (f->params->state_file && monotonic_us() >= f->checkpoint_us) {
+			follower_checkpoint(f);
+			if (!f->threaded && f->registry->dirty) {
+				registry_save(f->registry, f->params->state_file);
+			}
+		}
+		/* wait before retrying */
+		waiter_wait(&f->waiter, progress, limit);
+		for (k=0; k<f->waiter.num_woken; k++) {
+			sched_make_hot(&f->sched, f_array, f->waiter.woken[k]);
+		}
+		f->waiter.num_woken = 0;
+		if (debug && monotonic_us() >= f->sched.stats_us) {
+			sched_dump_stats(&f->sched, f->params, f_array, f->files,
+					f->num_files);
+			f->sched.stats_us += SCHED_STATS_INTERVAL_US;
+		}
+		if (!f->threaded) {
+			stats_dump(f->stats, f->params, f_array);
+		}
+		if (follower_should_stop(f)) {
+			break;
+		}
+	}
+	if (atomic_load(&watch_pid_gone)) {
+		follower_drain(f);
+	}
+	sched_dump_stats(&f->sched, f->params, f_array, f->files, f->num_files);
+	if (f->out.filter) {
+		filter_flush(f->out.filter, &f->out);
+	}
+	if (f->out.merge) {
+		merge_release(f->out.merge, &f->out, true);
+	}
+	out_sync(&f->out);
+	if (f->params->state_file) {
+		follower_checkpoint(f);
+	}
+	atomic_store_explicit(&f->done, true, memory_order_release);
+	return NULL;
+}
+
+/*
+ * -j writer: drain the queue into the sink until every reader is done
+ */
+void
+writer_run (out_queue_t *queue, out_sink_t *sink, follower_t *followers,
+		int num_followers, mtail_params_t *params, registry_t *registry,
+		stats_t *stats, file_data_t *f_array, discovery_t *d,
+		waiter_t *dir_waiter) {
+	struct pollfd pfd[3] = { { queue->efd, POLLIN, 0 },
+			{ dir_waiter ? dir_waiter->epfd : -1, POLLIN, 0 },
+			{ watch_pidfd, POLLIN, 0 } };
+	struct timespec ts;
+	out_node_t *node;
+	uint64_t count;
+	long limit;
+	bool all_done;
+	int k;
+
+	while (true) {
+		if (d && !atomic_load(&followers_stop)) {
+			discovery_poll(d);
+		}
+		limit = params->delay_us;
+		if (d && discovery_wait_limit(d) < limit) {
+			limit = discovery_wait_limit(d);
+		}
+		ts.tv_sec = limit / 1000000;
+		ts.tv_nsec = (limit % 1000000) * 1000;
+		/* a reader marks itself done only after its last push */
+		all_done = true;
+		for (k=0;k<num_followers;k++) {
+			all_done &= atomic_load_explicit(&followers[k].done,
+					memory_order_acquire);
+		}
+		while ((node = out_queue_pop(queue)) != NULL) {
+			out_sink_write(sink, node->segs, node->num_segs, node->arena);
+			atomic_fetch_add_explicit(&node->owner->written, 1,
+					memory_order_release);
+			free(node->segs);
+			free(node->arena);
+			free(node);
+		}
+		if (all_done) {
+			break;
+		}
+		if (ppoll(pfd, 3, &ts, NULL) > 0) {
+			if ((pfd[0].revents & POLLIN) &&
+					read(queue->efd, &count, sizeof(count)) < 0) {
+				/* spurious wakeup */
+			}
+			if (pfd[1].revents & POLLIN) {
+				waiter_drain_inotify(dir_waiter);
+			}
+			if (pfd[2].revents & POLLIN) {
+				/* the readers see it too, they drain and finish */
+				atomic_store(&watch_pid_gone, true);
+				pfd[2].fd = -1;
+			}
+		}
+		if (!atomic_load(&followers_stop) && stop_conditions_met(params)) {
+			atomic_store(&followers_stop, true);
+		}
+		/* the readers checkpoint, the writer saves */
+		if (params->state_file && monotonic_us() >= registry->save_us) {
+			if (registry->dirty) {
+				registry_save(registry, params->state_file);
+			}
+			registry->save_us = monotonic_us() + params->state_interval_us;
+		}
+		stats_dump(stats, params, f_array);
+	}
+}
+
+bool
+print_file_content (mtail_params_t *param_args) {
+	int i = 0;
+	int k;
+	int num_followers = param_args->threads > 1 ? param_args->threads : 1;
+	bool discover = param_args->rescan_us > 0 && param_args->regex[0];
+	out_sink_t sink;
+	out_queue_t queue;
+	registry_t registry;
+	registry_entry_t known;
+	discovery_t discovery;
+	waiter_t dir_waiter;
+	stats_t stats;
+	follower_t *followers;
+	const follow_engine_t *engine = param_args->ring ? &ring_engine :
+			param_args->commit >= COMMIT_LENPREFIX ? &commit_engine :
+			param_args->use_mmap ? &mmap_engine :
+			param_args->use_uring ? &uring_engine : &stdio_engine;
+	int out_fd = STDOUT_FILENO;
+	compressor_t *comp = NULL;
+	file_data_t *f_array;
+	serve_t serve;
+
+	if (engine == &uring_engine && !uring_available()) {
+		engine = &stdio_engine;
+		dbg_printf("io_uring not available, using the %s engine\n",
+				engine->name);
+	}
+	if (param_args->compress && (comp = comp_new(param_args->compress,
+			param_args->compress_level)) == NULL) {
+		return false;
+	}
+	if (param_args->sink_url &&
+			(out_fd = sink_connect(param_args->sink_url)) < 0) {
+		fprintf(stderr, "%s: %s\n", param_args->sink_url, strerror(errno));
+		if (comp) {
+			comp_finish(comp);
+		}
+		return false;
+	}
+	f_array = malloc(sizeof(file_data_t)*param_args->max_files);
+	/* Initialize data structures */
+	for (i=0;i<param_args->max_files;i++) {
+		memset(&f_array[i], 0, sizeof(file_data_t));
+		/* end is reached if we are not looking for last n lines */
+		f_array[i].end_reached = (param_args->num_lines == 0);
+		f_array[i].fp = NULL;
+		f_array[i].fd = -1;
+		f_array[i].wd = -1;
+		f_array[i].owner = -1;
+		f_array[i].sched_list = -1;
+		f_array[i].delim = param_args->delims[i];
+		f_array[i].end_marker = param_args->end_markers[i];
+	}
+	if (param_args->serve && !serve_init(&serve, param_args, f_array)) {
+		free(f_array);
+		if (comp) {
+			comp_finish(comp);
+		}
+		if (param_args->sink_url) {
+			close(out_fd);
+		}
+		return false;
+	}
+	if (param_args->watch_pid) {
+		watch_pid_open(param_args->watch_pid);
+	}
+	if (engine != &stdio_engine) {
+		/* the mmap and uring engines compute the tail -n start themselves */
+		for (i=0;i<param_args->num_files;i++) {
+			f_array[i].end_reached = false;
+		}
+	}
+	if (param_args->merge && num_followers > 1) {
+		/* the merge needs all files in one place */
+		dbg_printf("--merge: ignoring -j %d\n", num_followers);
+		num_followers = 1;
+	}
+	if (num_followers > param_args->num_files && !discover) {
+		num_followers = param_args->num_files > 0 ? param_args->num_files : 1;
+	}
+	dbg_printf("following %d file(s) with the %s engine, %d reader(s)\n",
+			param_args->num_files, engine->name, num_followers);
+
+	if (!open_files(engine, param_args->files, param_args->num_files,
+			f_array)) {
+		/* Could not open the given files */
+		if (param_args->serve) {
+			serve_free(&serve);
+		}
+		free(f_array);
+		if (comp) {
+			comp_finish(comp);
+		}
+		if (param_args->sink_url) {
+			close(out_fd);
+		}
+		return false;
+	}
+	registry_init(&registry);
+	if (param_args->state_file) {
+		if (!registry_load(&registry, param_args->state_file)) {
+			fprintf(stderr, "%s: %s\n", param_args->state_file,
+					strerror(errno));
+			close_files(engine, f_array, param_args->num_files);
+			registry_free(&registry);
+			if (param_args->serve) {
+				serve_free(&serve);
+			}
+			free(f_array);
+			if (comp) {
+				comp_finish(comp);
+			}
+			if (param_args->sink_url) {
+				close(out_fd);
+			}
+			return false;
+		}
+		for (i=0;i<param_args->num_files;i++) {
+			if (registry_get(&registry, f_array[i].dev, f_array[i].ino,
+					&known) && state_resume(&f_array[i], &known)) {
+				dbg_printf("%s: resuming at %zu\n", param_args->files[i],
+						f_array[i].cursor);
+			}
+		}
+	}
+	out_sink_init(&sink, out_fd, param_args);
+	if (comp) {
+		comp_attach(comp, &sink);
+	}
+	if (param_args->serve) {
+		sink.serve = &serve;
+	}
+	stats_init(&stats, param_args, f_array, num_followers);
+	/* the single reader writes itself, else the writer thread does */
+	sink.stats = &stats.threads[num_followers > 1 ? num_followers : 0];
+	followers = calloc(num_followers, sizeof(follower_t));
+	/* shard the files round robin */
+	for (k=0;k<num_followers;k++) {
+		followers[k].index = k;
+		followers[k].stats = &stats;
+		followers[k].files = malloc(sizeof(int)*param_args->max_files);
+	}
+	for (i=0;i<param_args->num_files;i++) {
+		k = i % num_followers;
+		followers[k].files[followers[k].num_files++] = i;
+	}
+	if (num_followers == 1) {
+		follower_init(&followers[0], param_args, engine, f_array, &sink,
+				NULL, &registry);
+		if (discover) {
+			discovery_init(&discovery, param_args, engine, f_array, &sink,
+					followers, num_followers, &registry, &followers[0].waiter);
+		}
+		follower_run(&followers[0]);
+	} else {
+		out_queue_init(&queue);
+		if (discover) {
+			waiter_init(&dir_waiter, param_args, f_array);
+			discovery_init(&discovery, param_args, engine, f_array, &sink,
+					followers, num_followers, &registry, &dir_waiter);
+		}
+		for (k=0;k<num_followers;k++) {
+			follower_init(&followers[k], param_args, engine, f_array, &sink,
+					&queue, &registry);
+			if (pthread_create(&followers[k].thread, NULL, follower_run,
+					&followers[k]) != 0) {
+				fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+				atomic_store(&followers[k].done, true);
+				atomic_store(&followers_stop, true);
+				followers[k].threaded = false;
+			}
+		}
+		writer_run(&queue, &sink, followers, num_followers, param_args,
+				&registry, &stats, f_array, discover ? &discovery : NULL,
+				discover ? &dir_waiter : NULL);
+		for (k=0;k<num_followers;k++) {
+			if (followers[k].threaded) {
+				pthread_join(followers[k].thread, NULL);
+			}
+		}
+		close(queue.efd);
+		if (discover) {
+			waiter_close(&dir_waiter);
+		}
+	}
+	if (param_args->state_file) {
+		/* the readers took their last checkpoint before they stopped */
+		registry_save(&registry, param_args->state_file);
+	}
+	if (param_args->stats_file) {
+		/* the final counters */
+		stats_requested = 1;
+		stats_dump(&stats, param_args, f_array);
+	}
+	close_files(engine, f_array, param_args->max_files);
+	if (discover) {
+		discovery_free(&discovery);
+	}
+	for (k=0;k<num_followers;k++) {
+		follower_free(&followers[k]);
+	}
+	free(followers);
+	if (comp) {
+		/* the end of the frame still goes to the sink */
+		comp_finish(comp);
+	}
+	out_sink_free(&sink);
+	if (param_args->serve) {
+		serve_free(&serve);
+	}
+	registry_free(&registry);
+	stats_free(&stats);
+	free(f_array);
+	if (watch_pidfd >= 0) {
+		close(watch_pidfd);
+		watch_pidfd = -1;
+	}
+	return true;
+}
+
+/*
+ * --attach: the name of table slot file as of gen, false if it was
+ * renamed since
+ * */
+static bool
+attach_slot_name (serve_file_t *file, uint32_t gen, char *name) {
+	if (atomic_load_explicit(&file->gen, memory_order_acquire) != gen) {
+		return false;
+	}
+	memcpy(name, file->name, MAX_ARG_SIZE);
+	name[MAX_ARG_SIZE-1] = '\0';
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&file->gen, memory_order_relaxed) == gen;
+}
+
+/*
+ * emit the run of an entry from the mapping of its file, opening the file
+ * the slot names first if the entry is of a new one
+ * */
+static void
+attach_emit (mtail_params_t *params, file_data_t *f_array,
+		serve_file_t *files, uint32_t i, uint32_t gen, uint64_t pos,
+		uint64_t len, out_batch_t *out) {
+	file_data_t *fdata = &f_array[i];
+	char name[MAX_ARG_SIZE];
+	uint64_t end = pos + len;
+	uint32_t j;
+
+	if (fdata->attach_gen != gen) {
+		if (!attach_slot_name(&files[i], gen, name)) {
+			/* the slot went to another file, this one is gone */
+			return;
+		}
+		if (fdata->fd >= 0) {
+			/* pending output may point into the old mapping */
+			out_sync(out);
+			mmap_close_file(fdata);
+			free(out->sink->header[i]);
+			out->sink->header[i] = NULL;
+			out->sink->last_file = -1;
+		}
+		free(params->files[i]);
+		params->files[i] = strdup(name);
+		file_delims_assign(params, i);
+		fdata->delim = params->delims[i];
+		fdata->end_marker = params->end_markers[i];
+		fdata->attach_gen = gen;
+		if (!out->sink->headers && !params->quiet &&
+				params->format == FORMAT_TEXT) {
+			/* headers once a second slot is named, like -r finding a file */
+			for (j=0;j<(uint32_t)params->max_files;j++) {
+				if (j != i && f_array[j].attach_gen) {
+					out_sync(out);
+					out->sink->headers = true;
+					break;
+				}
+			}
+		}
+		if (!mmap_open_file(fdata, name)) {
+			fprintf(stderr, "%s: %s\n", name, strerror(errno));
+			return;
+		}
+		dbg_printf("attach: slot %u is %s\n", i, name);
+		fdata->cursor = pos;
+	}
+	if (fdata->fd < 0) {
+		return;
+	}
+	if (end > fdata->map_len) {
+		mmap_remap_if_grown(fdata, out);
+		if (end > fdata->map_len) {
+			/* truncated since, the server names the slot again */
+			return;
+		}
+	}
+	if (end <= fdata->cursor) {
+		return;
+	}
+	out_switch_file(out, i);
+	if (pos > fdata->cursor) {
+		out_add_skip(out, params->files[i], pos, pos - fdata->cursor);
+	} else {
+		pos = fdata->cursor;
+	}
+	out_seek(out, pos);
+	out_append_mapped(out, mmap_at(fdata, pos), end - pos);
+	fdata->cursor = end;
+	mmap_advise(fdata);
+}
+
+/*
+ * --attach: follow the index a --serve instance publishes. The runs the
+ * entries point at are emitted from read-only mappings of the files, with
+ * the -e/-f, --format and headers of this instance. The client sleeps on
+ * a futex the server wakes after publishing, and stops once the server
+ * exited and everything it published was emitted. A gap between the runs
+ * of a file, from the server skipping or from the client being lapped, is
+ * noted like an --on-lag skip.
+ * */
+bool
+attach_run (mtail_params_t *params) {
+	char path[MAX_ARG_SIZE + 16];
+	char *map = MAP_FAILED;
+	struct stat st;
+	struct timespec ts;
+	serve_hdr_t *hdr;
+	serve_file_t *files;
+	serve_entry_t *entries, *e;
+	file_data_t *f_array;
+	out_sink_t sink;
+	out_batch_t out;
+	filter_t filter;
+	uint64_t r, h, seq, pos, len, lost = 0;
+	uint32_t mask, wake, file, gen;
+	long wait_us;
+	bool stop;
+	int fd, i;
+
+	serve_path(params->attach, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	if ((size_t)st.st_size >= sizeof(serve_hdr_t)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	hdr = (serve_hdr_t *)map;
+	if (map == MAP_FAILED || hdr->magic != SERVE_MAGIC ||
+			hdr->version != SERVE_VERSION || hdr->num_entries == 0 ||
+			(hdr->num_entries & (hdr->num_entries - 1)) != 0 ||
+			(size_t)st.st_size < serve_size(hdr->max_files,
+			hdr->num_entries)) {
+		fprintf(stderr, "%s: not a --serve index\n", path);
+		if (map != MAP_FAILED) {
+			munmap(map, st.st_size);
+		}
+		return false;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	files = (serve_file_t *)(map + sizeof(serve_hdr_t));
+	entries = (serve_entry_t *)(map + serve_entries_off(hdr->max_files));
+	mask = hdr->num_entries - 1;
+
+	/* the slots are named as the entries come in */
+	params->max_files = hdr->max_files;
+	params->files = calloc(params->max_files, sizeof(char *));
+	params->delims = realloc(params->delims, params->max_files);
+	params->end_markers = realloc(params->end_markers, params->max_files);
+	f_array = calloc(params->max_files, sizeof(file_data_t));
+	for (i=0;i<params->max_files;i++) {
+		params->delims[i] = params->delim;
+		params->end_markers[i] = params->end_marker;
+		f_array[i].fd = -1;
+		f_array[i].wd = -1;
+		f_array[i].owner = -1;
+		f_array[i].sched_list = -1;
+	}
+	params->watch_pid = hdr->pid;
+	params->use_mmap = true;
+	/* a run is emitted in one piece */
+	map_window = 0;
+	out_sink_init(&sink, STDOUT_FILENO, params);
+	/* turned on by attach_emit once the server follows more than one */
+	sink.headers = false;
+	out_init(&out, &sink, NULL, params);
+	if (params->num_patterns > 0 || params->format != FORMAT_TEXT ||
+			params->multiline != MULTILINE_NONE) {
+		filter_init(&filter, params);
+		out.filter = &filter;
+	}
+
+	r = atomic_load_explicit(&hdr->head, memory_order_acquire);
+	if (params->lines_from_start) {
+		/* whatever the ring still holds */
+		r = r > hdr->num_entries ? r - hdr->num_entries : 0;
+	}
+	dbg_printf("attach: %s, server pid %d, starting at entry %llu\n", path,
+			(int)hdr->pid, (unsigned long long)r);
+	for (;;) {
+		/* a server that exited published everything it is going to */
+		stop = stop_conditions_met(params);
+		h = atomic_load_explicit(&hdr->head, memory_order_acquire);
+		while (r < h) {
+			if (h - r > hdr->num_entries) {
+				lost += h - r - hdr->num_entries;
+				r = h - hdr->num_entries;
+			}
+			e = &entries[r & mask];
+			seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+			file = e->file;
+			gen = e->gen;
+			pos = e->pos;
+			len = e->len;
+			atomic_thread_fence(memory_order_acquire);
+			if (seq != r + 1 ||
+					atomic_load_explicit(&e->seq, memory_order_relaxed) != seq) {
+				/* lapped while reading it, go on with what is left */
+				h = atomic_load_explicit(&hdr->head, memory_order_acquire);
+				continue;
+			}
+			if (file < hdr->max_files) {
+				attach_emit(params, f_array, files, file, gen, pos, len,
+						&out);
+			}
+			r++;
+		}
+		if (stop) {
+			break;
+		}
+		wait_us = params->delay_us;
+		if (out.filter && filter.multiline && filter.timeout_us > 0) {
+			long limit = filter_expire(&filter, &out, false);
+			if (limit >= 0 && limit < wait_us) {
+				wait_us = limit;
+			}
+		}
+		out_flush(&out);
+		wake = atomic_load_explicit(&hdr->wake, memory_order_acquire);
+		if (atomic_load_explicit(&hdr->head, memory_order_acquire) == r) {
+			ts.tv_sec = wait_us / 1000000;
+			ts.tv_nsec = (wait_us % 1000000) * 1000;
+			syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+		}
+	}
+	dbg_printf("attach: %llu entries lost to the server lapping us\n",
+			(unsigned long long)lost);
+	if (out.filter) {
+		filter_flush(&filter, &out);
+	}
+	out_sync(&out);
+	if (out.filter) {
+		filter_free(&filter);
+	}
+	out_free(&out);
+	out_sink_free(&sink);
+	for (i=0;i<params->max_files;i++) {
+		mmap_close_file(&f_array[i]);
+		free(params->files[i]);
+	}
+	free(f_array);
+	free(params->files);
+	munmap(map, st.st_size);
+	return true;
+}
+
+void
+handle_stop_signal (int sig) {
+	(void)sig;
+	stop_requested = 1;
+}
+
+void
+handle_stats_signal (int sig) {
+	(void)sig;
+	stats_requested = 1;
+}
+
+/*
+ * A mapped file was truncated under us. Back the page with the -x end
+ * marker so the read stops there, the identity check on the next pass
+ * then reopens the file. A file whose --file-delims end marker differs
+ * reads the page as data until then.
+ * */
+void
+handle_bus_error (int sig, siginfo_t *info, void *ctx) {
+	long page = sysconf(_SC_PAGESIZE);
+	void *addr = (void *)((uintptr_t)info->si_addr & ~(uintptr_t)(page-1));
+	(void)ctx;
+	if (info->si_code != BUS_ADRERR ||
+			mmap(addr, page, mapping_fill ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+	if (mapping_fill) {
+		/* anonymous pages come zeroed */
+		memset(addr, mapping_fill, page);
+		mprotect(addr, page, PROT_READ);
+	}
+	atomic_fetch_add(&mapping_faults, 1);
+}
+
+int main (int argc, char *argv[]) {
+	mtail_params_t param_args;
+	struct sigaction sa;
+	setvbuf(stderr,NULL,_IONBF,0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = handle_stats_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_sigaction = handle_bus_error;
+	sa.sa_flags = SA_SIGINFO;
+	sigaction(SIGBUS, &sa, NULL);
 
-	return EXIT_SUCCESS;
+	if (!parse_opts(argc, argv, &param_args)) {
+		return EXIT_FAILURE;
+	}
+	mapping_fill = param_args.end_marker;
+	if (param_args.sink_url) {
+		/* a lost peer is an EPIPE, see sink_reconnect */
+		signal(SIGPIPE, SIG_IGN);
+	}
+	if (!scan_init(param_args.scan_kernel)) {
+		return EXIT_FAILURE;
+	}
+	if (param_args.attach) {
+		return attach_run(&param_args) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	return print_file_content(&param_args) ? EXIT_SUCCESS : EXIT_FAILURE;
 }